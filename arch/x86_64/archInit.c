@@ -85,6 +85,9 @@ archInit(start_info_t *si)
     // Grab the shared_info pointer and put it in a safe place.
     HYPERVISOR_shared_info = _mapSharedInfo(start_info.shared_info);
 
+    // per CPU data, smp_processor_id() and event masking need it
+    archSmpInit();
+
     // Set up event and failsafe callback addresses. 
 #ifdef __x86_32__
     HYPERVISOR_set_callbacks(
@@ -11,6 +11,8 @@
 #include <nano/xenSchedule.h>
 #include <nano/archPageTable.h>
 #include <nano/time.h>
+#include <nano/interruptDeferred.h>
+#include <nano/xenEventPoll.h>
 
 //______________________________________________________________________________
 /// Blocks the kernel until events arrive and get served.
@@ -18,13 +20,38 @@
 void
 archKernelBlock(void)
 {
+    // the caller may be waiting on a reply to a notification still held
+    xenEventNotifyFlush();
+
+    // work left by event handlers may be what the caller is waiting for
+    if (interruptDeferredRun())
+	{
+	    return;
+	}
 
     timeOneShotSet(1000000);
 
-    //ulong flags;
-    //__save_flags(flags);
+    // latency critical ports are spun on and polled before blocking
+    if (xenEventPollWait())
+	{
+	    return;
+	}
+
+    // idle: get page table pages ready while there is nothing else to do
+    archPageTablePtpPoolRefill();
+
+    // an event handled since the check above may have queued work; mask
+    // events and look again, SCHEDOP_block unmasks them as it blocks so
+    // nothing arriving after the test is slept through
+    __cli();
+    if (interruptDeferredPending())
+	{
+	    __sti();
+	    interruptDeferredRun();
+	    return;
+	}
 
     BUG_ON(xenScheduleBlock() < 0);
 
-    //__restore_flags(flags);
+    interruptDeferredRun();
 }
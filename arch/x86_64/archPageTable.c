@@ -16,6 +16,7 @@
 #include <nano/memory.h>
 #include <nano/physicalInfo.h>
 #include <nano/fmt.h>
+#include <nano/pageTableSnapshot.h>
 
 extern char stack[];
 mfn_t *pfnToMfnArray;
@@ -34,6 +35,7 @@ ptentry_t*          pageTablePtpAlloc(void);
 
 static ptentry_t   *_offlinePtpAlloc();
 static ptentry_t   *_insertInternal(pt_t pt, vaddr_t vaddr, maddr_t maddr, pteflags_t pteflags);
+static ptentry_t   *_pteWalk(pt_t pt, vaddr_t vaddr);
 static void         _offlineFree(pt_t pt, vaddr_t fromAddr, vaddr_t toAddr);
 static long         ptNoWriteCount; // number of pts created, waiting to remove write access
 static vaddr_t      ptNoWrite[MAX_PTS];
@@ -43,35 +45,342 @@ static void         _cloneUser(ptentry_t *ptePtr, ptentry_t pte);
 static void         _offlineDuplicateL4(pt_t pt, uint offset);
 #endif
 
-typedef enum {
-    I7_NONE,
-    I7_INVLPG,
-} I7handle;
+// Pages whose translation is changed by the pending batch, kept as
+// runs of contiguous pages.  Beyond pageTableFlushThreshold pages, one
+// full flush is cheaper than invalidating page by page.
+#define INVLPG_MAX   64
+typedef struct {
+    vaddr_t start;
+    ulong   pages;
+} InvalidateRange;
+static InvalidateRange  invlpgRanges[INVLPG_MAX];
+static int              invlpgRangeCount = 0;
+static ulong            invlpgPages = 0;
+static bool             invlpgAll   = false;
+static ulong            pageTableFlushThreshold = 16;
+static struct mmuext_op invlpgOps[INVLPG_MAX];
+
+// Page table pins, committed after the pte updates of the batch.
+#define PIN_MAX      4
+static struct mmuext_op pinOps[PIN_MAX];
+static pt_t             pinPts[PIN_MAX];
+static int              pinCount = 0;
+
+// A batch is at most: pte updates, pins, TLB invalidation.
+static multicall_entry_t multicalls[3];
+static int               multicallCount;
+
+static PageTableFlushStatistics flushStatistics;
+static PageTableCowStatistics   cowStatistics;
+
+// Page table pages kept zeroed and read only, so that adding a level to a
+// live page table needs no remap of the new page.  Freed page table pages
+// are kept to be zeroed, and the pool is refilled in one batch when the
+// kernel is idle (see archKernelBlock).
+#define PTP_POOL_MAX   64
+#define PTP_POOL_LOW   16
+static vaddr_t          ptpPool[PTP_POOL_MAX];
+static int              ptpPoolCount  = 0;
+static vaddr_t          ptpReleased[PTP_POOL_MAX];  // freed in the pending batch
+static int              ptpReleasedCount = 0;
+static vaddr_t          ptpFreed[PTP_POOL_MAX];     // writable, to be recycled
+static int              ptpFreedCount = 0;
+static PtpPoolStatistics ptpPoolStatistics;
+
+// Per address space state, found by hashing the root page.  The slot is
+// taken when the page table is created; a table that does not fit then is
+// neither counted nor cached for its whole life.
+//  - counters of the user part of the page table, kept up to date as
+//    entries change.
+//  - a direct mapped cache of the L1 tables of recently translated 2MB
+//    regions.  An L1 table stays put while its entries change, so only
+//    freeing page table pages (_ptpFree) or the root (archPageTableFree)
+//    invalidates the cache.
+// Slots are linearly probed; deleting one shifts the rest of its run back,
+// so lookups stop at the first empty slot.
+#define PT_SLOTS_MAX      256
+#define PT_CACHE_ENTRIES  8
+typedef struct {
+    vaddr_t    tag;  // (vaddr >> L2_PAGETABLE_SHIFT) + 1, 0 if empty
+    ptentry_t *l1;   // the L1 table mapping the region
+} PageTableCacheEntry;
+typedef struct {
+    pt_t                pt;
+    PageTableCounters   counters;
+    PageTableCacheEntry cache[PT_CACHE_ENTRIES];
+} PageTableSlot;
+static PageTableSlot ptSlots[PT_SLOTS_MAX];
+static PageTableSlot *lastSlot = ptSlots;  // most recently used
+static PageTableCacheStatistics cacheStatistics;
+
+//______________________________________________________________________________
+/// the translations of pages [start, start+pages*PAGE_SIZE) are stale
+/// once the pending batch is done
+//______________________________________________________________________________
+static inline
+void
+_invalidateRange(vaddr_t start, ulong pages)
+{
+    if (invlpgAll)
+	{
+	    return;
+	}
 
-static I7handle i7=I7_INVLPG;
+    invlpgPages += pages;
+    if (invlpgPages > pageTableFlushThreshold)
+	{
+	    invlpgAll = true;
+	    return;
+	}
+
+    start &= PAGE_MASK;
+    InvalidateRange *last = invlpgRanges + invlpgRangeCount - 1;
+    if (invlpgRangeCount && last->start + last->pages * PAGE_SIZE == start)
+	{   // extends the previous run
+	    last->pages += pages;
+	    return;
+	}
+
+    ASSERT(invlpgRangeCount < INVLPG_MAX);
+    invlpgRanges[invlpgRangeCount].start = start;
+    invlpgRanges[invlpgRangeCount].pages = pages;
+    invlpgRangeCount++;
+}
 
 //______________________________________________________________________________
-///  do the deferred changes
+/// the translation of vaddr is stale once the pending batch is done
 //______________________________________________________________________________
 static inline
 void
-_doUpdate(void)
+_invalidate(vaddr_t vaddr)
 {
-    if (!mmu_update_count)  // nothing to do
+    _invalidateRange(vaddr, 1);
+}
+
+//______________________________________________________________________________
+/// the pending batch changes translations which cannot be invalidated
+/// page by page (e.g., interior page table entries)
+//______________________________________________________________________________
+static inline
+void
+_invalidateAll(void)
+{
+    invlpgAll = true;
+}
+
+//______________________________________________________________________________
+/// pin pt once the pending batch has made its pages read only
+//______________________________________________________________________________
+static inline
+void
+_deferredPin(pt_t pt)
+{
+    ASSERT(pinCount < PIN_MAX);
+    xenPageTablePinOp(pt, pinOps + pinCount);
+    pinPts[pinCount] = pt;
+    pinCount++;
+}
+
+//______________________________________________________________________________
+/// queue a hypercall in the multicall for the pending batch
+//______________________________________________________________________________
+static inline
+void
+_multicallAdd(ulong op, void *list, int count)
+{
+    multicall_entry_t *call = multicalls + multicallCount++;
+    call->op      = op;
+    call->args[0] = (ulong) list;
+    call->args[1] = count;
+    call->args[2] = (ulong) NULL;
+    call->args[3] = DOMID_SELF;
+}
+
+//______________________________________________________________________________
+/// expand the pending invalidation runs into INVLPG operations
+//______________________________________________________________________________
+static
+int
+_invalidateOps(void)
+{
+    int count = 0;
+    int i;
+    for (i=0; i<invlpgRangeCount; i++)
 	{
-	    return;
+	    vaddr_t vaddr = invlpgRanges[i].start;
+	    ulong   page;
+	    for (page=0; page<invlpgRanges[i].pages; page++, vaddr += PAGE_SIZE)
+		{
+		    invlpgOps[count].cmd              = MMUEXT_INVLPG_LOCAL;
+		    invlpgOps[count].arg1.linear_addr = vaddr;
+		    count++;
+		}
 	}
+    ASSERT(count <= INVLPG_MAX);
+    return count;
+}
+
+//______________________________________________________________________________
+/// the page table pages freed by the batch just done are unlinked and
+/// writable: keep them for the pool, or give them back
+//______________________________________________________________________________
+static
+void
+_ptpRelease(void)
+{
+    while (ptpReleasedCount)
+	{
+	    vaddr_t ptp = ptpReleased[--ptpReleasedCount];
+	    if (ptpFreedCount < PTP_POOL_MAX)
+		{
+		    ptpFreed[ptpFreedCount++] = ptp;
+		}
+	    else
+		{
+		    pageTablePtpFree((void *) ptp);
+		}
+	}
+}
+
+//______________________________________________________________________________
+///  do the deferred changes: pte updates, then pins, then TLB invalidation,
+///  all in a single multicall.  If !invalidate, the invalidation is left
+///  pending for the next commit (used when the update buffer fills up
+///  in the middle of a batch).
+//______________________________________________________________________________
+static
+void
+_commit(bool invalidate)
+{
+    static struct mmuext_op flushOp = { .cmd = MMUEXT_TLB_FLUSH_LOCAL };
+
+    multicallCount = 0;
+    int invlpgCount = 0;
 
     // no need to pin here, only need to pin the top directories.
-    int err = HYPERVISOR_mmu_update(mmu_updates, mmu_update_count, NULL, DOMID_SELF);
-    if (err < 0) 
+    if (mmu_update_count)
+	{
+	    _multicallAdd(__HYPERVISOR_mmu_update, mmu_updates, mmu_update_count);
+	}
+    if (pinCount)
+	{
+	    _multicallAdd(__HYPERVISOR_mmuext_op, pinOps, pinCount);
+	}
+    if (invalidate && invlpgAll)
+	{
+	    _multicallAdd(__HYPERVISOR_mmuext_op, &flushOp, 1);
+	    flushStatistics.flushes++;
+	}
+    else if (invalidate && (invlpgCount = _invalidateOps()))
+	{
+	    _multicallAdd(__HYPERVISOR_mmuext_op, invlpgOps, invlpgCount);
+	    flushStatistics.invlpgs += invlpgCount;
+	}
+
+    if (!multicallCount)  // nothing to do
+	{
+	    return;
+	}
+
+    int err = HYPERVISOR_multicall(multicalls, multicallCount);
+    if (err < 0)
 	{
-	    xprintLog("ERROR: mmu_update failed with err = $[int]\n", err);
+	    xprintLog("ERROR: multicall failed with err = $[int]\n", err);
 	    BUG();
 	}
+    int i;
+    for (i=0; i<multicallCount; i++)
+	{
+	    if ((long) multicalls[i].result < 0)
+		{
+		    xprintLog("ERROR: page table hypercall $[int] failed with err = $[long]\n",
+			      multicalls[i].op, (long) multicalls[i].result);
+		    BUG();
+		}
+	}
+
+    for (i=0; i<pinCount; i++)
+	{
+	    xenPageTablePinned(pinPts[i]);
+	}
+
+    flushStatistics.batches++;
+    flushStatistics.updates += mmu_update_count;
+    flushStatistics.pins    += pinCount;
+
     mmu_update_count = 0;
+    pinCount         = 0;
+    if (invalidate)
+	{
+	    invlpgRangeCount = 0;
+	    invlpgPages      = 0;
+	    invlpgAll        = false;
+	    _ptpRelease();
+	}
+}
 
-    archPageTableLoad();
+//______________________________________________________________________________
+///  do the deferred changes and invalidate the TLB entries they made stale
+//______________________________________________________________________________
+static inline
+void
+_doUpdate(void)
+{
+    _commit(true);
+}
+
+//______________________________________________________________________________
+/// set the number of pages above which a batch does a full TLB flush
+//______________________________________________________________________________
+void
+archPageTableFlushThresholdSet(ulong pages)
+{
+    pageTableFlushThreshold = MIN(pages, INVLPG_MAX);
+}
+
+//______________________________________________________________________________
+/// print the TLB invalidation counts
+//______________________________________________________________________________
+void
+archPageTableFlushStatistics(void)
+{
+    xprintLog("page table batches: $[ulong]  ptes: $[ulong]  pins: $[ulong]  invlpg: $[ulong]  full flushes: $[ulong]\n",
+	      flushStatistics.batches,
+	      flushStatistics.updates,
+	      flushStatistics.pins,
+	      flushStatistics.invlpgs,
+	      flushStatistics.flushes);
+}
+
+//______________________________________________________________________________
+/// time archPageTableProtectRange over 1MB, 64MB and 1GB starting at base.
+/// Each range is made read only and then given back permission; only
+/// pages already mapped in pt are touched.
+//______________________________________________________________________________
+void
+archPageTableProtectBenchmark(pt_t pt, vaddr_t base, permission_t permission)
+{
+    static const ulong sizes[] = { 1UL << 20, 64UL << 20, 1UL << 30 };
+
+    int i;
+    for (i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++)
+	{
+	    PageTableFlushStatistics before = flushStatistics;
+
+	    uint64 start = getTsc();
+	    archPageTableProtectRange(pt, base, base + sizes[i], PERM_READ);
+	    uint64 middle = getTsc();
+	    archPageTableProtectRange(pt, base, base + sizes[i], permission);
+	    uint64 end = getTsc();
+
+	    xprintLog("protect $[ulong] KB: cycles $[ulong] / $[ulong]  ptes: $[ulong]  invlpg: $[ulong]  full flushes: $[ulong]\n",
+		      sizes[i] >> 10,
+		      (ulong) (middle - start),
+		      (ulong) (end - middle),
+		      flushStatistics.updates - before.updates,
+		      flushStatistics.invlpgs - before.invlpgs,
+		      flushStatistics.flushes - before.flushes);
+	}
 }
 
 //______z________________________________________________________________________
@@ -85,7 +394,7 @@ _deferredUpdate(maddr_t maddr,      ///< machine address of pte
 {
     if (mmu_update_count >= mmu_update_size)
 	{
-	    _doUpdate();
+	    _commit(false);
 	}
     mmu_updates[mmu_update_count].ptr = maddr;
     mmu_updates[mmu_update_count].val = pte;
@@ -93,6 +402,163 @@ _deferredUpdate(maddr_t maddr,      ///< machine address of pte
 }
 
 
+//______________________________________________________________________________
+/// the slot of pt, NULL if not counted.  If create, pt is a new page table
+/// and gets a fresh slot.
+//______________________________________________________________________________
+static inline
+ulong
+_slotHome(pt_t pt)
+{
+    return ((vaddr_t) pt >> (PAGE_SHIFT + PT_PAGE_ORDER)) % PT_SLOTS_MAX;
+}
+
+static
+PageTableSlot *
+_slot(pt_t pt, bool create)
+{
+    PageTableSlot *slot = lastSlot;
+
+    if (slot->pt != pt)
+	{
+	    ulong start = _slotHome(pt);
+	    ulong i;
+	    for (i=0; i<PT_SLOTS_MAX; i++)
+		{
+		    slot = ptSlots + (start + i) % PT_SLOTS_MAX;
+		    if (slot->pt == pt || !slot->pt)
+			{
+			    break;
+			}
+		}
+	    if (slot->pt != pt && (!create || slot->pt))
+		{   // not found, or no room
+		    return NULL;
+		}
+	}
+
+    if (create)
+	{
+	    memzero(slot, sizeof(PageTableSlot));
+	    slot->pt = pt;
+	}
+    lastSlot = slot;
+    return slot;
+}
+
+//______________________________________________________________________________
+/// drop the slot of pt, moving back the entries probed past it
+//______________________________________________________________________________
+static
+void
+_slotRemove(pt_t pt)
+{
+    PageTableSlot *slot = _slot(pt, false);
+    if (!slot)
+	{
+	    return;
+	}
+
+    ulong hole = slot - ptSlots;
+    ulong i    = hole;
+    for (;;)
+	{
+	    i = (i + 1) % PT_SLOTS_MAX;
+	    if (!ptSlots[i].pt)
+		{
+		    break;
+		}
+
+	    // an entry stays put if its home is cyclically in (hole, i]
+	    ulong home = _slotHome(ptSlots[i].pt);
+	    bool  stay = hole <= i ? hole < home && home <= i : hole < home || home <= i;
+	    if (!stay)
+		{
+		    ptSlots[hole] = ptSlots[i];
+		    hole = i;
+		}
+	}
+    ptSlots[hole].pt = NULL;
+}
+
+//______________________________________________________________________________
+/// the counters of pt, NULL if not counted.
+//______________________________________________________________________________
+static inline
+PageTableCounters *
+_counters(pt_t pt)
+{
+    PageTableSlot *slot = _slot(pt, false);
+    return slot ? &slot->counters : NULL;
+}
+
+//______________________________________________________________________________
+/// account for a user pte of pt changing from oldPte to newPte
+//______________________________________________________________________________
+static inline
+void
+_countersPte(pt_t pt, ptentry_t oldPte, ptentry_t newPte)
+{
+    const ptentry_t writable = _PAGE_PRESENT | _PAGE_RW;
+
+    PageTableCounters *counters = _counters(pt);
+    if (!counters)
+	{
+	    return;
+	}
+
+    counters->present  += !!(newPte & _PAGE_PRESENT) - !!(oldPte & _PAGE_PRESENT);
+    counters->writable += ((newPte & writable) == writable) - ((oldPte & writable) == writable);
+    counters->shared   += !!(newPte & _PAGE_COW) - !!(oldPte & _PAGE_COW);
+}
+
+//______________________________________________________________________________
+/// account for count page table pages added to (or removed from) pt
+//______________________________________________________________________________
+static inline
+void
+_countersPtps(pt_t pt, long count)
+{
+    PageTableCounters *counters = _counters(pt);
+    if (counters)
+	{
+	    counters->ptps += count;
+	}
+}
+
+//______________________________________________________________________________
+/// copy out the counters of pt, in O(1)
+//______________________________________________________________________________
+Status
+archPageTableCounters(pt_t pt, PageTableCounters *counters)
+{
+    ASSERT(counters);
+
+    PageTableSlot *slot = _slot(pt, false);
+    if (!slot)
+	{
+	    return StatusNotFound;
+	}
+    *counters = slot->counters;
+    return StatusOk;
+}
+
+//______________________________________________________________________________
+/// print the counters of pt
+//______________________________________________________________________________
+void
+archPageTableCountersPrint(pt_t pt)
+{
+    PageTableCounters counters;
+    if (archPageTableCounters(pt, &counters) != StatusOk)
+	{
+	    xprintLog("page table $[pointer] not counted\n", (ulong) pt);
+	    return;
+	}
+    xprintLog("page table $[pointer]: present: $[ulong]  ptps: $[ulong]  shared: $[ulong]  writable: $[ulong]\n",
+	      (ulong) pt, counters.present, counters.ptps, counters.shared, counters.writable);
+}
+
 //______________________________________________________________________________
 /// creates a ptentry
 //______________________________________________________________________________
@@ -105,6 +571,21 @@ _pteCreate(maddr_t    maddr,              ///< the machine address or ptentry
     return (maddr & FRAME_MASK) | pteflags;
 }
 
+//______________________________________________________________________________
+/// A copy-on-write page keeps _PAGE_COW and stays read-only whatever
+/// permission it is given, the write fault makes it writable.
+//______________________________________________________________________________
+static inline
+pteflags_t
+_pteCowFlags(ptentry_t pte, pteflags_t pteflags)
+{
+    if (pte & _PAGE_COW)
+	{
+	    pteflags = (pteflags & ~_PAGE_RW) | _PAGE_COW;
+	}
+    return pteflags;
+}
+
 //______________________________________________________________________________
 /// Compute page table (permission) flags from a permission_t.
 //______________________________________________________________________________
@@ -130,14 +611,71 @@ _pteFlags(permission_t permission, bool userSpace)
     return pteFlags;
 }
 
+//______________________________________________________________________________
+/// forget the cached translations of pt
+//______________________________________________________________________________
+static inline
+void
+_cacheFlush(pt_t pt)
+{
+    PageTableSlot *slot = _slot(pt, false);
+    if (slot)
+	{
+	    memzero(slot->cache, sizeof(slot->cache));
+	}
+}
+
+//______________________________________________________________________________
+/// print the translation cache counts
+//______________________________________________________________________________
+void
+archPageTableCacheStatistics(void)
+{
+    ulong lookups = cacheStatistics.hits + cacheStatistics.misses;
+
+    xprintLog("pte cache hits: $[ulong]  misses: $[ulong]  hit rate: $[ulong]%\n",
+	      cacheStatistics.hits,
+	      cacheStatistics.misses,
+	      lookups ? cacheStatistics.hits * 100 / lookups : 0);
+}
+
 //______________________________________________________________________________
 /// Return pointer to page table entry matching vaddr, null if no page entry.
+/// The L1 table found is remembered in the cache of pt.
 //______________________________________________________________________________
 ptentry_t *
 archPteGetPtr(pt_t pt, vaddr_t vaddr)
 {
     ASSERT(pt);
 
+    PageTableSlot       *slot  = _slot(pt, false);
+    vaddr_t              tag   = (vaddr >> L2_PAGETABLE_SHIFT) + 1;
+    PageTableCacheEntry *entry = slot ? slot->cache + tag % PT_CACHE_ENTRIES : NULL;
+
+    if (entry && entry->tag == tag)
+	{
+	    cacheStatistics.hits++;
+	    return entry->l1 + l1offset(vaddr);
+	}
+
+    ptentry_t *ptePtr = _pteWalk(pt, vaddr);
+    if (entry && ptePtr)
+	{
+	    entry->tag = tag;
+	    entry->l1  = ptePtr - l1offset(vaddr);
+	}
+
+    cacheStatistics.misses++;
+    return ptePtr;
+}
+
+//______________________________________________________________________________
+/// walk pt to the page table entry matching vaddr, null if no page entry.
+//______________________________________________________________________________
+static
+ptentry_t *
+_pteWalk(pt_t pt, vaddr_t vaddr)
+{
     ptentry_t *ptePtr;
 
 #ifdef HAS_L4
@@ -173,7 +711,7 @@ ptentry_t *
 archPteGet(pt_t pt, vaddr_t vaddr)
 {
     ptentry_t *ptePtr = archPteGetPtr(pt, vaddr);
-    if (archPteIsFree(*ptePtr))
+    if (!ptePtr || archPteIsFree(*ptePtr))
 	return NULL;
   
     return ptePtr;
@@ -254,32 +792,20 @@ _ptpInternalUpdate(ptentry_t *ptePtr, ptentry_t pte)
     _deferredUpdate(virtualToMachine((vaddr_t) ptePtr), pte);
 }
 
-//_____________________________________________________________________________
-// fix for Intel core i7 tlb changes.
-// It invalidates the virtual address which contains modified ptps
-//_____________________________________________________________________________
+//______________________________________________________________________________
+/// queue the update of a valid user-space page table entry of the running
+/// process to permission
+//______________________________________________________________________________
 static inline
 void
-_ptpI7(vaddr_t vaddr)
+_pteUserUpdate(ptentry_t *ptePtr, permission_t permission)
 {
-    switch (i7)
-	{
-	case I7_NONE:
-	    return;
-	case I7_INVLPG:
-	    {
-		struct mmuext_op op[2];
-		op[0].cmd = MMUEXT_INVLPG_LOCAL;
-		op[0].arg1.linear_addr = (vaddr_t) vaddr;
-		int reason  = HYPERVISOR_mmuext_op(op, 1, NULL, DOMID_SELF);
-		if ( reason < 0) {
-		    xprintLog("could invalidate, error = $[int]\n", reason);
-		    BUG();
-		}
-	    }
-	    return;
-	}
+    ASSERT(ptePtr);
+    pteflags_t pteflags = _pteCowFlags(*ptePtr, _pteFlags(permission, true));
+    ptentry_t    newPte = _pteCreate(*ptePtr, pteflags);
 
+    _countersPte(currentPt, *ptePtr, newPte);
+    _ptpInternalUpdate(ptePtr, newPte);
 }
 
 //______________________________________________________________________________
@@ -288,16 +814,25 @@ _ptpI7(vaddr_t vaddr)
 void
 archPteUserUpdate(ptentry_t *ptePtr, permission_t permission)
 {
-    ASSERT(ptePtr);
-    pteflags_t pteflags = _pteFlags(permission, true);
-    ptentry_t    newPte = _pteCreate(*ptePtr, pteflags);
+    _pteUserUpdate(ptePtr, permission);
 
-    _ptpInternalUpdate(ptePtr, newPte);
+    // the user address mapped by ptePtr is not known here
+    _invalidateAll();
 
     _doUpdate();
+}
 
-    // i7
-    _ptpI7(pteToVirtual(newPte));
+//______________________________________________________________________________
+/// Updates the valid user-space page table entry mapping vaddr with new
+/// permission, invalidating only vaddr
+//______________________________________________________________________________
+void
+archPteUserUpdateAddress(ptentry_t *ptePtr, vaddr_t vaddr, permission_t permission)
+{
+    _pteUserUpdate(ptePtr, permission);
+    _invalidate(vaddr);
+
+    _doUpdate();
 }
 
 
@@ -332,6 +867,64 @@ archPageTableProtectRange(
     return;
 }
 
+//______________________________________________________________________________
+/// Refill the pool of read only page table pages, if it is running low.
+/// Freed pages are zeroed and reused first.  All the read-only remaps are
+/// a single page table batch.
+//______________________________________________________________________________
+void
+archPageTablePtpPoolRefill(void)
+{
+    if (ptpPoolCount >= PTP_POOL_LOW)
+	{
+	    return;
+	}
+    // freed pages are writable only once their batch is done
+    ASSERT(!mmu_update_count);
+
+    while (ptpPoolCount < PTP_POOL_MAX)
+	{
+	    ptentry_t *ptp;
+	    if (ptpFreedCount)
+		{
+		    ptp = (ptentry_t *) ptpFreed[--ptpFreedCount];
+		    ptpPoolStatistics.recycled++;
+		}
+	    else if (!(ptp = pageTablePtpAlloc()))
+		{
+		    break;
+		}
+	    memset(ptp, 0, PAGE_SIZE);
+
+	    ptentry_t *ptePtr = archPteGet((pt_t) start_info.pt_base, (vaddr_t) ptp);
+	    ASSERT(ptePtr);
+	    _ptpInternalUpdate(ptePtr, *ptePtr & ~_PAGE_RW);
+	    _invalidate((vaddr_t) ptp);
+
+	    ptpPool[ptpPoolCount++] = (vaddr_t) ptp;
+	}
+
+    _doUpdate();
+    ptpPoolStatistics.refills++;
+}
+
+//______________________________________________________________________________
+/// print the page table page pool counts
+//______________________________________________________________________________
+void
+archPageTablePtpPoolStatistics(void)
+{
+    ulong allocs = ptpPoolStatistics.hits + ptpPoolStatistics.misses;
+
+    xprintLog("ptp pool: $[int] pages  hits: $[ulong]  misses: $[ulong]  hit rate: $[ulong]%  refills: $[ulong]  recycled: $[ulong]\n",
+	      ptpPoolCount,
+	      ptpPoolStatistics.hits,
+	      ptpPoolStatistics.misses,
+	      allocs ? ptpPoolStatistics.hits * 100 / allocs : 0,
+	      ptpPoolStatistics.refills,
+	      ptpPoolStatistics.recycled);
+}
+
 //______________________________________________________________________________
 // free a ptp.
 //______________________________________________________________________________
@@ -347,12 +940,22 @@ _ptpFree(pt_t pt,
 
     vaddr_t     child       = pteToVirtual(*ptePtr);
 
-    // free up page table page
-    pageTablePtpFree((void *) child);
+    // the page is still linked and read only until the batch is done,
+    // only then is it recycled or freed
+    if (ptpReleasedCount >= PTP_POOL_MAX)
+	{
+	    _doUpdate();
+	}
+    ptpReleased[ptpReleasedCount++] = child;
 
     ptentry_t *childPtePtr = archPteGet(pt, child);
 
     _ptpInternal(ptePtr, pte, childPtePtr, *childPtePtr | _PAGE_RW);
+    _countersPtps(pt, -1);
+    _cacheFlush(pt);
+
+    // interior entry removed, paging structure caches are stale
+    _invalidateAll();
 }
 
 
@@ -367,6 +970,8 @@ archPageTableFree(pt_t pt)
 
     _offlineFree(pt, USERSPACE_START, USERSPACE_END);
 
+    _slotRemove(pt);
+
 #if defined(__x86_32__)
     ptentry_t *pte = &pt[PT_USER_ENTRIES]; // first kernel entry
     void *l2KernelPage = (void *) pteToVirtual(*pte);
@@ -375,10 +980,12 @@ archPageTableFree(pt_t pt)
 #endif
     ptentry_t *childPtePtr = archPteGet(pt, (vaddr_t) pt);
     _ptpInternalUpdate(childPtePtr, *childPtePtr | _PAGE_RW);
+    _invalidate((vaddr_t) pt);
 
 #if defined(__x86_64__)
     childPtePtr = archPteGet(pt, (vaddr_t) USER_BASEPTR(pt));
     _ptpInternalUpdate(childPtePtr, *childPtePtr | _PAGE_RW);
+    _invalidate((vaddr_t) USER_BASEPTR(pt));
 #endif
 
     _doUpdate();
@@ -389,7 +996,8 @@ archPageTableFree(pt_t pt)
 //______________________________________________________________________________
 static
 bool
-_offlineAllocTreePtp(ptentry_t *ptePtr,
+_offlineAllocTreePtp(pt_t       pt,
+		     ptentry_t *ptePtr,
 		     pteflags_t  pteflags)
 {
     if (archPteIsFree(*ptePtr))
@@ -401,6 +1009,7 @@ _offlineAllocTreePtp(ptentry_t *ptePtr,
 		}
 	    *ptePtr     = _pteCreate(virtualToMachine((vaddr_t) childPtePtr), pteflags);
 	    ASSERT(archPteInUse(*ptePtr));
+	    _countersPtps(pt, 1);
 	}
 
     //xprintLog("$[str]: fromAddr=$[xlong]  toAddr=$[xlong]   virtual=$[xlong]  pte=$[xint64]\n",
@@ -421,7 +1030,7 @@ _offlineAllocTreeLevel2(pt_t       pt,
 			)
 {
 
-    if (!_offlineAllocTreePtp(ptePtr, L3_PROT))
+    if (!_offlineAllocTreePtp(pt, ptePtr, L3_PROT))
 	{
 	    return false;
 	}
@@ -436,7 +1045,7 @@ _offlineAllocTreeLevel2(pt_t       pt,
     ulong l;
     for (l=min; l <= max; l++)
 	{
-	    if (!_offlineAllocTreePtp(ptePtr + l, L2_PROT))
+	    if (!_offlineAllocTreePtp(pt, ptePtr + l, L2_PROT))
 		{
 		    return false;
 		}
@@ -458,7 +1067,7 @@ _offlineAllocTreeLevel3(pt_t       pt,
 			vaddr_t    toAddr
 			)
 {
-    if (!_offlineAllocTreePtp(ptePtr, L4_PROT))
+    if (!_offlineAllocTreePtp(pt, ptePtr, L4_PROT))
 	{
 	    return false;
 	}
@@ -556,6 +1165,13 @@ archPageTableOfflineClone(pt_t newPt, pt_t oldPt)
     ASSERT(newPt);
     ASSERT(oldPt);
 
+    // counted from the start or never, a slot taken later would count
+    // from zero with entries already in place
+    if (!_slot(newPt, true))
+	{
+	    xprintLog("page table $[pointer] not counted, no free slot\n", (ulong) newPt);
+	}
+
 #if defined(__x86_32__)
     // In PAE mode, processes may not share L3 kernel entries.
     // So, create a new L2, copy the kernel's L2 contents into it and
@@ -648,16 +1264,18 @@ archPageTableOfflineCompleteExisting(pt_t pt)
 	    ptentry_t *ptePtr = archPteGet((pt_t) start_info.pt_base, ptp);
 	    ASSERT(ptePtr);
 	    _ptpInternalUpdate(ptePtr, *ptePtr & ~_PAGE_RW);
+	    _invalidate(ptp);
 	}
 
-    _doUpdate();
-
-    xenPageTablePin(pt);
+    _deferredPin(pt);
 #if defined(__x86_64__)
 	// x86-64: need to pin the user page table as well
-    xenPageTablePin(USER_BASEPTR(pt));
+    _deferredPin(USER_BASEPTR(pt));
 #endif
- 
+
+    // read-only remaps, pins and invalidation in one hypercall
+    _doUpdate();
+
     ptNoWriteCount = 0;
 }
 
@@ -678,7 +1296,8 @@ archPageTableOfflineCompleteNew(pt_t pt)
 //______________________________________________________________________________
 static
 ptentry_t*
-_offlinePathLevel(ptentry_t  *ptePtr,
+_offlinePathLevel(pt_t        pt,
+		  ptentry_t  *ptePtr,
 			      pteflags_t  pteFlags
 			      )
 {
@@ -696,6 +1315,7 @@ _offlinePathLevel(ptentry_t  *ptePtr,
     ptentry_t pte  = _pteCreate(virtualToMachine((vaddr_t) page), pteFlags);
 	    
     *ptePtr = pte;
+    _countersPtps(pt, 1);
 
     return page;
 }
@@ -715,17 +1335,17 @@ _offlinePath(pt_t    pt,          ///< page table
 
 #ifdef HAS_L4
     // X86-64
-    tab = _offlinePathLevel(tab + l4offset(vaddr), L4_PROT);
+    tab = _offlinePathLevel(pt, tab + l4offset(vaddr), L4_PROT);
     // in case top level page table page has been updated
     _offlineDuplicateL4(pt, l4offset(vaddr));
 #endif
 
-    tab = _offlinePathLevel(tab + l3offset(vaddr),  L3_PROT);
+    tab = _offlinePathLevel(pt, tab + l3offset(vaddr),  L3_PROT);
   
     // all paged systems must have l2 and l1
 
     // the l2 level entries
-    tab = _offlinePathLevel(tab + l2offset(vaddr), L2_PROT);
+    tab = _offlinePathLevel(pt, tab + l2offset(vaddr), L2_PROT);
 
     ptentry_t *ptePtr = tab + l1offset(vaddr);
 
@@ -757,6 +1377,17 @@ _offlinePtpAlloc(void)
 // 
 //  i7: offline, so no i7 issues
 //______________________________________________________________________________
+static inline
+void
+_offlineUserInsertPte(pt_t pt, vaddr_t vaddr, ptentry_t pte)
+{
+    ptentry_t   *ptePtr = _offlinePath(pt, vaddr);
+    ASSERT(ptePtr);
+
+    _countersPte(pt, *ptePtr, pte);
+    *ptePtr = pte;
+}
+
 void
 archPageTableOfflineUserInsert(pt_t         pt,
 			       vaddr_t      vaddr,
@@ -765,13 +1396,10 @@ archPageTableOfflineUserInsert(pt_t         pt,
 			       )
 {
     ASSERT((maddr & FRAME_MASK) == maddr);
-    ptentry_t   *ptePtr = _offlinePath(pt, vaddr);
-    ASSERT(ptePtr);
-
     pteflags_t pteFlags = _pteFlags(permission, true);
     ptentry_t pte = _pteCreate(maddr, pteFlags);
     //xprintLog("$[str]: vaddr=$[pointer]  $[xint64]\n", __func__, vaddr, pte);
-    *ptePtr = pte;
+    _offlineUserInsertPte(pt, vaddr, pte);
 }
 
 //______________________________________________________________________________
@@ -856,8 +1484,18 @@ _insertPtp(ptentry_t  *pt,
 	   pteflags_t  pteFlags
 	   )
 {
+    ptentry_t *ptp;
+    if (ptpPoolCount)
+	{   // already read only, write its entry in the batch
+	    ptp = (ptentry_t *) ptpPool[--ptpPoolCount];
+	    ptpPoolStatistics.hits++;
+	    _ptpInternalUpdate(ptp + offset, _pteCreate(maddr, pteFlags));
+	    return (vaddr_t) ptp;
+	}
+    ptpPoolStatistics.misses++;
+
     // need a page beneath this level
-    ptentry_t *ptp = pageTablePtpAlloc();
+    ptp = pageTablePtpAlloc();
     ASSERT(ptp);
 
     ptp[offset] = _pteCreate(maddr, pteFlags);
@@ -866,10 +1504,25 @@ _insertPtp(ptentry_t  *pt,
     // as required by Xen's page management
     ptentry_t *childPtePtr = archPteGet(pt, (vaddr_t) ptp);
     _ptpInternalUpdate(childPtePtr, *childPtePtr & ~_PAGE_RW);
+    _invalidate((vaddr_t) ptp);
     return (vaddr_t) ptp;
 }
 
 
+//______________________________________________________________________________
+/// account for inserting pte at vaddr, which added ptps page table pages
+//______________________________________________________________________________
+static inline
+void
+_countersInsert(pt_t pt, vaddr_t vaddr, ptentry_t pte, long ptps)
+{
+    if (isUserSpaceAddress(vaddr))
+	{
+	    _countersPte(pt, 0, pte);
+	    _countersPtps(pt, ptps);
+	}
+}
+
 //______________________________________________________________________________
 // Insert a level of the tree
 //______________________________________________________________________________
@@ -897,6 +1550,7 @@ _insertInternal(pt_t       pt,          ///< page table
 	    pte = _pteCreate(virtualToMachine(ptp), L4_PROT);
 	    _ptpInternalUpdate(ptePtr, pte);
 	    _cloneUser(USER_BASEPTR(ptePtr), pte);
+	    _countersInsert(pt, vaddr, _pteCreate(maddr, leafFlags), 3);
 	    return ptePtr;
 	} 
     tab =  (ptentry_t *) pteToVirtual(*ptePtr);
@@ -910,6 +1564,7 @@ _insertInternal(pt_t       pt,          ///< page table
 	    ptp = _insertPtp(pt, l2offset(vaddr), virtualToMachine(ptp),      L2_PROT);
 	    pte = _pteCreate(virtualToMachine(ptp), L3_PROT);
 	    _ptpInternalUpdate(ptePtr, pte);
+	    _countersInsert(pt, vaddr, _pteCreate(maddr, leafFlags), 2);
 	    return ptePtr;
 	} 
     tab =  (ptentry_t *) pteToVirtual(*ptePtr);
@@ -920,6 +1575,7 @@ _insertInternal(pt_t       pt,          ///< page table
 	    ptp = _insertPtp(pt, l1offset(vaddr), maddr, leafFlags);
 	    pte = _pteCreate(virtualToMachine(ptp), L2_PROT);
 	    _ptpInternalUpdate(ptePtr, pte);
+	    _countersInsert(pt, vaddr, _pteCreate(maddr, leafFlags), 1);
 	    return ptePtr;
 	} 
     tab =  (ptentry_t *) pteToVirtual(*ptePtr);
@@ -930,6 +1586,7 @@ _insertInternal(pt_t       pt,          ///< page table
 	{   
 	    pte = _pteCreate(maddr, leafFlags);
 	    _ptpInternalUpdate(ptePtr, pte);
+	    _countersInsert(pt, vaddr, pte, 0);
 	    return ptePtr;
 	} 
 
@@ -963,8 +1620,6 @@ archPageTableInsert(pt_t    pt,                    ///< page table
 
     _doUpdate();
 
-    //_ptpI7(vaddr);
-
     return ptePtr;
 }
 
@@ -972,7 +1627,8 @@ archPageTableInsert(pt_t    pt,                    ///< page table
 //______________________________________________________________________________
 // do a batch update of leaves, previous levels exist
 //
-// unused
+// Entries written in a batch are not visible until it is done, so every
+// page must fall in an L1 table that existed before the call.
 //______________________________________________________________________________
 void
 archPageTablePageUpdate(pt_t         pt,
@@ -992,342 +1648,357 @@ archPageTablePageUpdate(pt_t         pt,
 	    pfn_t      pfn    = pfnArray[count];
 	    maddr_t    maddr  = pfnToMaddress(pfn);
 	    pteflags_t pteFlags = _pteFlags(permission, true);
+	    ASSERT(archPteGetPtr(pt, vaddr));
+
+	    // the l1 level entry, NULL if already mapped
 	    ptentry_t *ptePtr = _insertInternal(pt, vaddr, maddr, pteFlags);
-    
-	    // the l1 level entries
-	    if (archPteIsFree(*ptePtr)) 
-		{ 
-		    ptentry_t pte = _pteCreate(maddr, pteFlags);
-		    _ptpInternalUpdate(ptePtr, pte);
-		}
-	    else
-		{
-		    BUG();
-		}
+	    BUG_ON(!ptePtr);
 	}
 
     _doUpdate();
 }
 
 //______________________________________________________________________________
-/// Gets the next valid address in the page table within [addr,hi)
+/// Range walk.  visit is called for every in-use leaf pte mapping a page
+/// in [addr, hi) and, if interior, for each in-use interior entry before
+/// its subtree is walked.  A free entry at any level skips its whole
+/// subtree in one step.  The walk stops as soon as visit returns true.
 //______________________________________________________________________________
-vaddr_t
-archPageTableNext(pt_t pt, vaddr_t addr, vaddr_t hi)
-{
-    ASSERT(pt);
+typedef bool (*PteVisitor)(ptentry_t *ptePtr, vaddr_t vaddr, int level, void *arg);
 
-    vaddr_t base[4] = {0, 0, 0, 0};
-    ptentry_t *l4ptr, *l3ptr, *l2ptr, *l1ptr;
+#ifdef HAS_L4
+#define PT_TOP_LEVEL 3
+#else
+#define PT_TOP_LEVEL 2
+#endif
 
-    if ((hi - addr) < PAGE_SIZE)
+static const int levelShift[] = {
+    L1_PAGETABLE_SHIFT,
+    L2_PAGETABLE_SHIFT,
+    L3_PAGETABLE_SHIFT,
+#ifdef HAS_L4
+    L4_PAGETABLE_SHIFT,
+#endif
+};
+
+//______________________________________________________________________________
+/// index of the first in-use entry of table in [i, end), or end
+//______________________________________________________________________________
+static inline
+ulong
+_nextInUse(ptentry_t *table, ulong i, ulong end)
+{
+    // free entries are zero, so a run of four is tested at once
+    while ((i + 4 <= end) && !(table[i] | table[i+1] | table[i+2] | table[i+3]))
 	{
-	    return hi;
+	    i += 4;
 	}
+    while ((i < end) && archPteIsFree(table[i]))
+	{
+	    i++;
+	}
+    return i;
+}
 
-    addr += PAGE_SIZE;
-
-    vaddr_t offset1 = l1offset(addr);
-    vaddr_t offset2 = l2offset(addr);
-  
-    ptentry_t pte = _pteCreate(virtualToMachine((vaddr_t) pt), PERM_ALL);
-    l4ptr = l3ptr = &pte;
-
-    vaddr_t offset3 = l3offset(addr);
-
-#ifdef HAS_L4
-    vaddr_t offset4 = l4offset(addr);//, maxl4 = l4offset(hi);
+//______________________________________________________________________________
+/// walk the part of [addr, hi) covered by table, which maps from base
+//______________________________________________________________________________
+static
+bool
+_rangeWalkLevel(ptentry_t   *table,
+		int          level,
+		vaddr_t      base,
+		vaddr_t      addr,
+		vaddr_t      hi,
+		PteVisitor   visit,
+		void        *arg,
+		bool         interior
+		)
+{
+    int   shift = levelShift[level];
+    ulong first = (addr > base) ? (addr - base) >> shift : 0;
+    ulong end   = MIN(((hi - base - 1) >> shift) + 1, L1_PAGETABLE_ENTRIES);
 
-    ulong l4;
-    for (l4=offset4; l4<L4_PAGETABLE_ENTRIES; offset3 = offset2 = offset1 = 0, l4++)
+    ulong i;
+    for (i = _nextInUse(table, first, end); i < end; i = _nextInUse(table, i + 1, end))
 	{
-	    l4ptr = pt + l4;
-	    base[3] = l4 << L4_PAGETABLE_SHIFT;
-	    if (base[3] >= hi)
+	    ptentry_t *ptePtr = table + i;
+	    vaddr_t    vaddr  = base + ((vaddr_t) i << shift);
+
+	    if ((!level || interior) && visit(ptePtr, vaddr, level, arg))
 		{
-		    return hi;
+		    return true;
 		}
-	    if (archPteIsFree(*l4ptr))
+	    if (level && _rangeWalkLevel((ptentry_t *) pteToVirtual(*ptePtr), level - 1,
+					 vaddr, addr, hi, visit, arg, interior))
 		{
-		    continue;
+		    return true;
 		}
-#endif
+	}
 
-	    ptentry_t *t3 = (ptentry_t *) pteToVirtual(*l4ptr);
+    return false;
+}
 
-	    ulong l3;
-	    for (l3=offset3; l3<L3_PAGETABLE_ENTRIES; offset2 = offset1 = 0, l3++)
-		{
-		    l3ptr = t3 + l3;
-		    base[2] = base[3] + (l3 << L3_PAGETABLE_SHIFT);
-		    if (base[2] >= hi)
-			{
-			    return hi;
-			}
-		    if (archPteIsFree(*l3ptr)) 
-			{
-			    continue;
-			}
+//______________________________________________________________________________
+/// walk [addr, hi) in pt, see PteVisitor
+//______________________________________________________________________________
+static inline
+void
+_rangeWalk(pt_t pt, vaddr_t addr, vaddr_t hi, PteVisitor visit, void *arg, bool interior)
+{
+    ASSERT(pt);
 
-		    ptentry_t *t2 = (ptentry_t *) pteToVirtual(*l3ptr);
-		    
-		    ulong l2;
-		    for (l2=offset2; l2<L2_PAGETABLE_ENTRIES; offset1 = 0, l2++) 
-			{
-			    l2ptr = t2 + l2;
-			    base[1] = base[2] + (l2 << L2_PAGETABLE_SHIFT);
-			    if (base[1] >= hi) 
-				{
-				    return hi;
-				}
-			    if (archPteIsFree(*l2ptr)) 
-				{
-				    continue;
-				}
+    if (hi <= addr)
+	{
+	    return;
+	}
+    _rangeWalkLevel(pt, PT_TOP_LEVEL, 0, addr, hi, visit, arg, interior);
+}
+
+//______________________________________________________________________________
+/// Gets the next valid address in the page table within [addr,hi)
+//______________________________________________________________________________
+static
+bool
+_nextVisit(ptentry_t *ptePtr, vaddr_t vaddr, int level, void *arg)
+{
+    *(vaddr_t *) arg = vaddr;
+    return true;
+}
 
-			    ptentry_t *t1 = (ptentry_t *) pteToVirtual(*l2ptr);
+vaddr_t
+archPageTableNext(pt_t pt, vaddr_t addr, vaddr_t hi)
+{
+    ASSERT(pt);
 
-			    ulong l1;
-			    for (l1=offset1; l1<L1_PAGETABLE_ENTRIES; l1++)
-				{
-				    l1ptr = t1 + l1;
-				    base[0] = base[1] + (l1 << L1_PAGETABLE_SHIFT);
-				    if (base[0] >= hi)
-					{
-					    return hi;
-					}
-				    if (!archPteIsFree(*l1ptr))
-					{ // found it, compute address
-					    return base[0];
-					}
-				}
-			}
-		}
-#ifdef HAS_L4
+    if ((hi - addr) < PAGE_SIZE)
+	{
+	    return hi;
 	}
-#endif
 
-    return  hi;  // not found
-}
+    vaddr_t next = hi;  // not found
+    _rangeWalk(pt, addr + PAGE_SIZE, hi, _nextVisit, &next, false);
 
+    return next;
+}
 
 //______________________________________________________________________________
 /// copy page table pages from userspace address range [addr, hi) in pt to toPt
 //______________________________________________________________________________
+typedef struct {
+    pt_t         fromPt;
+    pt_t         toPt;
+    vaddr_t      offset;
+    permission_t permission;
+} UserspaceCopy;
+
+static
+bool
+_userspaceCopyVisit(ptentry_t *ptePtr, vaddr_t fromAddr, int level, void *arg)
+{
+    UserspaceCopy *copy = arg;
+    vaddr_t      toAddr = fromAddr + copy->offset;
+
+    // If there is a page a fromAddr, ...
+    maddr_t maddr = pteToMachine(*ptePtr);
+    ASSERT(maddr);
+
+    PhysicalInfo *physicalInfo = physicalToPhysicalInfo(machineToPhysical(maddr));
+    ASSERT(!test_bit(PG_pt,  &physicalInfo->flags));
+    ASSERT(!test_bit(PG_ptp, &physicalInfo->flags));
+    ASSERT(physicalInfo->count);
+
+    physicalInfoPageAlloc(physicalInfo);
+
+    // Map local_address to page.
+    archPageTableOfflineUserInsert(copy->toPt, toAddr, maddr, copy->permission);
+
+    return false;
+}
+
 void
 archPageTableUserspaceCopy(pt_t pt, vaddr_t addr, vaddr_t hi, pt_t toPt, vaddr_t offset, permission_t permission)
 {
     ASSERT(pt);
 
-    vaddr_t base[4] = {0, 0, 0, 0};
-    ptentry_t *l4ptr, *l3ptr, *l2ptr, *l1ptr;
-
     if ((hi - addr) < PAGE_SIZE)
 	{
 	    return;
 	}
 
-    vaddr_t offset1 = l1offset(addr);
-    vaddr_t offset2 = l2offset(addr);
-  
-    ptentry_t pte = _pteCreate(virtualToMachine((vaddr_t) pt), PERM_ALL);
-    l4ptr = l3ptr = &pte;
-
-    vaddr_t offset3 = l3offset(addr);
-
-#ifdef HAS_L4
-    vaddr_t offset4 = l4offset(addr);//, maxl4 = l4offset(hi);
-
-    ulong l4;
-    for (l4=offset4; l4<L4_PAGETABLE_ENTRIES; offset3 = offset2 = offset1 = 0, l4++)
-	{
-	    l4ptr = pt + l4;
-	    base[3] = l4 << L4_PAGETABLE_SHIFT;
-	    if (base[3] >= hi)
-		{
-		    return;
-		}
-	    if (archPteIsFree(*l4ptr))
-		{
-		    continue;
-		}
-#endif
-
-	    ptentry_t *t3 = (ptentry_t *) pteToVirtual(*l4ptr);
-
-	    ulong l3;
-	    for (l3=offset3; l3<L3_PAGETABLE_ENTRIES; offset2 = offset1 = 0, l3++)
-		{
-		    l3ptr = t3 + l3;
-		    base[2] = base[3] + (l3 << L3_PAGETABLE_SHIFT);
-		    if (base[2] >= hi)
-			{
-			    return;
-			}
-		    if (archPteIsFree(*l3ptr)) 
-			{
-			    continue;
-			}
+    UserspaceCopy copy = { pt, toPt, offset, permission };
+    _rangeWalk(pt, addr, hi, _userspaceCopyVisit, &copy, false);
+}
 
-		    ptentry_t *t2 = (ptentry_t *) pteToVirtual(*l3ptr);
-		    
-		    ulong l2;
-		    for (l2=offset2; l2<L2_PAGETABLE_ENTRIES; offset1 = 0, l2++) 
-			{
-			    l2ptr = t2 + l2;
-			    base[1] = base[2] + (l2 << L2_PAGETABLE_SHIFT);
-			    if (base[1] >= hi) 
-				{
-				    return;
-				}
-			    if (archPteIsFree(*l2ptr)) 
-				{
-				    continue;
-				}
+//______________________________________________________________________________
+/// copy-on-write duplication of [addr, hi) in pt to toPt at offset.
+/// Each page is shared, and writable pages become read-only and _PAGE_COW
+/// on both sides.  The write-protection of pt is done in one batch.
+//______________________________________________________________________________
+static
+bool
+_userspaceCowCopyVisit(ptentry_t *ptePtr, vaddr_t fromAddr, int level, void *arg)
+{
+    UserspaceCopy *copy = arg;
+    ptentry_t      pte  = *ptePtr;
 
-			    ptentry_t *t1 = (ptentry_t *) pteToVirtual(*l2ptr);
+    maddr_t maddr = pteToMachine(pte);
+    ASSERT(maddr);
 
-			    ulong l1;
-			    for (l1=offset1; l1<L1_PAGETABLE_ENTRIES; l1++)
-				{
-				    l1ptr = t1 + l1;
-				    base[0] = base[1] + (l1 << L1_PAGETABLE_SHIFT);
-				    if (base[0] >= hi)
-					{
-					    return;
-					}
-				    if (!archPteIsFree(*l1ptr))
-					{   // found it, compute address
-					    // Apply the rights.
-					    vaddr_t fromAddr = base[0];
-					    vaddr_t   toAddr = fromAddr + offset;
+    PhysicalInfo *physicalInfo = physicalToPhysicalInfo(machineToPhysical(maddr));
+    ASSERT(!test_bit(PG_pt,  &physicalInfo->flags));
+    ASSERT(!test_bit(PG_ptp, &physicalInfo->flags));
+    ASSERT(physicalInfo->count);
 
-					    // If there is a page a fromAddr, ...
-					    maddr_t maddr = pteToMachine(*l1ptr);
-					    ASSERT(maddr);
+    physicalInfoPageAlloc(physicalInfo);
 
-					    PhysicalInfo *physicalInfo = physicalToPhysicalInfo(machineToPhysical(maddr));
-					    ASSERT(!test_bit(PG_pt,  &physicalInfo->flags));
-					    ASSERT(!test_bit(PG_ptp, &physicalInfo->flags));
-					    ASSERT(physicalInfo->count);
+    if (pte & _PAGE_RW)
+	{   // write protect the parent
+	    pte = (pte & ~_PAGE_RW) | _PAGE_COW;
+	    _countersPte(copy->fromPt, *ptePtr, pte);
+	    _ptpInternalUpdate(ptePtr, pte);
+	    _invalidate(fromAddr);
+	}
 
-					    physicalInfoPageAlloc(physicalInfo);
+    _offlineUserInsertPte(copy->toPt, fromAddr + copy->offset, pte);
+    cowStatistics.forkPages++;
 
-					    // Map local_address to page.
-					    archPageTableOfflineUserInsert(toPt, toAddr, maddr, permission);
-					}
-				}
-			}
-		}
-#ifdef HAS_L4
-	}
-#endif
+    return false;
 }
 
 //______________________________________________________________________________
-/// set pte flags for an address range [addr,hi) in pt
+/// share the pages of [addr, hi) in pt copy-on-write with toPt at offset.
+/// Only the pages write protected count towards a full TLB flush.
 //______________________________________________________________________________
 void
-_rangeSet(pt_t pt, vaddr_t addr, vaddr_t hi, pteflags_t pteFlags)
+archPageTableUserspaceCowCopy(pt_t pt, vaddr_t addr, vaddr_t hi, pt_t toPt, vaddr_t offset)
 {
     ASSERT(pt);
 
-    vaddr_t base[4] = {0, 0, 0, 0};
-    ptentry_t *l4ptr, *l3ptr, *l2ptr, *l1ptr;
-
     if ((hi - addr) < PAGE_SIZE)
 	{
 	    return;
 	}
 
-    vaddr_t offset1 = l1offset(addr);
-    vaddr_t offset2 = l2offset(addr);
-  
-    ptentry_t pte = _pteCreate(virtualToMachine((vaddr_t) pt), PERM_ALL);
-    l4ptr = l3ptr = &pte;
+    uint64 start = getTsc();
 
-    vaddr_t offset3 = l3offset(addr);
+    UserspaceCopy copy = { pt, toPt, offset, PERM_NONE };
+    _rangeWalk(pt, addr, hi, _userspaceCowCopyVisit, &copy, false);
 
-#ifdef HAS_L4
-    vaddr_t offset4 = l4offset(addr);//, maxl4 = l4offset(hi);
+    _doUpdate();
+
+    cowStatistics.forks++;
+    cowStatistics.forkCycles += getTsc() - start;
+}
+
+//______________________________________________________________________________
+/// Resolve a write fault on a copy-on-write page of pt.  A page that is
+/// no longer shared is made writable in place, otherwise it is copied.
+/// Returns StatusFail if vaddr is not copy-on-write.
+//______________________________________________________________________________
+Status
+archPageTableCowFault(pt_t pt, vaddr_t vaddr)
+{
+    ASSERT(pt);
 
-    ulong l4;
-    for (l4=offset4; l4<L4_PAGETABLE_ENTRIES; offset3 = offset2 = offset1 = 0, l4++)
+    ptentry_t *ptePtr = archPteGet(pt, vaddr);
+    if (!ptePtr || !(*ptePtr & _PAGE_COW))
 	{
-	    l4ptr = pt + l4;
-	    base[3] = l4 << L4_PAGETABLE_SHIFT;
-	    if (base[3] >= hi)
-		{
-		    return;
-		}
-	    if (archPteIsFree(*l4ptr))
+	    return StatusFail;
+	}
+
+    ptentry_t     pte          = *ptePtr;
+    PhysicalInfo *physicalInfo = physicalToPhysicalInfo(pteToPhysical(pte));
+    ASSERT(physicalInfo->count);
+
+    if (pageShared(physicalInfo))
+	{
+	    pfn_t pfn = physicalAlloc();
+	    if (!pfn)
 		{
-		    continue;
+		    return StatusNoMemory;
 		}
-#endif
+	    memcpy((void *) pfnToVirtual(pfn), (void *) pteToVirtual(pte), PAGE_SIZE);
 
-	    ptentry_t *t3 = (ptentry_t *) pteToVirtual(*l4ptr);
+	    physicalInfoPageAlloc(pfnToPhysicalInfo(pfn));
+	    physicalInfoPageFree(physicalInfo);
 
-	    ulong l3;
-	    for (l3=offset3; l3<L3_PAGETABLE_ENTRIES; offset2 = offset1 = 0, l3++)
-		{
-		    l3ptr = t3 + l3;
-		    base[2] = base[3] + (l3 << L3_PAGETABLE_SHIFT);
-		    if (base[2] >= hi)
-			{
-			    return;
-			}
-		    if (archPteIsFree(*l3ptr)) 
-			{
-			    continue;
-			}
+	    pte = _pteCreate(pfnToMaddress(pfn), pte & ~FRAME_MASK);
+	    cowStatistics.copies++;
+	}
+    else
+	{
+	    cowStatistics.reuses++;
+	}
 
-		    ptentry_t *t2 = (ptentry_t *) pteToVirtual(*l3ptr);
-		    
-		    ulong l2;
-		    for (l2=offset2; l2<L2_PAGETABLE_ENTRIES; offset1 = 0, l2++) 
-			{
-			    l2ptr = t2 + l2;
-			    base[1] = base[2] + (l2 << L2_PAGETABLE_SHIFT);
-			    if (base[1] >= hi) 
-				{
-				    return;
-				}
-			    if (archPteIsFree(*l2ptr)) 
-				{
-				    continue;
-				}
+    pte = (pte | _PAGE_RW) & ~_PAGE_COW;
+    _countersPte(pt, *ptePtr, pte);
+    _ptpInternalUpdate(ptePtr, pte);
+    _invalidate(vaddr);
+    _doUpdate();
 
-			    ptentry_t *t1 = (ptentry_t *) pteToVirtual(*l2ptr);
+    return StatusOk;
+}
 
-			    ulong l1;
-			    for (l1=offset1; l1<L1_PAGETABLE_ENTRIES; l1++)
-				{
-				    l1ptr = t1 + l1;
-				    base[0] = base[1] + (l1 << L1_PAGETABLE_SHIFT);
-				    if (base[0] >= hi)
-					{
-					    return;
-					}
-				    if (!archPteIsFree(*l1ptr))
-					{ // found it, compute address
-					    // Apply the rights.
-					    ptentry_t *ptePtr = l1ptr;
-					    ptentry_t newPte = _pteCreate(*ptePtr, pteFlags);
+//______________________________________________________________________________
+/// print the copy-on-write counts
+//______________________________________________________________________________
+void
+archPageTableCowStatistics(void)
+{
+    xprintLog("cow forks: $[ulong]  pages: $[ulong]  cycles: $[ulong]  copies: $[ulong]  reuses: $[ulong]\n",
+	      cowStatistics.forks,
+	      cowStatistics.forkPages,
+	      cowStatistics.forkCycles,
+	      cowStatistics.copies,
+	      cowStatistics.reuses);
+}
 
-					    //xprintLog("archPageTableProtectRange:  addr =  $[xlong]    old = $[xint64]   new = $[xint64]\n",
-					    //   addr, *ptePtr, newPte);
+//______________________________________________________________________________
+/// set pte flags for an address range [addr,hi) in pt
+//______________________________________________________________________________
+typedef struct {
+    pt_t       pt;
+    pteflags_t pteFlags;
+} RangeSet;
 
-					    _ptpInternalUpdate(ptePtr, newPte);
+static
+bool
+_rangeSetVisit(ptentry_t *ptePtr, vaddr_t vaddr, int level, void *arg)
+{
+    RangeSet *rangeSet = arg;
 
-					    _ptpI7(addr);
-					}
-				}
-			}
-		}
-#ifdef HAS_L4
+    // Apply the rights.
+    ptentry_t newPte = _pteCreate(*ptePtr, _pteCowFlags(*ptePtr, rangeSet->pteFlags));
+    if (newPte == *ptePtr)
+	{   // already has the rights
+	    return false;
 	}
-#endif
+
+    //xprintLog("archPageTableProtectRange:  addr =  $[xlong]    old = $[xint64]   new = $[xint64]\n",
+    //   vaddr, *ptePtr, newPte);
+
+    _countersPte(rangeSet->pt, *ptePtr, newPte);
+    _ptpInternalUpdate(ptePtr, newPte);
+    _invalidate(vaddr);
+
+    return false;
+}
+
+void
+_rangeSet(pt_t pt, vaddr_t addr, vaddr_t hi, pteflags_t pteFlags)
+{
+    ASSERT(pt);
+
+    if ((hi - addr) < PAGE_SIZE)
+	{
+	    return;
+	}
+
+    // only the pages changed count towards the full flush threshold, a
+    // large sparse range is still invalidated page by page
+    RangeSet rangeSet = { pt, pteFlags };
+    _rangeWalk(pt, addr, hi, _rangeSetVisit, &rangeSet, false);
 }
 
 //______________________________________________________________________________
@@ -1394,90 +2065,147 @@ archPageTableWalk(vaddr_t vaddr)
 //______________________________________________________________________________
 // Walk PTs for a snapshot of process's user space physical page usage
 //______________________________________________________________________________
+static
+bool
+_statisticsVisit(ptentry_t *ptePtr, vaddr_t vaddr, int level, void *arg)
+{
+    if (*ptePtr & _PAGE_PRESENT)
+	{
+	    (*(ulong *) arg)++;
+	}
+    return false;
+}
+
 void
 archPageTableStatistics(pt_t pageTable)
 {
     ASSERT(pageTable);
 
-    pt_t	l2ptBase,		// page directory table base
-    		l1ptBase;		// page table base
-
-    ptentry_t	l3pte,		// page directory (pointer) entry
-	        l2pte,		// page directory entry
-	        l1pte;		// page table entry
-
     xprintLog("CR3: $[pointer]. ", (ulong)pageTable);
 
-    ulong l3, l2, l1;
     ulong pageCount = 0;
 
     pageCount++;	// page directory pointer table
 
-#ifdef HAS_L4
-    ulong l4;
-    pt_t l3ptBase;		// page directory table base
-    ptentry_t l4pte;	// page directory (pointer) entry
+    // counts the page table pages on the way, as well as the pages
+    _rangeWalk(pageTable, 0, (vaddr_t) L4_USER_ENTRIES << L4_PAGETABLE_SHIFT,
+	       _statisticsVisit, &pageCount, true);
 
-    // FIXME: skip kernel address space in L4
-    for (l4=0; l4<L4_USER_ENTRIES; l4++)
+    xprintLog("Total number of present userspace pages: $[ulong]\n", pageCount);
+
+#ifdef WITH_ASSERTS
+    // the full walk checks the incremental counters
+    PageTableCounters counters;
+    if (archPageTableCounters(pageTable, &counters) == StatusOk &&
+	1 + counters.ptps + counters.present != pageCount)
 	{
-	    l4pte = pageTable[(vaddr_t)l4];
-	    if ((l4pte & _PAGE_PRESENT) == 0)
-		{
-		    continue;
-		}
-	    pageCount++;
+	    xprintLog("page table counters out of step: 1 + ptps $[ulong] + present $[ulong] != $[ulong]\n",
+		      counters.ptps, counters.present, pageCount);
+	}
+#endif
+}
 
-	    l3ptBase = (ptentry_t *)pteToVirtual(l4pte);
-	    for (l3=0; l3<L3_USER_ENTRIES; l3++)
-		{
-		    l3pte = l3ptBase[(vaddr_t)l3];
-		    if ((l3pte & _PAGE_PRESENT) == 0)
-			{
-			    continue;
-			}
-		    pageCount++;
-#else
-	    for (l3=0; l3<L3_USER_ENTRIES; l3++)
-		{
-	    	l3pte = pageTable[(vaddr_t)l3];
-		    if ((l3pte & _PAGE_PRESENT) == 0)
-			{
-			    continue;
+//______________________________________________________________________________
+/// Snapshot: the runs of [addr, hi) in pt, written through write
+//______________________________________________________________________________
+typedef struct {
+    PageTableSnapshotWrite write;
+    void                  *arg;
+    PageTableSnapshotRun   run;    // run being extended
+    ulong                  runs;   // runs written
+} Snapshot;
 
-			}
-		    pageCount++;
-#endif
+static
+void
+_snapshotFlush(Snapshot *snapshot)
+{
+    if (snapshot->run.pages)
+	{
+	    snapshot->write(snapshot->arg, &snapshot->run, sizeof(snapshot->run));
+	    snapshot->runs++;
+	}
+}
 
-		    l2ptBase = (ptentry_t *)pteToVirtual(l3pte);
-		    for (l2=0; l2<L2_USER_ENTRIES; l2++)
-			{
-		    	l2pte = l2ptBase[(vaddr_t)l2];
-			    if ((l2pte & _PAGE_PRESENT) == 0)
-				{
-				    continue;
-				}
-			    pageCount++;
+static
+bool
+_snapshotVisit(ptentry_t *ptePtr, vaddr_t vaddr, int level, void *arg)
+{
+    Snapshot            *snapshot = arg;
+    PageTableSnapshotRun *run     = &snapshot->run;
+
+    ptentry_t pte   = *ptePtr;
+    maddr_t   maddr = pteToMachine(pte);
+    uint      flags = (pte & 0xfff) | ((pte >> 63) ? PT_SNAPSHOT_NX : 0);
+    uint      count = isForeignMachineAddr(maddr)
+	? PT_SNAPSHOT_FOREIGN
+	: physicalToPhysicalInfo(machineToPhysical(maddr))->count;
+
+    ulong length = (ulong) run->pages << PAGE_SHIFT;
+    if (run->pages &&
+	run->vaddr + length == vaddr &&
+	run->maddr + length == maddr &&
+	run->flags == flags &&
+	run->count == count)
+	{
+	    run->pages++;
+	    return false;
+	}
 
-			    l1ptBase = (ptentry_t *)pteToVirtual(l2pte);
-			    for (l1=0; l1<L1_USER_ENTRIES; l1++)
-				{
-			    	l1pte = l1ptBase[(vaddr_t)l1];
-				    if ((l1pte & _PAGE_PRESENT) == 0)
-				    {
-					    continue;
-				    }
-				    pageCount++;
-				} // end l1
-			} // end l2
-#ifdef HAS_L4
-		} // end l3
-	} // end l4
-#else
-		} // end l3
-#endif
+    _snapshotFlush(snapshot);
+    run->vaddr = vaddr;
+    run->maddr = maddr;
+    run->pages = 1;
+    run->flags = flags;
+    run->count = count;
+    return false;
+}
 
-    xprintLog("Total number of present userspace pages: $[ulong]\n", pageCount);
+//______________________________________________________________________________
+/// Write a binary snapshot of the pages mapped in [addr, hi) of pt
+/// (see pageTableSnapshot.h).  Returns the number of runs.
+//______________________________________________________________________________
+ulong
+archPageTableSnapshot(pt_t pt, vaddr_t addr, vaddr_t hi, PageTableSnapshotWrite write, void *arg)
+{
+    ASSERT(pt);
+    ASSERT(write);
+
+    PageTableSnapshotHeader header = {
+	.magic   = PT_SNAPSHOT_MAGIC,
+	.version = PT_SNAPSHOT_VERSION,
+	.pt      = (vaddr_t) pt,
+	.tsc     = getTsc(),
+    };
+    write(arg, &header, sizeof(header));
+
+    Snapshot snapshot = { .write = write, .arg = arg };
+    _rangeWalk(pt, addr, hi, _snapshotVisit, &snapshot, false);
+    _snapshotFlush(&snapshot);
+
+    PageTableSnapshotRun end = { .pages = 0 };
+    write(arg, &end, sizeof(end));
+
+    return snapshot.runs;
+}
+
+//______________________________________________________________________________
+/// console writer: one hex line per structure
+//______________________________________________________________________________
+static
+void
+_snapshotConsoleWrite(void *arg, const void *data, ulong length)
+{
+    printHexLog(PT_SNAPSHOT_PREFIX, data, length);
+}
+
+//______________________________________________________________________________
+/// snapshot the user space of pt to the console
+//______________________________________________________________________________
+void
+archPageTableSnapshotConsole(pt_t pt)
+{
+    ulong runs = archPageTableSnapshot(pt, USERSPACE_START, USERSPACE_END, _snapshotConsoleWrite, NULL);
+    xprintLog("page table $[pointer]: snapshot of $[ulong] runs\n", (ulong) pt, runs);
 }
 
 //______________________________________________________________________________
@@ -1614,11 +2342,13 @@ archPageTableRemove(
     ptentry_t *ptePtr = archPteGet(pt, vaddr);
     ASSERT(ptePtr);
 
+    if (isUserSpaceAddress(vaddr))
+	{
+	    _countersPte(pt, *ptePtr, 0);
+	}
     _ptpInternalUpdate(ptePtr, 0); // zero out page entry
+    _invalidate(vaddr);
     _doUpdate();
-
-    // i7
-    _ptpI7(vaddr);
 }
 
 //______________________________________________________________________________
@@ -1638,13 +2368,14 @@ archPageTableReplace(pt_t         pt,
     ptentry_t  pte    = _pteCreate(maddr, _pteFlags(permission, true));
     //xprintLog("$[str]: $[xint64]\n", __func__, pte);
 
+    if (isUserSpaceAddress(vaddr))
+	{
+	    _countersPte(pt, *ptePtr, pte);
+	}
     _ptpInternalUpdate(ptePtr, pte); // replace page entry
+    _invalidate(vaddr);
 
     _doUpdate();
-
-    // i7
-    _ptpI7(vaddr);
-
 }
 
 //______________________________________________________________________________
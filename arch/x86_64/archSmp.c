@@ -0,0 +1,179 @@
+//______________________________________________________________________________
+/// Multiple vCPUs.
+///   Each CPU has a per CPU data area (ArchPda) at its kernel GS base,
+///   which gives smp_processor_id() and the vcpu_info used by entry.S, and
+///   its own kernel and IRQ stacks.  Secondary vCPUs are started with
+///   VCPUOP_initialise/VCPUOP_up and then only run the handlers of event
+///   ports bound to them (xenEventBindCpu); deferred work they queue is
+///   run by CPU 0, which they kick with an IPI event.
+//______________________________________________________________________________
+
+#include <nano/common.h>
+#include <nano/mm.h>
+#include <nano/pageTable.h>
+#include <nano/xenEvent.h>
+#include <nano/xenEventFifo.h>
+#include <nano/xenSchedule.h>
+#include <xen/vcpu.h>
+
+#define MSR_GS_BASE     0xc0000101
+#define STACK_ORDER     2                        // pages of each stack, as 2^order
+#define STACK_SIZE      (PAGE_SIZE << STACK_ORDER)
+#define EFLAGS_IOPL1    0x1000
+
+// CPU 0's IRQ stack is static, it is needed before pages can be allocated
+static char irqstack[STACK_SIZE];
+
+static ArchPda        pda[ARCH_CPUS_MAX];
+static uint           cpuCount = 1;
+static volatile uint  cpusOnline = 1;
+static evtchn_port_t  ipiPort[ARCH_CPUS_MAX];
+
+// used once per secondary, during bring-up on CPU 0
+static vcpu_guest_context_t context;
+
+extern trap_info_t trapTable[];
+void failsafe_callback(void);
+
+//______________________________________________________________________________
+/// CPU 0's data area, before anything masks events
+//______________________________________________________________________________
+void
+archSmpInit(void)
+{
+    C_ASSERT(__builtin_offsetof(ArchPda, vcpuInfo) == ARCH_PDA_VCPU_INFO);
+    C_ASSERT(__builtin_offsetof(ArchPda, cpu) == ARCH_PDA_CPU);
+
+    pda[0].irqcount    = -1;
+    pda[0].irqstackptr = irqstack + STACK_SIZE;
+    pda[0].vcpuInfo    = &HYPERVISOR_shared_info->vcpu_info[0];
+    pda[0].cpu         = 0;
+
+    asm volatile("movl %0,%%fs ; movl %0,%%gs" :: "r" (0));
+    wrmsrl(MSR_GS_BASE, &pda[0]);
+}
+
+//______________________________________________________________________________
+/// IPI handler, the upcall itself is what wakes the CPU
+//______________________________________________________________________________
+static void
+_ipi(evtchn_port_t port, arch_interrupt_regs_t *regs, void *ign)
+{
+}
+
+//______________________________________________________________________________
+/// first code run by a secondary vCPU, on its own stack
+//______________________________________________________________________________
+static void
+_secondaryStart(void)
+{
+    __sync_fetch_and_add(&cpusOnline, 1);
+
+    __sti();
+    for (;;)
+	{
+	    BUG_ON(xenScheduleBlock() < 0);
+	}
+}
+
+//______________________________________________________________________________
+/// describe the initial state of cpu to Xen and start it, false if Xen
+/// has no such vCPU
+//______________________________________________________________________________
+static bool
+_secondaryUp(uint cpu)
+{
+    char *stack = (char *) pageKernelAlloc(STACK_ORDER);
+
+    pda[cpu].irqcount    = -1;
+    pda[cpu].irqstackptr = (char *) pageKernelAlloc(STACK_ORDER) + STACK_SIZE;
+    pda[cpu].vcpuInfo    = &HYPERVISOR_shared_info->vcpu_info[cpu];
+    pda[cpu].cpu         = cpu;
+    pda[cpu].vcpuInfo->evtchn_upcall_mask = 1;
+
+    memset(&context, 0, sizeof(context));
+    context.flags = VGCF_in_kernel | VGCF_failsafe_disables_events;
+
+    context.user_regs.cs     = __KERNEL_CS;
+    context.user_regs.ds     = __KERNEL_DS;
+    context.user_regs.es     = __KERNEL_DS;
+    context.user_regs.ss     = __KERNEL_SS;
+    context.user_regs.rip    = (ulong) _secondaryStart;
+    context.user_regs.rsp    = (ulong) stack + STACK_SIZE - sizeof(ulong);  // as if called
+    context.user_regs.rflags = EFLAGS_IOPL1;
+
+    // trapTable is a sparse list, Xen indexes trap_ctxt by vector
+    uint i;
+    for (i = 0; trapTable[i].address; i++)
+	{
+	    context.trap_ctxt[trapTable[i].vector] = trapTable[i];
+	}
+
+    context.kernel_ss             = __KERNEL_SS;
+    context.kernel_sp             = context.user_regs.rsp;
+    context.event_callback_eip    = (ulong) &hypervisor_callback;
+    context.failsafe_callback_eip = (ulong) failsafe_callback;
+    context.ctrlreg[3]            = xen_pfn_to_cr3(virtualToMfn((vaddr_t) currentPt));
+    context.gs_base_kernel        = (ulong) &pda[cpu];
+
+    if (HYPERVISOR_vcpu_op(VCPUOP_initialise, cpu, &context))
+	{
+	    pageKernelFree(stack, STACK_ORDER);
+	    pageKernelFree(pda[cpu].irqstackptr - STACK_SIZE, STACK_ORDER);
+	    return false;
+	}
+
+    // its events must have somewhere to go before it can take any
+    if (xenEventFifoActive)
+	{
+	    BUG_ON(!xenEventFifoInitCpu(cpu));
+	}
+
+    uint online = cpusOnline;
+    BUG_ON(HYPERVISOR_vcpu_op(VCPUOP_up, cpu, NULL));
+    while (cpusOnline == online)
+	{
+	    xenScheduleYield();
+	}
+    return true;
+}
+
+//______________________________________________________________________________
+/// bring up the secondary vCPUs Xen gives this domain, returns the number
+/// of CPUs online
+//______________________________________________________________________________
+uint
+archSmpStart(void)
+{
+    BUG_ON(xenEventBindIpi(0, _ipi, NULL, &ipiPort[0]));
+
+    while (cpuCount < ARCH_CPUS_MAX && _secondaryUp(cpuCount))
+	{
+	    cpuCount++;
+	}
+
+    printfLog("%d CPUs online\n", cpuCount);
+    return cpuCount;
+}
+
+//______________________________________________________________________________
+/// number of CPUs online
+//______________________________________________________________________________
+uint
+archCpuCount(void)
+{
+    return cpuCount;
+}
+
+//______________________________________________________________________________
+/// raise an event on cpu, so that it leaves SCHEDOP_block
+//______________________________________________________________________________
+void
+archSmpKick(uint cpu)
+{
+    ASSERT(cpu == 0);   // only CPU 0 takes IPIs so far
+    if (ipiPort[cpu])
+	{
+	    (void) xenEventSend(ipiPort[cpu]);
+	}
+}
@@ -39,6 +39,7 @@
 #include <nano/timer.h>
 #include <xen/vcpu.h>
 #include <nano/interruptDeferred.h>
+#include <nano/xenEventPoll.h>
 
 //______________________________________________________________________________
 // Time functions
@@ -257,6 +258,8 @@ timeOfDay64(void)
 //______________________________________________________________________________
 
 vcpu_set_singleshot_timer_t *pointer;
+static Time64        timerDeadline;    // when the one shot timer fires, 0 if not set
+static evtchn_port_t timerPort;
 void
 timeOneShotSet(int64 delta)
 {
@@ -273,6 +276,7 @@ timeOneShotSet(int64 delta)
 		result = HYPERVISOR_vcpu_op(VCPUOP_set_singleshot_timer, 0, &op);
         printfLog("timeOneShotSet: delta = %lld, result = %d\n", delta, result);
     } while (unlikely(result != 0));
+	timerDeadline = op.timeout_abs_ns;
 }
 
 //______________________________________________________________________________
@@ -291,12 +295,10 @@ void set_message(char *message) {
 
 static
 void
-timeHandler(evtchn_port_t ev,
-			arch_interrupt_regs_t *regs,
-			void *ign)
+timeHandlerDeferred(void *ign)
 {
 	// pointer contains the time to set the timer to
-	timerInterrupt.occured++;
+	timerInterrupt.serviced++;
 	// check if timer finished
 	if (pointer != NULL){
 		if (pointer->timeout_abs_ns < NOW()) {
@@ -309,11 +311,45 @@ timeHandler(evtchn_port_t ev,
 	}
 }
 
+static DeferredWork timeWork = DEFERRED_WORK(timeHandlerDeferred, NULL);
+
+//______________________________________________________________________________
+/// timer event, the printing is left to timeHandlerDeferred
+//______________________________________________________________________________
+static
+void
+timeHandler(evtchn_port_t ev,
+			arch_interrupt_regs_t *regs,
+			void *ign)
+{
+	timerInterrupt.occured++;
+
+	// the one shot timer is an event with a known time, which makes it
+	// the probe for how long the idle path takes to react
+	Time64 now = NOW();
+	if (timerDeadline && now >= timerDeadline) {
+		xenEventPollLatency(now - timerDeadline);
+		timerDeadline = 0;
+	}
+
+	interruptDeferredQueue(&timeWork);
+}
+
 //______________________________________________________________________________
 /// Bind the timer event so ethos can manage time
 //______________________________________________________________________________
 void
 timeInit(void)
 {
-	xenEventBindVirq(VIRQ_TIMER, &timeHandler, NULL);
+	// the timer is serviced ahead of device events under the FIFO ABI
+	xenEventBindVirqPriority(VIRQ_TIMER, &timeHandler, NULL, XEN_EVENT_PRIORITY_HIGH, &timerPort);
+}
+
+//______________________________________________________________________________
+/// poll the timer port from the idle path, or stop doing so
+//______________________________________________________________________________
+void
+timePollSet(bool hot)
+{
+	xenEventPollSet(timerPort, hot);
 }
@@ -105,7 +105,7 @@ TRAP_DEFAULT(19, "SIMD coprocessor error\n", SimdCoprocessorError)
 // The 'privilege ring' field specifies the least-privileged ring that
 // can trap to that vector using a software-interrupt instruction (INT).
 //______________________________________________________________________________
-static trap_info_t trapTable[] = {
+trap_info_t trapTable[] = {    // also handed to secondary vCPUs, see archSmp.c
     {    0, 0, __KERNEL_CS, (ulong)entryDivideError               },
     {    1, 0, __KERNEL_CS, (ulong)entryDebug                     },
     {    3, 3, __KERNEL_CS, (ulong)entryInt3                      },
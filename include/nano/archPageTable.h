@@ -13,6 +13,49 @@
 #define PT_ROOT_ENTRIES    (PT_USER_ENTRIES + PT_KERNEL_ENTRIES)
 #define USER_BASEPTR(x)    ((ptentry_t *)(x) + PT_PAGE_ORDER * PT_ROOT_ENTRIES)
 
+// counts of batched page table updates and the TLB invalidations they caused
+typedef struct {
+    ulong batches;   // multicalls, each a single hypercall
+    ulong updates;   // page table entries written
+    ulong pins;      // page tables pinned
+    ulong invlpgs;   // single page invalidations
+    ulong flushes;   // full TLB flushes
+} PageTableFlushStatistics;
+
+// counts of copy-on-write duplication and faults
+typedef struct {
+    ulong forks;       // archPageTableUserspaceCowCopy calls
+    ulong forkPages;   // pages shared by them
+    ulong forkCycles;  // TSC cycles spent in them
+    ulong copies;      // faults that copied a shared page
+    ulong reuses;      // faults that made an unshared page writable
+} PageTableCowStatistics;
+
+// counts for the pool of read only page table pages
+typedef struct {
+    ulong hits;      // page table pages taken from the pool
+    ulong misses;    // page table pages allocated and remapped in the batch
+    ulong refills;   // refill batches
+    ulong recycled;  // freed page table pages put back in the pool
+} PtpPoolStatistics;
+
+// counters of the user part of an address space, see archPageTableCounters
+typedef struct {
+    ulong present;   // present pages
+    ulong ptps;      // page table pages below the root
+    ulong shared;    // pages shared copy-on-write
+    ulong writable;  // present and writable pages
+} PageTableCounters;
+
+// counts for the translation cache of archPteGetPtr
+typedef struct {
+    ulong hits;
+    ulong misses;
+} PageTableCacheStatistics;
+
+// sink for archPageTableSnapshot, e.g., the console or a file
+typedef void (*PageTableSnapshotWrite)(void *arg, const void *data, ulong length);
+
 ptentry_t  *archPtpAlloc(void);
 
 void        archPageTablePrintUserspace(pt_t pt);
@@ -36,6 +79,8 @@ void          archPageTableOfflineUserInsert(pt_t pt, vaddr_t vaddr, maddr_t mad
 void          archPageTableOfflineCompleteNew(pt_t pt);
 void          archPageTableOfflineCompleteExisting(pt_t pt);
 
+void          archPageTableUserspaceCowCopy(pt_t pt, vaddr_t addr, vaddr_t hi, pt_t toPt, vaddr_t offset);
+Status        archPageTableCowFault(pt_t pt, vaddr_t vaddr);
 void          archPageTableUserspaceCopy(pt_t pt, vaddr_t addr, vaddr_t hi, pt_t fromPt, vaddr_t offset, permission_t permission);
 
 void          archPageTableFree(pt_t old);
@@ -48,9 +93,21 @@ void          archPageTableWalk(vaddr_t vaddr);
 ptentry_t    *archPteGet(pt_t pageTable, vaddr_t addr);
 permission_t  archPteGetPermission(ptentry_t *p);
 void          archPteUserUpdate(ptentry_t *p, permission_t ps);
+void          archPteUserUpdateAddress(ptentry_t *p, vaddr_t vaddr, permission_t ps);
 
 void          archPageTableProtectRange(pt_t pt, vaddr_t startAddr, vaddr_t endAddr, permission_t permission);
 
 void          archPageTableStatistics(pt_t pageTable);
+Status        archPageTableCounters(pt_t pt, PageTableCounters *counters);
+void          archPageTableCountersPrint(pt_t pt);
+void          archPageTableCacheStatistics(void);
+ulong         archPageTableSnapshot(pt_t pt, vaddr_t addr, vaddr_t hi, PageTableSnapshotWrite write, void *arg);
+void          archPageTableSnapshotConsole(pt_t pt);
+void          archPageTableFlushStatistics(void);
+void          archPageTableCowStatistics(void);
+void          archPageTablePtpPoolRefill(void);
+void          archPageTablePtpPoolStatistics(void);
+void          archPageTableFlushThresholdSet(ulong pages);
+void          archPageTableProtectBenchmark(pt_t pt, vaddr_t base, permission_t permission);
 
 #endif /* _ARCH_PAGE_H_ */
@@ -4,6 +4,10 @@
 
 #include <ethos/kernel/arch/synchro.h>
 #include <xen/io/blkif.h>
+#include <ethos/kernel/xenGrant.h>
+
+// persistent grant pages per interface: a full ring of full requests
+#define BLKFRONT_PERSISTENT_PAGES (32 * BLKIF_MAX_SEGMENTS_PER_REQUEST)
 
 struct blkfront_info {
 	uint64 sectors;
@@ -26,6 +30,8 @@ typedef struct BlkfrontInterface {
 	unsigned evtchn;  // event channel
 	blkif_vdev_t handle;
 	struct blkfront_info info;
+	int persistent;  // backend agreed to feature-persistent
+	XenGrantPersistentPool pool;  // pages granted for the device's life
 } BlkfrontInterface;
 
 struct blkfront_aiocb {
@@ -38,6 +44,9 @@ struct blkfront_aiocb {
 	unsigned long id; // index into efsReplyInfoArray
 
 	grant_ref_t gref[BLKIF_MAX_SEGMENTS_PER_REQUEST];
+	// with persistent grants, the pool pages gref[] refers to; reads
+	// are copied out of them on completion, before they are put back
+	XenGrantPersistentPage *persistent[BLKIF_MAX_SEGMENTS_PER_REQUEST];
 	int n; // how many pages to IO
 };
 
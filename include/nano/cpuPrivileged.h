@@ -29,11 +29,15 @@ ArchPrivilegeState archPrivilegeState(arch_interrupt_regs_t *regs);
 // Sets the system call Status return value.
 int archSyscallStatus(arch_interrupt_regs_t *regs, int retval);
 
-// No SMP =).
-#define smp_processor_id() 0
 void archInit(start_info_t *si);
 void archPrintInfo(void);
 
+// Defined in archSmp.c
+void archSmpInit(void);
+uint archSmpStart(void);
+uint archCpuCount(void);
+void archSmpKick(uint cpu);
+
 // Defined in archProcess.c
 void archFpuClearDetect(void);
 void archFpuSetDetect(void);
@@ -119,6 +119,9 @@ void    xprintLog(const char *format, ...);
 void    vxprint(const char *format, va_list args);
 void    vxprintLog(const char *format, va_list args);
 
+        // one log line of prefix followed by data in hex, for binary exports
+void    printHexLog(const char *prefix, const void *data, ulong length);
+
         // print to string
 String *xprintString(const char *format, ...);
 String *vxprintString(const char *format, va_list args);
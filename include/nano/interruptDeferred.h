@@ -23,4 +23,38 @@ serviceInterrupt(InterruptService is)
 {
     return is.occured-is.serviced;
 }
+
+// work an event handler leaves to be done with events enabled.  Handlers
+// acknowledge the event and queue the work; queueing work which is already
+// queued does nothing, so the work must handle everything that is pending.
+typedef void (*DeferredWorkFunction)(void *arg);
+
+typedef struct DeferredWork {
+    DeferredWorkFunction  function;
+    void                 *arg;
+    bool                  queued;
+    struct DeferredWork  *next;
+    ulong                 runs;
+} DeferredWork;
+
+#define DEFERRED_WORK(function, arg) { function, arg, false, NULL, 0 }
+
+typedef struct {
+    ulong upcalls;           // event upcalls taken
+    ulong maskedCycles;      // TSC cycles spent in upcalls, events masked
+    ulong maskedCyclesMax;   // longest single upcall
+    ulong queued;            // work queued
+    ulong coalesced;         // work queued while already queued
+    ulong runs;              // interruptDeferredRun calls which ran work
+    ulong exhausted;         // runs which stopped on the budget
+} InterruptDeferredStatistics;
+
+extern InterruptDeferredStatistics interruptDeferredStatistics;
+
+void  interruptDeferredQueue(DeferredWork *work);
+bool  interruptDeferredPending(void);
+ulong interruptDeferredRun(void);
+void  interruptDeferredBudgetSet(uint budget);
+void  interruptDeferredStatisticsPrint(void);
+
 #endif
@@ -0,0 +1,75 @@
+//______________________________________________________________________________
+// cooperative kernel tasks and the wait queues they sleep on
+//______________________________________________________________________________
+
+#ifndef __KERNEL_TASK_H__
+#define __KERNEL_TASK_H__
+
+// a task is a continuation: its function runs a step and returns true if
+// the task is to run again, false once it is finished.  A step must not
+// block; to wait it puts the task on a wait queue and returns true.  The
+// function may keep where it is in state.
+struct KernelTask;
+typedef bool (*KernelTaskFunction)(struct KernelTask *task);
+
+typedef struct KernelTask {
+    KernelTaskFunction  function;
+    void               *arg;
+    uint                state;      // for the function, e.g. its next step
+    bool                queued;     // on the run queue or a wait queue
+    struct KernelTask  *next;
+} KernelTask;
+
+#define KERNEL_TASK(function, arg) { function, arg, 0, false, NULL }
+
+// event handlers wake wait queues; the generation counts the wakes, so
+// a waiter which read it before testing its condition misses none
+typedef struct {
+    KernelTask     *head;
+    KernelTask     *tail;
+    volatile ulong  generation;
+} WaitQueue;
+
+#define WAIT_QUEUE_INIT { NULL, NULL, 0 }
+
+typedef struct {
+    ulong started;    // tasks started
+    ulong steps;      // task functions run
+    ulong finished;   // tasks which returned false
+    ulong sleeps;     // tasks put on a wait queue
+    ulong wakes;      // waitQueueWake calls
+    ulong woken;      // tasks moved from wait queues to the run queue
+    ulong waits;      // blocking waits by code outside a task
+    ulong blocks;     // times such a wait blocked the kernel
+} KernelTaskStatistics;
+
+extern KernelTaskStatistics kernelTaskStatistics;
+
+void  kernelTaskStart(KernelTask *task);
+void  kernelTaskSleep(WaitQueue *queue, KernelTask *task);
+ulong kernelTaskRun(void);
+bool  kernelTaskRunning(void);
+void  kernelTaskStatisticsPrint(void);
+
+void  waitQueueWake(WaitQueue *queue);
+void  waitQueueWait(WaitQueue *queue, ulong generation);
+
+// block code outside a task until condition holds, running tasks and
+// deferred work meanwhile; condition is retested after every wake of queue
+#define WAIT_EVENT(queue, condition)					\
+    do									\
+	{								\
+	    for (;;)							\
+		{							\
+		    ulong _generation = (queue)->generation;		\
+		    rmb();						\
+		    if (condition)					\
+			{						\
+			    break;					\
+			}						\
+		    waitQueueWait(queue, _generation);			\
+		}							\
+	}								\
+    while (0)
+
+#endif
@@ -0,0 +1,38 @@
+//______________________________________________________________________________
+/// Binary page table snapshot format, written by archPageTableSnapshot and
+/// read by tools/ptSnapshot on the host.  Shared by both, so it uses only
+/// plain C types (x86_64 sizes).
+//
+// A snapshot is a header followed by runs in increasing vaddr order, ended
+// by a run of zero pages.  A run is a maximal range of pages with
+// contiguous vaddr and maddr, the same flags and the same PhysicalInfo
+// count.  Through the console each structure is one line of the form
+//     PTSNAP <hex bytes>
+//______________________________________________________________________________
+
+#ifndef __PAGE_TABLE_SNAPSHOT_H__
+#define __PAGE_TABLE_SNAPSHOT_H__
+
+#define PT_SNAPSHOT_MAGIC       0x31535450  // "PTS1"
+#define PT_SNAPSHOT_VERSION     1
+#define PT_SNAPSHOT_PREFIX      "PTSNAP "
+#define PT_SNAPSHOT_NX          0x80000000  // flags bit for the pte's NX bit
+#define PT_SNAPSHOT_FOREIGN     0xffffffff  // count of a foreign page
+
+typedef struct {
+    unsigned int       magic;
+    unsigned int       version;
+    unsigned long long pt;      // root page, identifies the address space
+    unsigned long long tsc;     // when the snapshot was started
+} __attribute__((packed)) PageTableSnapshotHeader;
+
+typedef struct {
+    unsigned long long vaddr;   // first page
+    unsigned long long maddr;   // machine address of the first page
+    unsigned int       pages;   // run length, 0 ends the snapshot
+    unsigned int       flags;   // low 12 pte bits, PT_SNAPSHOT_NX
+    unsigned int       count;   // PhysicalInfo count of each page
+    unsigned int       pad;
+} __attribute__((packed)) PageTableSnapshotRun;
+
+#endif
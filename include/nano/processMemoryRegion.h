@@ -12,10 +12,10 @@
 #include <ethos/kernel/mm.h>
 
 // Region pagefault handler for not-present faults.
-typedef int (*RegionNotPresentHandler)(ProcessMemoryRegion *this, vaddr_t faulting_address);
+typedef Status (*RegionNotPresentHandler)(ProcessMemoryRegion *this, vaddr_t faulting_address);
 
 // Region pagefault handler for access permission faults.
-typedef int (*RegionBadAccessHandler)(ProcessMemoryRegion *this, vaddr_t faulting_address, permission_t tried);
+typedef Status (*RegionBadAccessHandler)(ProcessMemoryRegion *this, vaddr_t faulting_address, permission_t tried);
 
 struct ProcessMemoryRegion
 {
@@ -37,8 +37,27 @@ struct ProcessMemoryRegion
     ProcessMemory *processMemory;
 };
 
+// A region demand paged from a file image held in memory.
+typedef struct
+{
+    ProcessMemoryRegion region;  // must be first
+    uchar              *data;    // contents of [vm_start, vm_start+size)
+    ulong               size;    // the rest of the region is zero filled
+} ProcessMemoryFileRegion;
+
 void processMemoryRegionInit(void);
 
+// bad_access_pf handler for regions shared copy-on-write.
+Status processMemoryRegionCowFault(ProcessMemoryRegion *this, vaddr_t faulting_address, permission_t tried);
+void   processMemoryRegionCowShare(ProcessMemoryRegion *from, ProcessMemoryRegion *to);
+
+// not_present_pf handlers for demand paged regions.
+Status processMemoryRegionZeroFault(ProcessMemoryRegion *this, vaddr_t faulting_address);
+Status processMemoryRegionFileFault(ProcessMemoryRegion *this, vaddr_t faulting_address);
+void processMemoryFileRegionInit(ProcessMemoryFileRegion *fileRegion, uchar *data, ulong size);
+void processMemoryRegionFaultAroundSet(ulong pages);
+void processMemoryRegionDemandStatistics(void);
+
 // Print a processMemoryRegion
 void processMemoryRegionPrint(void *ptr);
 
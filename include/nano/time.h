@@ -36,6 +36,7 @@ Time64   timeMonotonic(void);
 void     timeOfDay(uint32 *seconds, uint32 *nanoseconds);
 Time64   timeOfDay64(void);
 void     timeOneShotSet(int64 delta);
+void     timePollSet(bool hot);
 int64    get_input(int64 time);
 void     set_message(char* message);
 //______________________________________________________________________________
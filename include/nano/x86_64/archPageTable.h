@@ -131,6 +131,10 @@ l3offset(vaddr_t vaddr)
 // It doesn't really matter which bit, as they all have no meaning without the present bit.
 #define _PAGE_PERM_NONE  ((ptentry_t) 0x080)
 
+// A read-only page shared copy-on-write: a write fault copies it (or, once
+// it is no longer shared, makes it writable).  Uses a bit left to software.
+#define _PAGE_COW        ((ptentry_t) 0x200)
+
 // for some reason write permission is given to page
 // table entries even though Xen forbids it.
 //
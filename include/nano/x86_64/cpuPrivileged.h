@@ -12,6 +12,11 @@
 #define __KERNEL_DS  FLAT_KERNEL_DS
 #define __KERNEL_SS  FLAT_KERNEL_SS
 
+// per CPU data area (ArchPda), reached through the kernel GS base
+#define ARCH_CPUS_MAX        8
+#define ARCH_PDA_VCPU_INFO   16
+#define ARCH_PDA_CPU         24
+
 #define TRAP_divide_error      0
 #define TRAP_debug             1
 #define TRAP_nmi               2
@@ -38,6 +43,22 @@
 
 #include <nano/xenEventHandler.h>
 
+typedef struct {
+    int          irqcount;      // offset 0
+    char        *irqstackptr;   //        8
+    vcpu_info_t *vcpuInfo;      //       16 ARCH_PDA_VCPU_INFO, used in entry.S
+    int          cpu;           //       24 ARCH_PDA_CPU
+} ArchPda;
+
+// the vCPU this code runs on
+static inline int
+smp_processor_id(void)
+{
+    int cpu;
+    __asm__ __volatile__("movl %%gs:%c1, %0" : "=r" (cpu) : "i" (ARCH_PDA_CPU));
+    return cpu;
+}
+
 // L1 cache size.
 #define L1_CACHE_BYTES          128
 
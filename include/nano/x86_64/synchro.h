@@ -3,9 +3,9 @@
 #ifndef x86_64_SYNCHRO_H
 #define x86_64_SYNCHRO_H
 
-// Needs to be not this for SMP.
-#define LOCK_PREFIX ""
-#define LOCK
+// Secondary vCPUs share memory, so read-modify-write must be locked.
+#define LOCK_PREFIX "lock ; "
+#define LOCK "lock ; "
 
 // This is a barrier for the compiler only, NOT the processor!
 #define barrier() __asm__ __volatile__("": : :"memory")
@@ -15,4 +15,33 @@
 #define rmb()   __asm__ __volatile__ ("lfence":::"memory")
 #define wmb()	__asm__ __volatile__ ("sfence" ::: "memory") /* From CONFIG_UNORDERED_IO (linux) */
 
+#ifndef __ASSEMBLY__
+
+// Spin lock between vCPUs, held only with events masked and only briefly.
+typedef struct {
+    volatile int locked;
+} SpinLock;
+
+#define SPIN_LOCK_UNLOCKED { 0 }
+
+static inline void
+spinLock(SpinLock *lock)
+{
+    while (__sync_lock_test_and_set(&lock->locked, 1))
+	{
+	    while (lock->locked)
+		{
+		    __asm__ __volatile__("pause" ::: "memory");
+		}
+	}
+}
+
+static inline void
+spinUnlock(SpinLock *lock)
+{
+    __sync_lock_release(&lock->locked);
+}
+
+#endif
+
 #endif 
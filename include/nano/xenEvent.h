@@ -14,11 +14,72 @@
 #include <nano/xenEventHandler.h>
 #include <xen/event_channel.h>
 
+// priorities handed to xenEventPrioritySet, lower is serviced first
+#define XEN_EVENT_PRIORITY_HIGH     EVTCHN_FIFO_PRIORITY_MAX
+#define XEN_EVENT_PRIORITY_DEFAULT  EVTCHN_FIFO_PRIORITY_DEFAULT
+#define XEN_EVENT_PRIORITY_BULK     EVTCHN_FIFO_PRIORITY_MIN
+
+// ports each vCPU takes under the 2-level ABI, one bit per port.  A word
+// for each bit of evtchn_pending_sel, so that any selector the upcall is
+// given indexes the mask; ports past those bound stay clear.
+#define XEN_EVENT_2L_WORDS  (8 * sizeof(ulong))
+extern ulong xenEventCpuMask[ARCH_CPUS_MAX][XEN_EVENT_2L_WORDS];
+
 typedef void (*evtchn_handler_t)(evtchn_port_t, arch_interrupt_regs_t *, void *);
 
+// handler durations are kept in log2 buckets of TSC cycles: bucket 0 holds
+// durations below 2^(XEN_EVENT_HISTOGRAM_SHIFT+1), the last everything longer
+#define XEN_EVENT_HISTOGRAM_BUCKETS 16
+#define XEN_EVENT_HISTOGRAM_SHIFT   7
+
+typedef struct {
+    ulong events;          // handler calls
+    ulong coalesced;       // port pending again when the handler returned,
+                           // all notifications in that window became one event
+    ulong cycles;          // TSC cycles spent in the handler
+    ulong latencyTotal;    // cycles from upcall entry to the handler
+    ulong latencyMax;
+    ulong histogram[XEN_EVENT_HISTOGRAM_BUCKETS];
+} XenEventPortStatistics;
+
+// binary export: a header, then one record per port which has seen events
+#define XEN_EVENT_EXPORT_MAGIC    0x31535645     // "EVS1"
+#define XEN_EVENT_EXPORT_VERSION  1
+#define XEN_EVENT_EXPORT_PREFIX   "EVSTAT "      // console lines, hex encoded
+
+typedef struct {
+    uint   magic;
+    uint   version;
+    uint   ports;          // records which follow
+    uint   buckets;        // XEN_EVENT_HISTOGRAM_BUCKETS
+    uint64 tsc;            // when the export was taken
+} __attribute__((packed)) XenEventExportHeader;
+
+typedef struct {
+    uint                    port;
+    uint                    pad;
+    XenEventPortStatistics  statistics;
+} __attribute__((packed)) XenEventExportRecord;
+
+typedef void (*XenEventExportWrite)(void *arg, const void *data, ulong length);
+
+typedef struct {
+    ulong requested;       // xenEventNotify calls
+    ulong duplicates;      // ... for a port already in the batch
+    ulong hypercalls;      // EVTCHNOP_send or multicalls issued
+    ulong batches;         // multicalls carrying more than one send
+} XenEventNotifyStatistics;
+
 void          xenEventHandle(evtchn_port_t port, arch_interrupt_regs_t *regs);
 int           xenEventBindVirq(uint32_t virq, evtchn_handler_t handler, void *data);
-evtchn_port_t xenEventBind(evtchn_port_t port, evtchn_handler_t handler,
+int           xenEventBindVirqPriority(uint32_t virq, evtchn_handler_t handler,
+				       void *data, uint priority, evtchn_port_t *port);
+int           xenEventPrioritySet(evtchn_port_t port, uint priority);
+int           xenEventBindCpu(evtchn_port_t port, uint cpu);
+uint          xenEventCpu(evtchn_port_t port);
+int           xenEventBindIpi(uint cpu, evtchn_handler_t handler, void *data,
+			      evtchn_port_t *port);
+int           xenEventBind(evtchn_port_t port, evtchn_handler_t handler,
 			  void *data);
 void          xenEventUnbind(evtchn_port_t port);
 void          xenEventInit(void);
@@ -28,7 +89,18 @@ int           xenEventBindInterdomain(domid_t pal, evtchn_port_t remote_port,
 				      evtchn_handler_t handler, void *data,
 				      evtchn_port_t *local_port);
 void          xenEventUnbindAllPorts(void);
+bool          xenEventPortStatistics(evtchn_port_t port, XenEventPortStatistics *statistics);
+void          xenEventStatisticsPrint(void);
+uint          xenEventStatisticsExport(XenEventExportWrite write, void *arg);
+void          xenEventStatisticsExportConsole(void);
+void          xenEventStatisticsReset(void);
 int           xenEventSend(evtchn_port_t);
+void          xenEventNotify(evtchn_port_t port);
+void          xenEventNotifyBegin(void);
+void          xenEventNotifyEnd(void);
+void          xenEventNotifyFlush(void);
+void          xenEventNotifyStatistics(XenEventNotifyStatistics *statistics);
+void          xenEventNotifyStatisticsPrint(void);
 void
 xenEventConsole(evtchn_handler_t handler,    ///< handler for console event
         void *data                   ///< data to be passed to handler
@@ -0,0 +1,27 @@
+//______________________________________________________________________________
+// xenEventFifo.h
+//
+// FIFO event channel ABI: up to EVTCHN_FIFO_NR_CHANNELS ports, delivered
+// through per-priority queues linked through the event words.  Used when
+// Xen supports EVTCHNOP_init_control, otherwise the 2-level bitmaps in
+// shared info remain in use.
+//______________________________________________________________________________
+
+#ifndef __XEN_EVENT_FIFO_H__
+#define __XEN_EVENT_FIFO_H__
+
+#include <nano/cpuPrivileged.h>
+#include <xen/event_channel.h>
+
+extern bool xenEventFifoActive;    // FIFO ABI in use
+
+bool  xenEventFifoInit(void);
+bool  xenEventFifoInitCpu(uint cpu);
+int   xenEventFifoSetup(evtchn_port_t port);
+void  xenEventFifoCallback(arch_interrupt_regs_t *regs);
+void  xenEventFifoMask(evtchn_port_t port);
+void  xenEventFifoUnmask(evtchn_port_t port);
+void  xenEventFifoClearPort(evtchn_port_t port);
+bool  xenEventFifoPending(evtchn_port_t port);
+
+#endif
@@ -36,5 +36,8 @@ extern shared_info_t *HYPERVISOR_shared_info;
 void xenEventHandlerMask(uint32 port);
 void xenEventHandlerUnmask(uint32 port);
 void xenEventHandlerClearPort(uint32 port);
+bool xenEventHandlerPending(uint32 port);
+
+extern uint64 xenEventUpcallTsc;   // TSC at entry to the current upcall
 
 #endif 
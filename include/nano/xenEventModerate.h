@@ -0,0 +1,38 @@
+//______________________________________________________________________________
+// xenEventModerate.h
+//
+// Interrupt moderation for high rate event ports: the first event masks
+// the port and schedules a poll from deferred work; the poll runs until the
+// device is drained or its budget is spent, and the port is unmasked only
+// once drained.
+//______________________________________________________________________________
+
+#ifndef __XEN_EVENT_MODERATE_H__
+#define __XEN_EVENT_MODERATE_H__
+
+#include <nano/xenEvent.h>
+#include <nano/interruptDeferred.h>
+
+#define XEN_EVENT_MODERATED_MAX      8
+#define XEN_EVENT_MODERATE_BUDGET    64
+
+// does at most budget units of work for the port, returns the units done;
+// fewer than budget means the device is drained
+typedef uint (*XenEventPollFunction)(evtchn_port_t port, uint budget, void *data);
+
+typedef struct {
+    ulong events;         // upcalls which masked the port
+    ulong polls;          // poll function calls
+    ulong work;           // units of work done
+    ulong exhausted;      // polls which used the whole budget
+    ulong rearms;         // times the port was unmasked
+    ulong rearmPending;   // ... with an event already pending again
+} XenEventModerateStatistics;
+
+int           xenEventModerate(evtchn_port_t port, XenEventPollFunction poll, void *data,
+			       InterruptService *service);
+void          xenEventModerateBudgetSet(evtchn_port_t port, uint budget);
+bool          xenEventModerateStatistics(evtchn_port_t port, XenEventModerateStatistics *statistics);
+void          xenEventModerateStatisticsPrint(void);
+
+#endif
@@ -0,0 +1,34 @@
+//______________________________________________________________________________
+// xenEventPoll.h
+//
+// Busy polling of latency critical event ports from the idle path: spin
+// on the hot ports for an adaptive window, then SCHEDOP_poll just those
+// ports, and only then block.
+//______________________________________________________________________________
+
+#ifndef __XEN_EVENT_POLL_H__
+#define __XEN_EVENT_POLL_H__
+
+#include <nano/xenEvent.h>
+
+#define XEN_EVENT_HOT_MAX          8     // ports which can be polled
+#define XEN_EVENT_LATENCY_BUCKETS  32    // log2 ns
+
+typedef struct {
+    ulong spins;          // idle waits which spun
+    ulong spinHits;       // ... and saw an event while spinning
+    ulong polls;          // SCHEDOP_poll calls
+    ulong pollHits;       // ... which returned with a hot port pending
+    ulong blocks;         // waits which fell through to SCHEDOP_block
+    ulong window;         // current spin window in TSC cycles
+    ulong latency[2][XEN_EVENT_LATENCY_BUCKETS];  // [polling] event to handler ns
+} XenEventPollStatistics;
+
+int   xenEventPollSet(evtchn_port_t port, bool hot);
+void  xenEventPollEnable(bool enable);
+bool  xenEventPollWait(void);
+void  xenEventPollLatency(Time64 ns);
+void  xenEventPollStatistics(XenEventPollStatistics *statistics);
+void  xenEventPollStatisticsPrint(void);
+
+#endif
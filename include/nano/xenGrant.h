@@ -7,9 +7,78 @@
 #define __XEN_GRANT_H__
 
 #include <xen/grant_table.h>
+#include <nano/kernelTask.h>
 
-// NR_GRANT_FRAMES must be less than or equal to that configured in Xen
+// the table starts with NR_GRANT_FRAMES and grows up to Xen's limit,
+// but no further than XEN_GRANT_FRAMES_MAX
 #define NR_GRANT_FRAMES 8
+#define XEN_GRANT_FRAMES_MAX 64
+
+// reserved entries are never handed out, so ref 0 marks failure
+#define XEN_GRANT_INVALID_REF ((grant_ref_t) 0)
+
+// entries set aside by xenGrantReserve
+typedef struct {
+    uint count;
+} XenGrantReserve;
+
+typedef struct {
+    ulong grows;      // times the table grew
+    ulong exhausted;  // requests failed at the table's limit
+    ulong waits;      // waits for entries to be freed
+    ulong reserved;   // entries set aside by reserves
+    uint  inUseMax;   // most entries in use at once
+    ulong mapped;     // foreign grants mapped
+    ulong mapCalls;   // map hypercalls
+    ulong unmapped;   // foreign grants unmapped
+    ulong unmapCalls; // unmap hypercalls
+    ulong persistentGets;    // pages taken from persistent pools
+    ulong persistentWaits;   // waits on an empty pool
+} XenGrantStatistics;
+
+// A pool of pages granted to one backend for the life of a device, the
+// persistent grants protocol: I/O is copied into and out of the pages
+// instead of granting and revoking the caller's pages on every request.
+typedef struct XenGrantPersistentPage {
+    void                           *page;
+    grant_ref_t                     ref;
+    struct XenGrantPersistentPage  *next;   // while free
+} XenGrantPersistentPage;
+
+typedef struct {
+    domid_t                  backend;
+    uint                     count;     // pages granted
+    uint                     free;      // pages in the free list
+    XenGrantPersistentPage  *pages;
+    XenGrantPersistentPage  *freeList;
+    WaitQueue                queue;     // woken when a page is put back
+} XenGrantPersistentPool;
+
+extern XenGrantStatistics xenGrantStatistics;
+
+// fill in a map op: flags GNTMAP_host_map maps at hostAddr,
+// GNTMAP_device_map gives a bus address instead
+static inline void
+xenGrantMapOpSet(gnttab_map_grant_ref_t *op, vaddr_t hostAddr, uint32_t flags,
+		 domid_t domId, grant_ref_t ref, int readOnly)
+{
+    op->host_addr = hostAddr;
+    op->flags     = flags | (readOnly ? GNTMAP_readonly : 0);
+    op->ref       = ref;
+    op->dom       = domId;
+    op->status    = GNTST_okay;
+}
+
+// fill in an unmap op from what the map op returned
+static inline void
+xenGrantUnmapOpSet(gnttab_unmap_grant_ref_t *op, vaddr_t hostAddr,
+		   uint64_t devBusAddr, grant_handle_t handle)
+{
+    op->host_addr    = hostAddr;
+    op->dev_bus_addr = devBusAddr;
+    op->handle       = handle;
+    op->status       = GNTST_okay;
+}
 
 void          xenGrantInit(void);
 grant_ref_t   xenGrantAllocAndGrant(void **map);
@@ -19,6 +88,21 @@ ulong         xenGrantEndTransfer(grant_ref_t gref);
 int           xenGrantEndAccess(grant_ref_t ref);
 const char   *xenGrantOpError(int16_t status);
 int           xenGrantUnmapForeignGrant(vaddr_t hostAddr, grant_handle_t handle);
+void          xenGrantWait(uint count);
+bool          xenGrantSleep(KernelTask *task, uint count);
+Status        xenGrantReserve(XenGrantReserve *reserve, uint count);
+grant_ref_t   xenGrantReserveAccess(XenGrantReserve *reserve, domid_t domid, mfn_t frame, int readonly);
+void          xenGrantReserveRelease(XenGrantReserve *reserve);
+void          xenGrantStatisticsPrint(void);
+int           xenGrantMapForeignGrants(gnttab_map_grant_ref_t *ops, uint count);
+int           xenGrantUnmapForeignGrants(gnttab_unmap_grant_ref_t *ops, uint count);
+void          xenGrantBenchmarkStart(void);
+bool          xenGrantPersistentNegotiate(const char *frontend, const char *backend);
+Status        xenGrantPersistentInit(XenGrantPersistentPool *pool, domid_t backend, uint count);
+void          xenGrantPersistentDestroy(XenGrantPersistentPool *pool);
+XenGrantPersistentPage *xenGrantPersistentGet(XenGrantPersistentPool *pool);
+XenGrantPersistentPage *xenGrantPersistentWait(XenGrantPersistentPool *pool);
+void          xenGrantPersistentPut(XenGrantPersistentPool *pool, XenGrantPersistentPage *page);
 int           xenGrantMapForeignGrant(vaddr_t hostAddr, uint32_t domId, grant_ref_t ref, int readOnly, grant_handle_t* handle);
 
 #endif /* !__XEN_GRANT_H__ */
@@ -11,6 +11,12 @@
 // pin a page table
 void xenPageTablePin(pt_t pgd);
 
+// fill in a pin operation, to be issued in a batch
+void xenPageTablePinOp(pt_t pgd, struct mmuext_op *op);
+
+// mark a page table pinned, once its batched pin is done
+void xenPageTablePinned(pt_t pgd);
+
 // unpin a page directory
 void xenPageTableUnpin(pt_t pte);
 
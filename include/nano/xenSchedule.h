@@ -11,6 +11,7 @@
 
 int xenScheduleBlock(void);
 int xenScheduleYield(void);
+int xenSchedulePoll(evtchn_port_t *ports, uint count, uint64 timeout);
 int xenScheduleShutdown(int);
 int xenKernelBlock(void);
 
@@ -6,6 +6,9 @@
 #ifndef __XENBUS_H__
 #define __XENBUS_H__
 
+#include <nano/interruptDeferred.h>
+#include <nano/kernelTask.h>
+
 typedef unsigned long xenbus_transaction_t;
 #define XBT_NIL ((xenbus_transaction_t) 0)
 
@@ -14,9 +17,90 @@ typedef unsigned long xenbus_transaction_t;
 #define XENBUS_PERM_READ_WRITE 'b'	// "both"
 #define XENBUS_PERM_NONE       'n'	// "no access"
 
+// An asynchronous request.  It is outstanding from submission until
+// done, when the callback, if set, runs from the xenstore event handler
+// with events masked; otherwise the submitter waits for it.
+struct XenbusRequest;
+typedef void (*XenbusCallback)(struct XenbusRequest *request);
+
+typedef struct XenbusRequest {
+    XenbusCallback          callback;  // run when done, or NULL
+    void                   *arg;       // for the callback
+    volatile bool           done;      // reply received
+    bool                    borrow;    // reply may be left in the ring
+    void                   *reply;     // reply message
+    uint32_t                id;        // request id, from the reqIds table
+    char                   *message;   // copy while waiting for ring space
+    uint                    length;    // of message
+    struct XenbusRequest   *next;      // in the backlog
+} XenbusRequest;
+
+// A registered watch.  Events carrying its token set pending; the
+// callback, if set, then runs as deferred work with events enabled,
+// otherwise the owner waits with xenbus_watch_wait.  eventPath is the
+// path of the pending event, or the watched path if several merged.
+struct XenbusWatch;
+typedef void (*XenbusWatchCallback)(struct XenbusWatch *watch);
+
+#define XENBUS_WATCH_PATH_MAX 128
+
+typedef struct XenbusWatch {
+    XenbusWatchCallback  callback;   // run on events, or NULL
+    void                *arg;        // for the callback
+    const char          *path;       // path watched
+    char                 token[24];
+    char                 eventPath[XENBUS_WATCH_PATH_MAX];
+    volatile bool        pending;    // an event is not yet handled
+    ulong                events;     // events received
+    ulong                coalesced;  // events merged into a pending one
+    WaitQueue            queue;
+    DeferredWork         work;
+    struct XenbusWatch  *next;       // in its token hash bucket
+} XenbusWatch;
+
 // Initializes xenbus/xenstore.
 void xenbus_init(void);
 
+// Register and remove watches, wait for an event on one.
+int  xenbus_watch_register(XenbusWatch *watch, const char *path);
+int  xenbus_watch_unregister(XenbusWatch *watch);
+void xenbus_watch_wait(XenbusWatch *watch);
+
+// Start a read or a write, completed asynchronously.
+void xenbus_read_submit(
+			XenbusRequest *request,
+			xenbus_transaction_t xbt,
+			const char *path
+			);
+void xenbus_write_submit(
+			 XenbusRequest *request,
+			 xenbus_transaction_t xbt,
+			 const char *path,
+			 const char *value
+			 );
+
+// Requests submitted between these go out under one notification.
+void xenbus_submit_begin(void);
+void xenbus_submit_end(void);
+
+// Wait for a request, outside kernel tasks.
+void xenbus_request_wait(XenbusRequest *request);
+
+// Status of a done request, and for reads the value, freed by kfree.
+int xenbus_request_value(XenbusRequest *request, char **value);
+
+// Read many paths with all the reads in flight at once.
+int xenbus_read_many(
+		     xenbus_transaction_t xbt,
+		     const char **paths,
+		     uint count,
+		     char **values,
+		     int *statuses
+		     );
+
+void xenbus_statistics_print(void);
+void xenbus_benchmark_start(void);
+
 // Writes a formatted string to XenStore.
 int xenbus_print(
 		  xenbus_transaction_t xbt,
@@ -0,0 +1,156 @@
+//______________________________________________________________________________
+/// Deferred interrupt work.
+///   Event handlers run inside the upcall with events masked, so they only
+///   acknowledge the event and queue work here.  interruptDeferredRun then
+///   does the work with events enabled, at most budget items per run so
+///   that a stream of events cannot starve the caller.
+//______________________________________________________________________________
+
+#include <nano/common.h>
+#include <nano/xenEvent.h>
+#include <nano/interruptDeferred.h>
+
+#define DEFERRED_BUDGET_DEFAULT 16
+
+InterruptDeferredStatistics interruptDeferredStatistics;
+
+static DeferredWork *head;
+static DeferredWork *tail;
+static SpinLock      lock = SPIN_LOCK_UNLOCKED;   // secondary CPUs queue too
+static uint          budget = DEFERRED_BUDGET_DEFAULT;
+
+//______________________________________________________________________________
+/// queue work, normally called from an event handler
+//______________________________________________________________________________
+void
+interruptDeferredQueue(DeferredWork *work   ///< work to be done
+		       )
+{
+    ulong flags;
+    bool  kick = false;
+    local_irq_save(flags);
+    spinLock(&lock);
+
+    if (work->queued)
+	{
+	    interruptDeferredStatistics.coalesced++;
+	}
+    else
+	{
+	    work->queued = true;
+	    work->next   = NULL;
+	    if (tail)
+		{
+		    tail->next = work;
+		}
+	    else
+		{
+		    head = work;
+		}
+	    tail = work;
+	    interruptDeferredStatistics.queued++;
+	    kick = smp_processor_id() != 0;
+	}
+
+    spinUnlock(&lock);
+    local_irq_restore(flags);
+
+    // the work is run by CPU 0, which may be blocked
+    if (kick)
+	{
+	    archSmpKick(0);
+	}
+}
+
+//______________________________________________________________________________
+/// true if work is waiting to be run
+//______________________________________________________________________________
+bool
+interruptDeferredPending(void)
+{
+    return head != NULL;
+}
+
+//______________________________________________________________________________
+/// take the first queued work, or NULL
+//______________________________________________________________________________
+static DeferredWork *
+_dequeue(void)
+{
+    ulong flags;
+    local_irq_save(flags);
+    spinLock(&lock);
+
+    DeferredWork *work = head;
+    if (work)
+	{
+	    head = work->next;
+	    if (!head)
+		{
+		    tail = NULL;
+		}
+	    // cleared before running, so an event arriving during the work
+	    // queues it again rather than being lost
+	    work->queued = false;
+	}
+
+    spinUnlock(&lock);
+    local_irq_restore(flags);
+    return work;
+}
+
+//______________________________________________________________________________
+/// run queued work with events enabled, returns the number of items run
+//______________________________________________________________________________
+ulong
+interruptDeferredRun(void)
+{
+    ulong ran = 0;
+    DeferredWork *work;
+
+    ASSERT(smp_processor_id() == 0);
+
+    // the pass's notifications to backends go out in one hypercall
+    xenEventNotifyBegin();
+    while (ran < budget && (work = _dequeue()))
+	{
+	    work->runs++;
+	    work->function(work->arg);
+	    ran++;
+	}
+    xenEventNotifyEnd();
+
+    if (ran)
+	{
+	    interruptDeferredStatistics.runs++;
+	    if (ran == budget && head)
+		{
+		    interruptDeferredStatistics.exhausted++;
+		}
+	}
+    return ran;
+}
+
+//______________________________________________________________________________
+/// set the most work items run by one interruptDeferredRun
+//______________________________________________________________________________
+void
+interruptDeferredBudgetSet(uint newBudget   ///< items per run, at least one
+			   )
+{
+    budget = newBudget ? newBudget : 1;
+}
+
+//______________________________________________________________________________
+/// print time spent with events masked and work queue activity
+//______________________________________________________________________________
+void
+interruptDeferredStatisticsPrint(void)
+{
+    InterruptDeferredStatistics *s = &interruptDeferredStatistics;
+
+    xprintLog("deferred: upcalls $[ulong] masked cycles $[ulong] max $[ulong]\n",
+	      s->upcalls, s->maskedCycles, s->maskedCyclesMax);
+    xprintLog("deferred: queued $[ulong] coalesced $[ulong] runs $[ulong] exhausted $[ulong] budget $[uint]\n",
+	      s->queued, s->coalesced, s->runs, s->exhausted, budget);
+}
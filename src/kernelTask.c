@@ -0,0 +1,255 @@
+//______________________________________________________________________________
+/// Cooperative kernel tasks.
+///   There are no kernel threads, so an operation which has to wait for
+///   an event is written as a task: a function run in steps, which sleeps
+///   on a wait queue between them.  Event handlers wake the queue, which
+///   moves its tasks to the run queue and queues the executor as deferred
+///   work, so many operations can be in flight and interleave.
+///
+///   Code which is not a task (initialization, system calls) waits with
+///   WAIT_EVENT, which runs tasks and deferred work while it waits, so
+///   the tasks are not held up behind it.
+//______________________________________________________________________________
+
+#include <nano/common.h>
+#include <nano/xenEvent.h>
+#include <nano/schedPrivileged.h>
+#include <nano/interruptDeferred.h>
+#include <nano/kernelTask.h>
+
+KernelTaskStatistics kernelTaskStatistics;
+
+static KernelTask *head;
+static KernelTask *tail;
+static SpinLock    lock = SPIN_LOCK_UNLOCKED;   // handlers on any CPU wake
+static bool        running;                      // in a task's step
+
+static void _run(void *ign);
+static DeferredWork executor = DEFERRED_WORK(_run, NULL);
+
+//______________________________________________________________________________
+/// append task to a list, lock held
+//______________________________________________________________________________
+static void
+_append(KernelTask **first, KernelTask **last, KernelTask *task)
+{
+    task->next = NULL;
+    if (*last)
+	{
+	    (*last)->next = task;
+	}
+    else
+	{
+	    *first = task;
+	}
+    *last = task;
+}
+
+//______________________________________________________________________________
+/// put task on the run queue
+//______________________________________________________________________________
+static void
+_ready(KernelTask *task)
+{
+    ulong flags;
+    local_irq_save(flags);
+    spinLock(&lock);
+
+    ASSERT(!task->queued);
+    task->queued = true;
+    _append(&head, &tail, task);
+
+    spinUnlock(&lock);
+    local_irq_restore(flags);
+}
+
+//______________________________________________________________________________
+/// make task runnable, it runs when deferred work is next run
+//______________________________________________________________________________
+void
+kernelTaskStart(KernelTask *task)
+{
+    kernelTaskStatistics.started++;
+    _ready(task);
+    interruptDeferredQueue(&executor);
+}
+
+//______________________________________________________________________________
+/// put task, which is running, to sleep on queue; its step then returns
+/// true and the task runs again after the queue is next woken
+//______________________________________________________________________________
+void
+kernelTaskSleep(WaitQueue  *queue,    ///< queue a handler will wake
+		KernelTask *task      ///< the running task
+		)
+{
+    ulong flags;
+    local_irq_save(flags);
+    spinLock(&lock);
+
+    ASSERT(!task->queued);
+    task->queued = true;
+    _append(&queue->head, &queue->tail, task);
+    kernelTaskStatistics.sleeps++;
+
+    spinUnlock(&lock);
+    local_irq_restore(flags);
+}
+
+//______________________________________________________________________________
+/// wake everything waiting on queue, callable from event handlers
+//______________________________________________________________________________
+void
+waitQueueWake(WaitQueue *queue)
+{
+    ulong flags;
+    bool  woken = false;
+    local_irq_save(flags);
+    spinLock(&lock);
+
+    queue->generation++;
+    kernelTaskStatistics.wakes++;
+    while (queue->head)
+	{
+	    KernelTask *task = queue->head;
+	    queue->head = task->next;
+	    _append(&head, &tail, task);
+	    kernelTaskStatistics.woken++;
+	    woken = true;
+	}
+    queue->tail = NULL;
+
+    spinUnlock(&lock);
+    local_irq_restore(flags);
+
+    if (woken)
+	{
+	    interruptDeferredQueue(&executor);
+	}
+}
+
+//______________________________________________________________________________
+/// take the first runnable task, or NULL
+//______________________________________________________________________________
+static KernelTask *
+_dequeue(void)
+{
+    ulong flags;
+    local_irq_save(flags);
+    spinLock(&lock);
+
+    KernelTask *task = head;
+    if (task)
+	{
+	    head = task->next;
+	    if (!head)
+		{
+		    tail = NULL;
+		}
+	    task->queued = false;
+	}
+
+    spinUnlock(&lock);
+    local_irq_restore(flags);
+    return task;
+}
+
+//______________________________________________________________________________
+/// run one step of every task runnable now, returns the number of steps;
+/// tasks made runnable by these steps wait for the next run, so a task
+/// which keeps yielding cannot starve deferred work
+//______________________________________________________________________________
+ulong
+kernelTaskRun(void)
+{
+    ulong steps = 0;
+    KernelTask *last = tail;
+    KernelTask *task;
+
+    if (running || !last)
+	{
+	    return 0;
+	}
+
+    running = true;
+    do
+	{
+	    task = _dequeue();
+	    if (!task)
+		{
+		    break;
+		}
+	    steps++;
+	    kernelTaskStatistics.steps++;
+	    if (!task->function(task))
+		{
+		    ASSERT(!task->queued);
+		    kernelTaskStatistics.finished++;
+		}
+	    else if (!task->queued)
+		{
+		    // neither finished nor asleep: it yielded
+		    _ready(task);
+		}
+	}
+    while (task != last);
+    running = false;
+
+    return steps;
+}
+
+//______________________________________________________________________________
+/// deferred work running the executor, requeued if tasks are left
+//______________________________________________________________________________
+static void
+_run(void *ign)
+{
+    kernelTaskRun();
+    if (head)
+	{
+	    interruptDeferredQueue(&executor);
+	}
+}
+
+//______________________________________________________________________________
+/// true inside a task's step, where blocking is not allowed
+//______________________________________________________________________________
+bool
+kernelTaskRunning(void)
+{
+    return running;
+}
+
+//______________________________________________________________________________
+/// block until queue is woken after generation was read, running tasks
+/// and deferred work meanwhile.  Not for use inside a task.
+//______________________________________________________________________________
+void
+waitQueueWait(WaitQueue *queue,      ///< queue to wait on
+	      ulong generation       ///< queue's generation before the test
+	      )
+{
+    ASSERT(!running);
+
+    kernelTaskStatistics.waits++;
+    while (queue->generation == generation)
+	{
+	    kernelTaskStatistics.blocks++;
+	    archKernelBlock();
+	    rmb();
+	}
+}
+
+//______________________________________________________________________________
+/// print executor activity
+//______________________________________________________________________________
+void
+kernelTaskStatisticsPrint(void)
+{
+    KernelTaskStatistics *s = &kernelTaskStatistics;
+
+    xprintLog("tasks: started $[ulong] steps $[ulong] finished $[ulong] sleeps $[ulong]\n",
+	      s->started, s->steps, s->finished, s->sleeps);
+    xprintLog("tasks: wakes $[ulong] woken $[ulong] waits $[ulong] blocks $[ulong]\n",
+	      s->wakes, s->woken, s->waits, s->blocks);
+}
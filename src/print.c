@@ -15,6 +15,8 @@ extern bool consoleInitialized;          // used to buffer until initialized
 extern bool logShadowdaemon;             // print to log, can lose recent entries
 bool        consoleImmediate = false;     // write to the console immediately
 
+#define PRINT_HEX_MAX 256                 // longest record printHexLog takes
+
 void consolePrint(const char *data, int length);
 
 //______________________________________________________________________________
@@ -89,3 +91,26 @@ printOld(const char buf[])
     // (void) HYPERVISOR_console_io(CONSOLEIO_write, strlen(buf), buf);
     //	}
 }
+
+//______________________________________________________________________________
+/// log prefix followed by length bytes of data in hex on one line, so that
+/// binary records can be recovered from a console log
+//______________________________________________________________________________
+void
+printHexLog(const char *prefix, const void *data, ulong length)
+{
+    static const char hex[] = "0123456789abcdef";
+    static char       line[2 * PRINT_HEX_MAX + 1];
+    const uchar      *byte = data;
+
+    ASSERT(length <= PRINT_HEX_MAX);
+    ulong i;
+    for (i=0; i<length; i++)
+	{
+	    line[2*i]   = hex[byte[i] >> 4];
+	    line[2*i+1] = hex[byte[i] & 0xf];
+	}
+    line[2*length] = 0;
+
+    xprintLog("$[str]$[str]\n", prefix, line);
+}
@@ -0,0 +1,50 @@
+//______________________________________________________________________________
+/// Copy-on-write page fault handling for process memory regions.
+//
+// processMemoryRegionCowShare shares the pages of a region with its copy in
+// another address space; both then use processMemoryRegionCowFault as their
+// bad_access_pf handler.
+//______________________________________________________________________________
+
+#include <nano/common.h>
+#include <nano/status.h>
+#include <nano/processMemory.h>
+#include <nano/processMemoryRegion.h>
+#include <nano/archPageTable.h>
+
+//______________________________________________________________________________
+/// Write to a copy-on-write page in a writable region: copy or unshare it.
+/// Any other bad access is left to the caller.
+//______________________________________________________________________________
+Status
+processMemoryRegionCowFault(ProcessMemoryRegion *this, vaddr_t faulting_address, permission_t tried)
+{
+    ASSERT(this);
+    ASSERT(this->processMemory);
+
+    if (!(tried & PERM_WRITE) || !(this->vm_page_prot & PERM_WRITE))
+	{
+	    return StatusPageFault;
+	}
+
+    return archPageTableCowFault(this->processMemory->pageTable, faulting_address & PAGE_MASK);
+}
+
+//______________________________________________________________________________
+/// Share the pages of from copy-on-write with to, its copy in another
+/// address space, e.g., on fork.  The page table pages of to are built
+/// offline; the caller completes its page table.
+//______________________________________________________________________________
+void
+processMemoryRegionCowShare(ProcessMemoryRegion *from, ProcessMemoryRegion *to)
+{
+    ASSERT(from && to);
+    ASSERT(from->processMemory && to->processMemory);
+    ASSERT(from->vm_start == to->vm_start && from->vm_end == to->vm_end);
+
+    archPageTableUserspaceCowCopy(from->processMemory->pageTable, from->vm_start, from->vm_end,
+				  to->processMemory->pageTable, 0);
+
+    from->bad_access_pf = processMemoryRegionCowFault;
+    to->bad_access_pf   = processMemoryRegionCowFault;
+}
@@ -0,0 +1,190 @@
+//______________________________________________________________________________
+/// Demand paging for process memory regions.
+//
+// A demand region has no pages (nor page table pages) until it is touched.
+// Its not_present_pf handler allocates the faulting page, filled with zeros
+// or from the backing file, and maps up to faultAround neighbouring pages
+// which are not yet present along with it.
+//______________________________________________________________________________
+
+#include <nano/common.h>
+#include <nano/status.h>
+#include <nano/physicalInfo.h>
+#include <nano/processMemory.h>
+#include <nano/processMemoryRegion.h>
+#include <nano/archPageTable.h>
+
+#define FAULT_AROUND_MAX  16
+
+static ulong faultAround = 8;  // pages mapped per fault, including the faulting one
+
+static ulong demandFaults;     // not present faults handled
+static ulong demandPages;      // pages mapped by them
+
+typedef void (*PageFill)(ProcessMemoryRegion *this, vaddr_t vaddr, uchar *page);
+
+//______________________________________________________________________________
+/// zero fill
+//______________________________________________________________________________
+static
+void
+_zeroFill(ProcessMemoryRegion *this, vaddr_t vaddr, uchar *page)
+{
+    memset(page, 0, PAGE_SIZE);
+}
+
+//______________________________________________________________________________
+/// fill from the file contents, zeros past its end
+//______________________________________________________________________________
+static
+void
+_fileFill(ProcessMemoryRegion *this, vaddr_t vaddr, uchar *page)
+{
+    ProcessMemoryFileRegion *fileRegion = (ProcessMemoryFileRegion *) this;
+
+    ulong offset = vaddr - this->vm_start;
+    ulong length = 0;
+    if (offset < fileRegion->size)
+	{
+	    length = MIN(fileRegion->size - offset, (ulong) PAGE_SIZE);
+	    memcpy(page, fileRegion->data + offset, length);
+	}
+    memset(page + length, 0, PAGE_SIZE - length);
+}
+
+//______________________________________________________________________________
+/// allocate and fill the page for vaddr, 0 if out of memory
+//______________________________________________________________________________
+static
+pfn_t
+_demandPage(ProcessMemoryRegion *this, vaddr_t vaddr, PageFill fill)
+{
+    pfn_t pfn = physicalAlloc();
+    if (!pfn)
+	{
+	    return 0;
+	}
+    fill(this, vaddr, (uchar *) pfnToVirtual(pfn));
+    physicalInfoPageAlloc(pfnToPhysicalInfo(pfn));
+    return pfn;
+}
+
+//______________________________________________________________________________
+/// true iff vaddr is mapped in pt
+//______________________________________________________________________________
+static inline
+bool
+_present(pt_t pt, vaddr_t vaddr)
+{
+    return NULL != archPteGet(pt, vaddr);
+}
+
+//______________________________________________________________________________
+/// map the faulting page and the missing pages around it.  The neighbours
+/// are limited to the faulting page's L1 table, which the first insert
+/// creates, so they all go in one page table batch.
+//______________________________________________________________________________
+static
+Status
+_demandFault(ProcessMemoryRegion *this, vaddr_t faulting_address, PageFill fill)
+{
+    ASSERT(this);
+    ASSERT(this->processMemory);
+
+    pt_t    pt    = this->processMemory->pageTable;
+    vaddr_t vaddr = faulting_address & PAGE_MASK;
+    ASSERT(addressInRange(this->vm_start, this->vm_end, vaddr));
+
+    if (_present(pt, vaddr))
+	{   // a racing fault got here first
+	    return StatusOk;
+	}
+
+    pfn_t pfn = _demandPage(this, vaddr, fill);
+    if (!pfn)
+	{
+	    return StatusNoMemory;
+	}
+    archPageTableInsert(pt, vaddr, pfnToMaddress(pfn), this->vm_page_prot);
+    demandFaults++;
+    demandPages++;
+
+    // the window around vaddr, within its L1 table and the region
+    vaddr_t l1Start = vaddr & ~L1_MASK;
+    vaddr_t half    = (faultAround / 2) << PAGE_SHIFT;
+    vaddr_t start   = MAX((vaddr - l1Start > half) ? vaddr - half : l1Start, this->vm_start);
+    vaddr_t end     = MIN(start + (faultAround << PAGE_SHIFT), this->vm_end);
+    end             = MIN(end, l1Start + L1_MASK + 1);
+
+    pfn_t   pfns[FAULT_AROUND_MAX];
+    vaddr_t vaddrs[FAULT_AROUND_MAX];
+    ulong   count = 0;
+
+    vaddr_t a;
+    for (a = start; a < end; a += PAGE_SIZE)
+	{
+	    if (a == vaddr || _present(pt, a))
+		{
+		    continue;
+		}
+	    if (!(pfns[count] = _demandPage(this, a, fill)))
+		{   // the neighbours are optional
+		    break;
+		}
+	    vaddrs[count++] = a;
+	}
+
+    archPageTablePageUpdate(pt, pfns, vaddrs, count, this->vm_page_prot);
+    demandPages += count;
+
+    return StatusOk;
+}
+
+//______________________________________________________________________________
+/// not_present_pf handler for zero filled regions (heap, stack, bss)
+//______________________________________________________________________________
+Status
+processMemoryRegionZeroFault(ProcessMemoryRegion *this, vaddr_t faulting_address)
+{
+    return _demandFault(this, faulting_address, _zeroFill);
+}
+
+//______________________________________________________________________________
+/// not_present_pf handler for file backed regions, see ProcessMemoryFileRegion
+//______________________________________________________________________________
+Status
+processMemoryRegionFileFault(ProcessMemoryRegion *this, vaddr_t faulting_address)
+{
+    return _demandFault(this, faulting_address, _fileFill);
+}
+
+//______________________________________________________________________________
+/// make fileRegion demand paged from size bytes at data, which must stay
+/// valid for the life of the region
+//______________________________________________________________________________
+void
+processMemoryFileRegionInit(ProcessMemoryFileRegion *fileRegion, uchar *data, ulong size)
+{
+    ASSERT(fileRegion);
+    fileRegion->data                  = data;
+    fileRegion->size                  = size;
+    fileRegion->region.not_present_pf = processMemoryRegionFileFault;
+}
+
+//______________________________________________________________________________
+/// set the number of pages mapped per fault
+//______________________________________________________________________________
+void
+processMemoryRegionFaultAroundSet(ulong pages)
+{
+    faultAround = MIN(MAX(pages, 1UL), (ulong) FAULT_AROUND_MAX);
+}
+
+//______________________________________________________________________________
+/// print the demand paging counts
+//______________________________________________________________________________
+void
+processMemoryRegionDemandStatistics(void)
+{
+    xprintLog("demand faults: $[ulong]  pages: $[ulong]\n", demandFaults, demandPages);
+}
@@ -174,6 +174,9 @@ startKernel(start_info_t *si)
     pfn_t maxPfn = start_info.nr_pages;
     archPageTablePopulate(&startPfn, &maxMappedPfn, &maxPfn);
     archPageTableWalk(si->pt_base);
+
+    // secondary vCPUs share the kernel page table, so start them last
+    archSmpStart();
     // create an array of timer_lst
     // struct timer_lst timer_list[10];
 
@@ -6,14 +6,22 @@
 //______________________________________________________________________________
 
 #include <nano/common.h>
+#include <nano/archPageTable.h>
 #include <nano/interruptDeferred.h>
+#include <nano/kernelTask.h>
 #include <nano/kernelLog.h>
 #include <nano/mm.h>
+#include <nano/pageTable.h>
+#include <nano/processMemoryRegion.h>
 #include <nano/ref.h>
 #include <nano/time.h>
 #include <nano/xenEvent.h>
 #include <nano/xenEventHandler.h>
+#include <nano/xenEventPoll.h>
+#include <nano/xenEventModerate.h>
 #include <nano/xenSchedule.h>
+#include <nano/xenbus.h>
+#include <nano/xenGrant.h>
 #include <xen/io/console.h>
 
 static inline struct
@@ -30,7 +38,8 @@ static inline void
 xencons_notify_backend(void)
 {
     // Use evtchn: this is called early, before irq is set up.
-    xenEventSend(start_info.console.domU.evtchn);
+    // Within a processing pass the kicks are merged.
+    xenEventNotify(start_info.console.domU.evtchn);
 }
 
 char *userInput[10];
@@ -44,11 +53,78 @@ xencons_rx(char *buf, unsigned len)
 	{
 	    // Just repeat what's written 
 	    buf[len] = '\0';
-		temp[k] = buf[len - 1]; // a
-		k++;     
+		if (k < sizeof(temp) - 1) {
+			temp[k] = buf[len - 1]; // a
+			k++;     
+		}
 		printf("%s", buf);
 		if (buf[len-1] == '\r') {
 			printf("\n");
+			// "events" dumps the per port event statistics,
+			// "poll" the idle path's polling and latency,
+			// "pollon" and "polloff" turn that polling on and off,
+			// "timerhot" and "timercold" add and remove the timer
+			// from the polled ports,
+			// "moderate" the moderated ports, "notify" notifications,
+			// "tasks" the kernel task executor, "xenstore" xenstore
+			// pipelining, "xsbench" times reads with and without it
+			// "grants" shows grant table use and "grantbench" times
+			// grant maps one per hypercall and batched,
+			// "ptcounters" the counters of the current page table,
+			// "ptcache" the pte lookup cache, "ptflush" the
+			// batching of page table updates and TLB flushes and
+			// "ptprotect" times protection changes of the current
+			// page table's user space, leaving it read/write,
+			// "cow" shows copy-on-write forks and faults, "demand"
+			// demand paging faults and "ptsnapshot" dumps the
+			// user space mappings of the current page table,
+			// "ptpool" the pool of page table pages
+			temp[k - 1] = '\0';
+			if (strcmp(temp, "events") == 0) {
+				xenEventStatisticsPrint();
+			} else if (strcmp(temp, "poll") == 0) {
+				xenEventPollStatisticsPrint();
+			} else if (strcmp(temp, "pollon") == 0) {
+				xenEventPollEnable(true);
+			} else if (strcmp(temp, "polloff") == 0) {
+				xenEventPollEnable(false);
+			} else if (strcmp(temp, "timerhot") == 0) {
+				timePollSet(true);
+			} else if (strcmp(temp, "timercold") == 0) {
+				timePollSet(false);
+			} else if (strcmp(temp, "moderate") == 0) {
+				xenEventModerateStatisticsPrint();
+			} else if (strcmp(temp, "notify") == 0) {
+				xenEventNotifyStatisticsPrint();
+			} else if (strcmp(temp, "tasks") == 0) {
+				kernelTaskStatisticsPrint();
+			} else if (strcmp(temp, "xenstore") == 0) {
+				xenbus_statistics_print();
+			} else if (strcmp(temp, "xsbench") == 0) {
+				xenbus_benchmark_start();
+			} else if (strcmp(temp, "grants") == 0) {
+				xenGrantStatisticsPrint();
+			} else if (strcmp(temp, "grantbench") == 0) {
+				xenGrantBenchmarkStart();
+			} else if (strcmp(temp, "ptcounters") == 0) {
+				archPageTableCountersPrint(currentPt);
+			} else if (strcmp(temp, "ptcache") == 0) {
+				archPageTableCacheStatistics();
+			} else if (strcmp(temp, "ptflush") == 0) {
+				archPageTableFlushStatistics();
+			} else if (strcmp(temp, "ptprotect") == 0) {
+				archPageTableProtectBenchmark(currentPt, USERSPACE_START,
+							      PERM_READ | PERM_WRITE);
+			} else if (strcmp(temp, "cow") == 0) {
+				archPageTableCowStatistics();
+			} else if (strcmp(temp, "demand") == 0) {
+				processMemoryRegionDemandStatistics();
+			} else if (strcmp(temp, "ptsnapshot") == 0) {
+				archPageTableSnapshotConsole(currentPt);
+			} else if (strcmp(temp, "ptpool") == 0) {
+				archPageTablePtpPoolStatistics();
+			}
+			k = 0;
 		}   
 	}
 }
@@ -93,7 +169,8 @@ xencons_ring_send(int initialized, const char *data, unsigned len)
 		    wmb();
 		}      
 	    else 
-		{ // buffer full, yield
+		{ // buffer full, make sure the backend was kicked and yield
+		    xenEventNotifyFlush();
 		    xenScheduleYield();
 		}
 	}
@@ -109,22 +186,25 @@ xencons_ring_send(int initialized, const char *data, unsigned len)
 
 
 //______________________________________________________________________________
-/// console interrupt handler
+/// console input, at most budget characters, and pending output.  Runs
+/// from deferred work with the console port masked; returns the
+/// characters taken.
 //______________________________________________________________________________
-static void
-consoleHandler(evtchn_port_t port, arch_interrupt_regs_t *regs, void *ign)
+static uint
+consolePoll(evtchn_port_t port, uint budget, void *ign)
 {
-    consoleInterrupt.occured++;
     struct xencons_interface *intf = xencons_interface();
     XENCONS_RING_IDX cons, prod;
+    uint taken = 0;
     cons = intf->in_cons;
     prod = intf->in_prod;
     mb();
     BUG_ON((prod - cons) > sizeof(intf->in));
-    while (cons != prod) {
+    while (cons != prod && taken < budget) {
 		// char *c = intf->in + MASK_XENCONS_IDX(cons, intf->in);
 		xencons_rx(intf->in + MASK_XENCONS_IDX(cons, intf->in), 1);
 		cons++;
+		taken++;
     }
     mb();
     intf->in_cons = cons;
@@ -132,6 +212,17 @@ consoleHandler(evtchn_port_t port, arch_interrupt_regs_t *regs, void *ign)
     xencons_tx();
 
     consoleDoAll();
+    return taken;
+}
+
+//______________________________________________________________________________
+/// console input and output, run with events enabled
+//______________________________________________________________________________
+void
+consoleHandlerDeferred(void)
+{
+    consoleInterrupt.serviced++;
+    consolePoll(start_info.console.domU.evtchn, ~0U, NULL);
 }
 
 //______________________________________________________________________________
@@ -147,7 +238,9 @@ xencons_ring_init(void)
 	    return 0;
 	}
 
-    int err = xenEventBind(start_info.console.domU.evtchn, consoleHandler,  NULL);
+    // typing or pasting arrives a character per event, moderation
+    // takes a burst in one poll
+    int err = xenEventModerate(start_info.console.domU.evtchn, consolePoll, NULL, &consoleInterrupt);
     if (err <= 0) 
 	{
 	    printfLog("XEN console request chn bind failed %i\n", err);
@@ -0,0 +1,217 @@
+//______________________________________________________________________________
+/// eventSim: host simulation of event channel dispatch under the 2-level and
+/// FIFO ABIs (see xen/xenEventHandler.c and xen/xenEventFifo.c).
+//
+//  usage: eventSim [ports ...]
+//
+//  For each port count every port is made pending, the upcall drains them
+//  and, half way through, the timer fires.  Reports the cost per dispatched
+//  event and how many bulk events were handled between the timer firing and
+//  its handler running.  The 2-level ABI is only simulated up to its 4096
+//  port limit.  Xen's side (setting pending and linking) is modelled with
+//  plain memory operations; nothing here runs under a hypervisor.
+//______________________________________________________________________________
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define WORD_BITS     64
+#define PORTS_2L      (WORD_BITS * WORD_BITS)
+#define PORTS_FIFO    (1 << 17)
+#define QUEUES        16
+#define PRIORITY_HIGH 0
+#define PRIORITY_DEF  7
+
+#define PENDING (1u << 31)
+#define MASKED  (1u << 30)
+#define LINKED  (1u << 29)
+#define LINK_MASK ((1u << 17) - 1)
+
+static unsigned int timerPort;         // last port bound, as at boot
+static unsigned long dispatched, timerFire, timerLatency;
+static volatile unsigned long work;
+
+//______________________________________________________________________________
+/// the work a handler does, the same for both ABIs
+//______________________________________________________________________________
+static void
+handler(unsigned int port)
+{
+    work += port;
+    dispatched++;
+    if (port == timerPort)
+	{
+	    timerLatency = dispatched - timerFire - 1;
+	}
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+//______________________________________________________________________________
+/// 2-level: selector word plus pending bitmap, as xenEventHandlerCallback
+//______________________________________________________________________________
+static uint64_t pending[WORD_BITS], selector;
+
+static void
+raise2l(unsigned int port)
+{
+    pending[port / WORD_BITS]  |= 1ULL << (port % WORD_BITS);
+    selector                   |= 1ULL << (port / WORD_BITS);
+}
+
+static void
+upcall2l(unsigned int ports)
+{
+    while (selector)
+	{
+	    uint64_t l1 = selector;
+	    selector = 0;
+	    while (l1)
+		{
+		    unsigned int l1i = __builtin_ctzll(l1);
+		    l1 &= ~(1ULL << l1i);
+		    uint64_t l2;
+		    while ((l2 = pending[l1i]) != 0)
+			{
+			    unsigned int port = l1i * WORD_BITS + __builtin_ctzll(l2);
+			    pending[l1i] &= ~(1ULL << (port % WORD_BITS));
+			    handler(port);
+			    if (dispatched == ports / 2)
+				{
+				    timerFire = dispatched;
+				    raise2l(timerPort);
+				}
+			}
+		}
+	}
+}
+
+//______________________________________________________________________________
+/// FIFO: per priority queues linked through the event words
+//______________________________________________________________________________
+static uint32_t word[PORTS_FIFO];
+static uint8_t  priority[PORTS_FIFO];
+static uint32_t head[QUEUES], tail[QUEUES], guestHead[QUEUES], ready;
+
+static void
+raiseFifo(unsigned int port)
+{
+    uint32_t *w = &word[port];
+    *w |= PENDING;
+    if ((*w & (MASKED | LINKED)))
+	{
+	    return;
+	}
+    *w |= LINKED;
+    unsigned int q = priority[port];
+    if (tail[q] && (word[tail[q]] & LINKED))
+	{
+	    word[tail[q]] = (word[tail[q]] & ~LINK_MASK) | port;
+	}
+    else
+	{
+	    head[q] = port;
+	}
+    tail[q] = port;
+    ready |= 1u << q;
+}
+
+static void
+upcallFifo(unsigned int ports)
+{
+    uint32_t r = ready;
+    ready = 0;
+    while (r)
+	{
+	    unsigned int q = __builtin_ctz(r);
+	    uint32_t h = guestHead[q];
+	    if (!h)
+		{
+		    h = head[q];
+		}
+	    unsigned int port = h;
+	    h = word[port] & LINK_MASK;
+	    word[port] &= ~(LINKED | LINK_MASK);
+	    if (!h)
+		{
+		    r &= ~(1u << q);
+		}
+	    guestHead[q] = h;
+	    if ((word[port] & PENDING) && !(word[port] & MASKED))
+		{
+		    word[port] &= ~PENDING;
+		    handler(port);
+		    if (dispatched == ports / 2)
+			{
+			    timerFire = dispatched;
+			    raiseFifo(timerPort);
+			}
+		}
+	    r |= ready;
+	    ready = 0;
+	}
+}
+
+//______________________________________________________________________________
+/// run one ABI over ports active ports
+//______________________________________________________________________________
+static void
+run(const char *abi, unsigned int ports, int fifo)
+{
+    unsigned int p;
+    dispatched = timerFire = timerLatency = 0;
+    timerPort  = ports;       // bound after the bulk ports, port 0 is reserved
+
+    double start = now();
+    for (p=1; p<ports; p++)
+	{
+	    fifo ? raiseFifo(p) : raise2l(p);
+	}
+    fifo ? upcallFifo(ports) : upcall2l(ports);
+    double ns = now() - start;
+
+    printf("%-8s %7u ports  %8lu events  %6.1f ns/event  timer waited %6lu events\n",
+	   abi, ports, dispatched, ns / dispatched, timerLatency);
+}
+
+int
+main(int argc, char **argv)
+{
+    static const unsigned int defaults[] = { 1024, 4000, 16384, 65536, 130000 };
+    unsigned int i, n = argc > 1 ? argc - 1 : sizeof(defaults) / sizeof(defaults[0]);
+
+    for (i=0; i<n; i++)
+	{
+	    unsigned int ports = argc > 1 ? strtoul(argv[i+1], NULL, 0) : defaults[i];
+	    if (ports < 2 || ports >= PORTS_FIFO)
+		{
+		    fprintf(stderr, "eventSim: ports must be in 2..%d\n", PORTS_FIFO - 1);
+		    return 1;
+		}
+
+	    if (ports < PORTS_2L)
+		{
+		    memset(pending, 0, sizeof(pending));
+		    selector = 0;
+		    run("2-level", ports, 0);
+		}
+
+	    memset(word, 0, sizeof(word));
+	    memset(priority, PRIORITY_DEF, sizeof(priority));
+	    memset(head, 0, sizeof(head));
+	    memset(tail, 0, sizeof(tail));
+	    memset(guestHead, 0, sizeof(guestHead));
+	    priority[ports] = PRIORITY_HIGH;
+	    run("FIFO", ports, 1);
+	}
+    return 0;
+}
@@ -0,0 +1,186 @@
+//______________________________________________________________________________
+/// ptSnapshot: host decoder for page table snapshots written by
+/// archPageTableSnapshot (see include/nano/pageTableSnapshot.h).
+//
+//  usage: ptSnapshot [-v] [file]
+//
+//  file (default stdin) is either the raw binary snapshot or a console log
+//  holding PTSNAP lines; other log lines are skipped.  Prints a summary of
+//  the address space, the L1 tables that map few pages (page table bloat)
+//  and, with -v, every run.
+//______________________________________________________________________________
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/nano/pageTableSnapshot.h"
+
+#define PAGE_SHIFT    12
+#define L1_SHIFT      21          // bytes mapped by one L1 table
+#define L1_ENTRIES    512
+#define SPARSE_PAGES  16          // L1 tables mapping fewer pages are reported
+
+static FILE *input;
+static int   text;                // console log rather than binary
+
+//______________________________________________________________________________
+/// read the next structure of length bytes into data, 0 at end of input
+//______________________________________________________________________________
+static int
+readNext(void *data, size_t length)
+{
+    if (!text)
+	{
+	    return fread(data, length, 1, input) == 1;
+	}
+
+    char line[1024];
+    while (fgets(line, sizeof(line), input))
+	{
+	    char *hex = strstr(line, PT_SNAPSHOT_PREFIX);
+	    if (!hex)
+		{
+		    continue;
+		}
+	    hex += strlen(PT_SNAPSHOT_PREFIX);
+
+	    unsigned char *byte = data;
+	    size_t i;
+	    for (i=0; i<length; i++)
+		{
+		    unsigned int value;
+		    if (sscanf(hex + 2*i, "%2x", &value) != 1)
+			{
+			    fprintf(stderr, "ptSnapshot: short line: %s", line);
+			    return 0;
+			}
+		    byte[i] = value;
+		}
+	    return 1;
+	}
+    return 0;
+}
+
+//______________________________________________________________________________
+/// the L1 table being accumulated
+//______________________________________________________________________________
+static unsigned long long l1Base = ~0ULL;
+static unsigned long      l1Pages;
+static unsigned long      l1Tables, l1Sparse;
+
+static void
+l1Done(int verbose)
+{
+    if (l1Base == ~0ULL)
+	{
+	    return;
+	}
+    l1Tables++;
+    if (l1Pages < SPARSE_PAGES)
+	{
+	    l1Sparse++;
+	    if (verbose)
+		{
+		    printf("  sparse L1 %016llx: %lu of %d pages\n", l1Base, l1Pages, L1_ENTRIES);
+		}
+	}
+}
+
+static void
+l1Add(unsigned long long vaddr, unsigned long pages, int verbose)
+{
+    while (pages)
+	{
+	    unsigned long long base = vaddr & ~((1ULL << L1_SHIFT) - 1);
+	    unsigned long      left = (base + (1ULL << L1_SHIFT) - vaddr) >> PAGE_SHIFT;
+	    unsigned long      here = pages < left ? pages : left;
+
+	    if (base != l1Base)
+		{
+		    l1Done(verbose);
+		    l1Base  = base;
+		    l1Pages = 0;
+		}
+	    l1Pages += here;
+	    vaddr   += (unsigned long long) here << PAGE_SHIFT;
+	    pages   -= here;
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+    int verbose = 0;
+    if (argc > 1 && !strcmp(argv[1], "-v"))
+	{
+	    verbose = 1;
+	    argc--, argv++;
+	}
+
+    input = argc > 1 ? fopen(argv[1], "rb") : stdin;
+    if (!input)
+	{
+	    perror(argv[1]);
+	    return 1;
+	}
+
+    // binary snapshots start with the magic number
+    int c = getc(input);
+    ungetc(c, input);
+    text = (c != (PT_SNAPSHOT_MAGIC & 0xff));
+
+    PageTableSnapshotHeader header;
+    if (!readNext(&header, sizeof(header)) || header.magic != PT_SNAPSHOT_MAGIC)
+	{
+	    fprintf(stderr, "ptSnapshot: no snapshot header\n");
+	    return 1;
+	}
+    if (header.version != PT_SNAPSHOT_VERSION)
+	{
+	    fprintf(stderr, "ptSnapshot: unknown version %u\n", header.version);
+	    return 1;
+	}
+
+    printf("page table %016llx  tsc %llu\n", header.pt, header.tsc);
+
+    unsigned long runs = 0, pages = 0, writable = 0, shared = 0, foreign = 0;
+    PageTableSnapshotRun run;
+    while (readNext(&run, sizeof(run)) && run.pages)
+	{
+	    runs++;
+	    pages += run.pages;
+	    if (run.flags & 0x2)
+		{
+		    writable += run.pages;
+		}
+	    if (run.count == PT_SNAPSHOT_FOREIGN)
+		{
+		    foreign += run.pages;
+		}
+	    else if (run.count > 1)
+		{
+		    shared += run.pages;
+		}
+	    if (verbose)
+		{
+		    printf("%016llx-%016llx  maddr %016llx  flags %08x  count %u\n",
+			   run.vaddr, run.vaddr + ((unsigned long long) run.pages << PAGE_SHIFT),
+			   run.maddr, run.flags, run.count);
+		}
+	    l1Add(run.vaddr, run.pages, verbose);
+	}
+    l1Done(verbose);
+
+    if (run.pages)
+	{
+	    fprintf(stderr, "ptSnapshot: truncated snapshot\n");
+	}
+
+    printf("runs %lu  pages %lu  writable %lu  shared %lu  foreign %lu\n",
+	   runs, pages, writable, shared, foreign);
+    printf("L1 tables %lu  sparse (< %d pages) %lu  pages per L1 %.1f\n",
+	   l1Tables, SPARSE_PAGES, l1Sparse, l1Tables ? (double) pages / l1Tables : 0.0);
+
+    return run.pages ? 1 : 0;
+}
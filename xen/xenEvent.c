@@ -14,23 +14,77 @@
 #include <nano/mm.h>
 #include <nano/xenEventHandler.h>
 #include <nano/xenEvent.h>
+#include <nano/xenEventFifo.h>
 #include <nano/fmt.h>
 
-#define NR_EVS 1024
+#define NR_EVS     EVTCHN_FIFO_NR_CHANNELS   // most ports of either ABI
+#define NR_EVS_2L  1024                      // ports under the 2-level ABI
+#define EV_CHUNK   64                        // actions allocated together
+#define EV_CHUNK_ORDER 2                     // pages holding a chunk
 
 // this represents an event handler. Chaining or sharing is not allowed.
 typedef struct _ev_action_t 
 {
-    evtchn_handler_t  handler;
-    void             *data;
-    u32               count;
+    evtchn_handler_t        handler;
+    void                   *data;
+    uint                    cpu;          // vCPU the port is bound to
+    XenEventPortStatistics  statistics;
 } ev_action_t;
 
-static ev_action_t ev_actions[NR_EVS];
+// actions are allocated a chunk at a time as ports are bound, the first
+// chunk is static as it covers the ports handed over at start of day
+static ev_action_t  ev_actions0[EV_CHUNK];
+static ev_action_t *ev_actions[NR_EVS/EV_CHUNK] = { ev_actions0 };
 void xenEventDefaultHandler(evtchn_port_t port, arch_interrupt_regs_t *regs, void *data);
 
 static ulong bound_ports[NR_EVS/(8*sizeof(unsigned long))];
 
+ulong xenEventCpuMask[ARCH_CPUS_MAX][XEN_EVENT_2L_WORDS];
+
+static uint  nr_evs = NR_EVS_2L;             // ports usable under current ABI
+
+//______________________________________________________________________________
+/// the action for a port, NULL if create is false and none was bound
+//______________________________________________________________________________
+static ev_action_t *
+_action(evtchn_port_t port, bool create)
+{
+    ev_action_t *chunk = ev_actions[port / EV_CHUNK];
+
+    if (!chunk)
+	{
+	    if (!create)
+		{
+		    return NULL;
+		}
+	    ASSERT(EV_CHUNK * sizeof(ev_action_t) <= PAGE_SIZE << EV_CHUNK_ORDER);
+	    chunk = (ev_action_t *) pageKernelAlloc(EV_CHUNK_ORDER);
+	    memset(chunk, 0, EV_CHUNK * sizeof(ev_action_t));
+	    int i;
+	    for (i = 0; i < EV_CHUNK; i++)
+		{
+		    chunk[i].handler = xenEventDefaultHandler;
+		}
+	    ev_actions[port / EV_CHUNK] = chunk;
+	}
+
+    return chunk + port % EV_CHUNK;
+}
+
+//______________________________________________________________________________
+/// move port to cpu in the per-vCPU masks the 2-level upcall filters by
+//______________________________________________________________________________
+static void
+_cpuSet(evtchn_port_t port, ev_action_t *action, uint cpu)
+{
+    if (port < NR_EVS_2L)
+	{
+	    clear_bit(port, xenEventCpuMask[action->cpu]);
+	    set_bit(port, xenEventCpuMask[cpu]);
+	}
+    action->cpu = cpu;
+}
+
 //______________________________________________________________________________
 /// close each port
 //______________________________________________________________________________
@@ -39,7 +93,7 @@ xenEventUnbindAllPorts(void)
 {
     int i;
     
-    for (i = 0; i < NR_EVS; i++) // foreach event
+    for (i = 0; i < nr_evs; i++) // foreach event
 	{
 	    if (test_and_clear_bit(i, bound_ports))
 		{
@@ -51,6 +105,21 @@ xenEventUnbindAllPorts(void)
 	}
 }
   
+//______________________________________________________________________________
+/// histogram bucket of a handler duration
+//______________________________________________________________________________
+static inline uint
+_bucket(ulong cycles)
+{
+    uint log2 = 63 - __builtin_clzl(cycles | 1);
+
+    if (log2 <= XEN_EVENT_HISTOGRAM_SHIFT)
+	{
+	    return 0;
+	}
+    return MIN(log2 - XEN_EVENT_HISTOGRAM_SHIFT, XEN_EVENT_HISTOGRAM_BUCKETS - 1);
+}
+
 //_____________________________________________________________________
 /// Demux events to different handlers.
 //_____________________________________________________________________
@@ -61,39 +130,241 @@ xenEventHandle(evtchn_port_t port,           ///< event to be handled
 {
     ev_action_t *action;
     ASSERT(regs);
-    ASSERT(port < NR_EVS);
-    if (port >= NR_EVS)
+    ASSERT(port < nr_evs);
+    if (port >= nr_evs)
+	{
+	    printfLog("port (0x%x) >= nr_evs (0x%x)\n", port, nr_evs);
+	    goto out;
+	}
+    action = _action(port, false);
+    if (!action)
 	{
-	    printfLog("port (0x%x) >= NR_EVS (0x%x)\n", port, NR_EVS);
+	    xenEventDefaultHandler(port, regs, NULL);
 	    goto out;
 	}
-    action = &ev_actions[port];
-    action->count++;
+
+    // cleared before the handler so that a notification arriving while it
+    // runs is seen, rather than lost with this one
+    xenEventHandlerClearPort(port);
+
+    XenEventPortStatistics *s = &action->statistics;
+    uint64 start = getTsc();
+    ulong  latency = start - xenEventUpcallTsc;
     
     // Call the handler.
     action->handler(port, regs, action->data);    
+
+    ulong cycles = getTsc() - start;
+    s->events++;
+    s->cycles       += cycles;
+    s->latencyTotal += latency;
+    if (latency > s->latencyMax)
+	{
+	    s->latencyMax = latency;
+	}
+    s->histogram[_bucket(cycles)]++;
+    if (xenEventHandlerPending(port))
+	{
+	    s->coalesced++;
+	}
+    return;
  out:
     xenEventHandlerClearPort(port);
 }
 
 //______________________________________________________________________________
-/// provide an event handler for a port (and also some data)
+/// statistics of a port, false if it was never bound
+//______________________________________________________________________________
+bool
+xenEventPortStatistics(evtchn_port_t port,                  ///< port of interest
+		       XenEventPortStatistics *statistics   ///< returns its statistics
+		       )
+{
+    ev_action_t *action = port < nr_evs ? _action(port, false) : NULL;
+
+    if (!action)
+	{
+	    return false;
+	}
+    *statistics = action->statistics;
+    return true;
+}
+
+//______________________________________________________________________________
+/// call visit on each port which has seen events
 //______________________________________________________________________________
-evtchn_port_t
+static void
+_statisticsEach(void (*visit)(evtchn_port_t, XenEventPortStatistics *, void *), void *arg)
+{
+    uint c, i;
+
+    for (c = 0; c < nr_evs / EV_CHUNK; c++)
+	{
+	    ev_action_t *chunk = ev_actions[c];
+	    if (!chunk)
+		{
+		    continue;
+		}
+	    for (i = 0; i < EV_CHUNK; i++)
+		{
+		    if (chunk[i].statistics.events)
+			{
+			    visit(c * EV_CHUNK + i, &chunk[i].statistics, arg);
+			}
+		}
+	}
+}
+
+static void
+_cyclesSum(evtchn_port_t port, XenEventPortStatistics *s, void *arg)
+{
+    *(ulong *) arg += s->cycles;
+}
+
+static void
+_statisticsPrint(evtchn_port_t port, XenEventPortStatistics *s, void *arg)
+{
+    ulong total = *(ulong *) arg;
+
+    xprintLog("port $[uint]: events $[ulong] coalesced $[ulong] cycles $[ulong] ($[ulong]%) "
+	      "mean $[ulong] latency mean $[ulong] max $[ulong]\n",
+	      port, s->events, s->coalesced, s->cycles, total ? 100 * s->cycles / total : 0,
+	      s->cycles / s->events, s->latencyTotal / s->events, s->latencyMax);
+
+    uint b;
+    for (b = 0; b < XEN_EVENT_HISTOGRAM_BUCKETS; b++)
+	{
+	    if (s->histogram[b])
+		{
+		    xprintLog("    < 2^$[uint] cycles: $[ulong]\n",
+			      b + XEN_EVENT_HISTOGRAM_SHIFT + 1, s->histogram[b]);
+		}
+	}
+}
+
+//______________________________________________________________________________
+/// print per port event counts, handler time and its share, and latency
+//______________________________________________________________________________
+void
+xenEventStatisticsPrint(void)
+{
+    ulong total = 0;
+
+    _statisticsEach(_cyclesSum, &total);
+    xprintLog("event ports: $[ulong] handler cycles in all\n", total);
+    _statisticsEach(_statisticsPrint, &total);
+}
+
+typedef struct {
+    XenEventExportWrite  write;
+    void                *arg;
+    uint                 ports;
+} Export;
+
+static void
+_portCount(evtchn_port_t port, XenEventPortStatistics *s, void *arg)
+{
+    (*(uint *) arg)++;
+}
+
+static void
+_export(evtchn_port_t port, XenEventPortStatistics *s, void *arg)
+{
+    Export *export = arg;
+    XenEventExportRecord record;
+
+    record.port       = port;
+    record.pad        = 0;
+    record.statistics = *s;
+    export->write(export->arg, &record, sizeof(record));
+    export->ports++;
+}
+
+//______________________________________________________________________________
+/// write the statistics of every port which has seen events, returns the
+/// number of ports written
+//______________________________________________________________________________
+uint
+xenEventStatisticsExport(XenEventExportWrite write,  ///< consumer of the records
+			 void *arg                   ///< passed to write
+			 )
+{
+    XenEventExportHeader header;
+    Export export = { write, arg, 0 };
+
+    header.magic   = XEN_EVENT_EXPORT_MAGIC;
+    header.version = XEN_EVENT_EXPORT_VERSION;
+    header.ports   = 0;
+    header.buckets = XEN_EVENT_HISTOGRAM_BUCKETS;
+    header.tsc     = getTsc();
+    _statisticsEach(_portCount, &header.ports);
+    write(arg, &header, sizeof(header));
+
+    _statisticsEach(_export, &export);
+    ASSERT(export.ports == header.ports);
+    return export.ports;
+}
+
+static void
+_exportConsoleWrite(void *arg, const void *data, ulong length)
+{
+    printHexLog(XEN_EVENT_EXPORT_PREFIX, data, length);
+}
+
+//______________________________________________________________________________
+/// export the statistics to the console as hex lines
+//______________________________________________________________________________
+void
+xenEventStatisticsExportConsole(void)
+{
+    xenEventStatisticsExport(_exportConsoleWrite, NULL);
+}
+
+static void
+_reset(evtchn_port_t port, XenEventPortStatistics *s, void *arg)
+{
+    memset(s, 0, sizeof(*s));
+}
+
+//______________________________________________________________________________
+/// start counting afresh, e.g. before a load test
+//______________________________________________________________________________
+void
+xenEventStatisticsReset(void)
+{
+    _statisticsEach(_reset, NULL);
+}
+
+//______________________________________________________________________________
+/// provide an event handler for a port (and also some data).  Returns the
+/// port, or a negative value if the event array cannot cover it.
+//______________________________________________________________________________
+int
 xenEventBind(evtchn_port_t port,               ///< event to bind to a handler
 	     evtchn_handler_t handler,         ///< the procedure to call on the event
 	     void *data                        ///< data to be associated with handler
 	     )
 {
-    if (ev_actions[port].handler != xenEventDefaultHandler)
+    BUG_ON(port >= nr_evs);
+    ev_action_t *action = _action(port, true);
+
+    if (action->handler != xenEventDefaultHandler)
 	{
 	    printfLog("WARN: Handler for port %d already registered, replacing\n",
 		   port);
 	}
 
-    ev_actions[port].data = data;
+    // Xen drops events on ports the event array does not yet cover
+    int err;
+    if (xenEventFifoActive && (err = xenEventFifoSetup(port)))
+	{
+	    return err < 0 ? err : -1;
+	}
+
+    action->data = data;
     wmb();
-    ev_actions[port].handler = handler;
+    action->handler = handler;
+    _cpuSet(port, action, action->cpu);
 
     // Finally unmask the port 
     xenEventHandlerUnmask(port);
@@ -108,13 +379,78 @@ void
 xenEventUnbind(evtchn_port_t port            ///< remove the handler on a port
 		 )
 {
-    if (ev_actions[port].handler == xenEventDefaultHandler)
+    ev_action_t *action = _action(port, false);
+
+    if (!action || action->handler == xenEventDefaultHandler)
 	{
 	    printfLog("WARN: No handler for port %d when unbinding\n", port);
+	    return;
 	}
-    ev_actions[port].handler = xenEventDefaultHandler;
+    action->handler = xenEventDefaultHandler;
     wmb();
-    ev_actions[port].data = NULL;
+    action->data = NULL;
+    if (port < NR_EVS_2L)
+	{
+	    clear_bit(port, xenEventCpuMask[action->cpu]);
+	}
+    action->cpu = 0;
+}
+
+//______________________________________________________________________________
+/// deliver the events of port to vCPU cpu
+//______________________________________________________________________________
+int
+xenEventBindCpu(evtchn_port_t port,      ///< bound port
+		uint cpu                 ///< vCPU to take its events
+		)
+{
+    ev_action_t *action = _action(port, false);
+
+    if (!action || cpu >= archCpuCount())
+	{
+	    return -1;
+	}
+
+    evtchn_bind_vcpu_t op;
+    op.port = port;
+    op.vcpu = cpu;
+    int err = HYPERVISOR_event_channel_op(EVTCHNOP_bind_vcpu, &op);
+    if (!err)
+	{
+	    _cpuSet(port, action, cpu);
+	}
+    return err;
+}
+
+//______________________________________________________________________________
+/// vCPU the events of port are delivered to
+//______________________________________________________________________________
+uint
+xenEventCpu(evtchn_port_t port)
+{
+    ev_action_t *action = port < nr_evs ? _action(port, false) : NULL;
+
+    return action ? action->cpu : 0;
+}
+
+//______________________________________________________________________________
+/// set the priority a port is serviced at, lower first.  Only the FIFO ABI
+/// has priorities; under the 2-level ABI this is a no-op.
+//______________________________________________________________________________
+int
+xenEventPrioritySet(evtchn_port_t port,      ///< port to prioritize
+		    uint priority            ///< XEN_EVENT_PRIORITY_HIGH ... _BULK
+		    )
+{
+    if (!xenEventFifoActive)
+	{
+	    return 0;
+	}
+
+    evtchn_set_priority_t op;
+    op.port     = port;
+    op.priority = priority;
+    return HYPERVISOR_event_channel_op(EVTCHNOP_set_priority, &op);
 }
 
 //______________________________________________________________________________
@@ -125,6 +461,20 @@ xenEventBindVirq(uint32_t virq,               ///< virtual irq
 		 evtchn_handler_t handler,    ///< handler for the virq
 		 void *data                   ///< data to be passed to handler
 		 )
+{
+    return xenEventBindVirqPriority(virq, handler, data, XEN_EVENT_PRIORITY_DEFAULT, NULL);
+}
+
+//______________________________________________________________________________
+/// bind a virtual irq to a handler, serviced at priority
+//______________________________________________________________________________
+int
+xenEventBindVirqPriority(uint32_t virq,               ///< virtual irq
+			 evtchn_handler_t handler,    ///< handler for the virq
+			 void *data,                  ///< data to be passed to handler
+			 uint priority,               ///< XEN_EVENT_PRIORITY_HIGH ... _BULK
+			 evtchn_port_t *port          ///< if not NULL, returns the port bound
+			 )
 {
     evtchn_bind_virq_t op;
 
@@ -139,24 +489,50 @@ xenEventBindVirq(uint32_t virq,               ///< virtual irq
 	}
 
     set_bit(op.port,bound_ports);
-    xenEventBind(op.port, handler, data);
+    xenEventPrioritySet(op.port, priority);
+    _action(op.port, true)->cpu = op.vcpu;
+    if (xenEventBind(op.port, handler, data) < 0)
+	{
+	    return 1;
+	}
+    if (port)
+	{
+	    *port = op.port;
+	}
     return 0;
 }
 
-#if defined(__x86_64__)
-
-// Allocate 4 pages for the irqstack
-#define STACK_PAGES 4
-char irqstack[1024 * 4 * STACK_PAGES];
-
-static struct pda
+//______________________________________________________________________________
+/// bind an inter-processor event delivered to vCPU cpu
+//______________________________________________________________________________
+int
+xenEventBindIpi(uint cpu,                     ///< vCPU the IPI is delivered to
+		evtchn_handler_t handler,     ///< handler for the IPI
+		void *data,                   ///< data to be passed to handler
+		evtchn_port_t *port           ///< if not NULL, returns the port bound
+		)
 {
-    int irqcount;       // offset 0 (used in x86_64.S)
-    char *irqstackptr;  //        8 
-} cpu0_pda;
+    evtchn_bind_ipi_t op;
 
-#endif
+    op.vcpu = cpu;
+    if (HYPERVISOR_event_channel_op(EVTCHNOP_bind_ipi, &op) != 0)
+	{
+	    printfLog("Failed to bind IPI for vCPU %d\n", cpu);
+	    return 1;
+	}
 
+    set_bit(op.port, bound_ports);
+    _action(op.port, true)->cpu = cpu;
+    if (xenEventBind(op.port, handler, data) < 0)
+	{
+	    return 1;
+	}
+    if (port)
+	{
+	    *port = op.port;
+	}
+    return 0;
+}
 
 //________________________________________________________________________
 /// Initially all events are without a handler and disabled
@@ -165,19 +541,28 @@ void
 xenEventInit(void)
 {
     int i;
-#if defined(__x86_64__)
-    asm volatile("movl %0,%%fs ; movl %0,%%gs" :: "r" (0));
-    wrmsrl(0xc0000101, &cpu0_pda); /* 0xc0000101 is MSR_GS_BASE */
-    cpu0_pda.irqcount = -1;
-    cpu0_pda.irqstackptr = irqstack + 1024 * 4 * STACK_PAGES;
-#endif
 
     // inintialise event handler
-    for ( i = 0; i < NR_EVS; i++ )
+    for ( i = 0; i < EV_CHUNK; i++ )
 	{
-	    ev_actions[i].handler = xenEventDefaultHandler;
-	    xenEventHandlerMask(i);
+	    ev_actions0[i].handler = xenEventDefaultHandler;
 	}
+
+    // the FIFO ABI starts with every port masked, the 2-level one must
+    // mask them here
+    if (xenEventFifoInit())
+	{
+	    nr_evs = NR_EVS;
+	}
+    else
+	{
+	    for ( i = 0; i < NR_EVS_2L; i++ )
+		{
+		    xenEventHandlerMask(i);
+		}
+	}
+    printfLog("event channels: %s ABI, %d ports\n",
+	      xenEventFifoActive ? "FIFO" : "2-level", nr_evs);
 }
 
 //______________________________________________________________________________
@@ -216,7 +601,10 @@ xenEventAllocUnbound(domid_t pal,                 ///< other domain for event ch
     int err = HYPERVISOR_event_channel_op(EVTCHNOP_alloc_unbound, &op);
     if (err)
 	return err;
-    *port = xenEventBind(op.port, handler, data);
+    int bound = xenEventBind(op.port, handler, data);
+    if (bound < 0)
+	return bound;
+    *port = bound;
     return err;
 }
 
@@ -241,7 +629,10 @@ xenEventBindInterdomain(domid_t pal,                 ///< other domain communica
     set_bit(op.local_port, bound_ports);
     evtchn_port_t port = op.local_port;
     xenEventHandlerClearPort(port);	      // Without, handler gets invoked now!
-    *local_port = xenEventBind(port, handler, data);
+    int bound = xenEventBind(port, handler, data);
+    if (bound < 0)
+	return bound;
+    *local_port = bound;
     return err;
 }
 
@@ -258,3 +649,153 @@ xenEventSend(evtchn_port_t port ///< Port on which to send event
     return err;
 }
 
+// notifications collected during a processing pass, sent together
+#define NOTIFY_BATCH_MAX 16
+
+static evtchn_send_t      notifySend[NOTIFY_BATCH_MAX];
+static multicall_entry_t  notifyCalls[NOTIFY_BATCH_MAX];
+static uint               notifyCount;
+static uint               notifyDepth;
+static XenEventNotifyStatistics notifyStatistics;
+
+//______________________________________________________________________________
+/// send the collected notifications, one hypercall for all of them
+//______________________________________________________________________________
+void
+xenEventNotifyFlush(void)
+{
+    ulong flags;
+    uint  i;
+
+    if (smp_processor_id())
+	{
+	    return;
+	}
+    local_irq_save(flags);
+    if (notifyCount == 1)
+	{
+	    (void) xenEventSend(notifySend[0].port);
+	    notifyStatistics.hypercalls++;
+	}
+    else if (notifyCount > 1)
+	{
+	    for (i = 0; i < notifyCount; i++)
+		{
+		    notifyCalls[i].op      = __HYPERVISOR_event_channel_op;
+		    notifyCalls[i].args[0] = EVTCHNOP_send;
+		    notifyCalls[i].args[1] = (ulong) &notifySend[i];
+		}
+	    int err = HYPERVISOR_multicall(notifyCalls, notifyCount);
+	    BUG_ON(err);
+	    for (i = 0; i < notifyCount; i++)
+		{
+		    if (notifyCalls[i].result)
+			{
+			    printfLog("notify of port %d failed with %ld\n",
+				      notifySend[i].port, (long) notifyCalls[i].result);
+			}
+		}
+	    notifyStatistics.hypercalls++;
+	    notifyStatistics.batches++;
+	}
+    notifyCount = 0;
+    local_irq_restore(flags);
+}
+
+//______________________________________________________________________________
+/// start a processing pass, notifications are held until the outermost
+/// xenEventNotifyEnd
+//______________________________________________________________________________
+void
+xenEventNotifyBegin(void)
+{
+    ulong flags;
+
+    // batches are kept by CPU 0 only, other CPUs send at once
+    if (smp_processor_id())
+	{
+	    return;
+	}
+    local_irq_save(flags);
+    notifyDepth++;
+    local_irq_restore(flags);
+}
+
+//______________________________________________________________________________
+/// end a processing pass, sending what was collected if it is the outermost
+//______________________________________________________________________________
+void
+xenEventNotifyEnd(void)
+{
+    ulong flags;
+
+    if (smp_processor_id())
+	{
+	    return;
+	}
+    local_irq_save(flags);
+    ASSERT(notifyDepth);
+    if (--notifyDepth == 0)
+	{
+	    xenEventNotifyFlush();
+	}
+    local_irq_restore(flags);
+}
+
+//______________________________________________________________________________
+/// notify the remote end of port, at the end of the pass if one is open
+//______________________________________________________________________________
+void
+xenEventNotify(evtchn_port_t port   ///< port to kick
+	       )
+{
+    ulong flags;
+    uint  i;
+
+    local_irq_save(flags);
+    notifyStatistics.requested++;
+    if (!notifyDepth || smp_processor_id())
+	{
+	    (void) xenEventSend(port);
+	    notifyStatistics.hypercalls++;
+	    goto out;
+	}
+
+    for (i = 0; i < notifyCount; i++)
+	{
+	    if (notifySend[i].port == port)
+		{
+		    notifyStatistics.duplicates++;
+		    goto out;
+		}
+	}
+
+    if (notifyCount == NOTIFY_BATCH_MAX)
+	{
+	    xenEventNotifyFlush();
+	}
+    notifySend[notifyCount++].port = port;
+ out:
+    local_irq_restore(flags);
+}
+
+//______________________________________________________________________________
+/// copy of the notification counters, requested - hypercalls were saved
+//______________________________________________________________________________
+void
+xenEventNotifyStatistics(XenEventNotifyStatistics *statistics)
+{
+    *statistics = notifyStatistics;
+}
+
+//______________________________________________________________________________
+/// print notification counters
+//______________________________________________________________________________
+void
+xenEventNotifyStatisticsPrint(void)
+{
+    XenEventNotifyStatistics *s = &notifyStatistics;
+
+    xprintLog("notify: requested $[ulong] duplicates $[ulong] hypercalls $[ulong] batches $[ulong] saved $[ulong]\n",
+	      s->requested, s->duplicates, s->hypercalls, s->batches, s->requested - s->hypercalls);
+}
@@ -0,0 +1,278 @@
+//______________________________________________________________________________
+/// FIFO event channel ABI
+///   each port has an event word in the event array, pages of which are
+///   handed to Xen as ports are bound.  Pending unmasked events are linked
+///   by Xen onto one of 16 priority queues whose heads live in the control
+///   block; the upcall drains the highest priority ready queue first and
+///   rechecks readiness after every event, so a timer event overtakes a
+///   backlog of bulk events.
+//
+//  Follows the Xen FIFO event channel design (EVTCHNOP_init_control,
+//  EVTCHNOP_expand_array, EVTCHNOP_set_priority).
+//______________________________________________________________________________
+
+#include <nano/common.h>
+#include <nano/mm.h>
+#include <nano/xenEventHandler.h>
+#include <nano/xenEvent.h>
+#include <nano/xenEventFifo.h>
+#include <nano/fmt.h>
+
+#define EVENT_WORDS_PER_PAGE  (PAGE_SIZE / sizeof(event_word_t))
+#define EVENT_ARRAY_PAGES_MAX (EVTCHN_FIFO_NR_CHANNELS / EVENT_WORDS_PER_PAGE)
+
+bool xenEventFifoActive;
+
+// one control block per vCPU, holding the heads of its queues
+static evtchn_fifo_control_block_t *controlBlock[ARCH_CPUS_MAX];
+
+// guest side copy of each queue head, Xen only updates the control block
+// head when a queue goes from empty to non-empty
+static evtchn_port_t queueHead[ARCH_CPUS_MAX][EVTCHN_FIFO_MAX_QUEUES];
+
+static event_word_t *eventArray[EVENT_ARRAY_PAGES_MAX];
+static uint          eventArrayPages;
+
+//______________________________________________________________________________
+/// the event word for a port, ports beyond the event array are never linked
+//______________________________________________________________________________
+static inline volatile event_word_t *
+_word(evtchn_port_t port)
+{
+    ASSERT(port / EVENT_WORDS_PER_PAGE < eventArrayPages);
+    return eventArray[port / EVENT_WORDS_PER_PAGE] + port % EVENT_WORDS_PER_PAGE;
+}
+
+//______________________________________________________________________________
+/// add a page to the event array, all of its ports start masked
+//______________________________________________________________________________
+static int
+_expand(void)
+{
+    if (eventArrayPages >= EVENT_ARRAY_PAGES_MAX)
+	{
+	    return -1;
+	}
+
+    event_word_t *page = (event_word_t *) pageKernelAllocSingle();
+    if (!page)
+	{
+	    return -1;
+	}
+    uint i;
+    for (i=0; i<EVENT_WORDS_PER_PAGE; i++)
+	{
+	    page[i] = 1 << EVTCHN_FIFO_MASKED;
+	}
+
+    evtchn_expand_array_t op;
+    op.array_gfn = virtualToMfn((vaddr_t) page);
+    int err = HYPERVISOR_event_channel_op(EVTCHNOP_expand_array, &op);
+    if (err)
+	{
+	    pageKernelFreeSingle(page);
+	    return err;
+	}
+
+    eventArray[eventArrayPages++] = page;
+    return 0;
+}
+
+//______________________________________________________________________________
+/// make sure the event array covers port, called before a port is unmasked
+//______________________________________________________________________________
+int
+xenEventFifoSetup(evtchn_port_t port   ///< port about to be bound
+		  )
+{
+    while (port >= eventArrayPages * EVENT_WORDS_PER_PAGE)
+	{
+	    int err = _expand();
+	    if (err)
+		{
+		    printfLog("event array cannot cover port %d (%d)\n", port, err);
+		    return err;
+		}
+	}
+    return 0;
+}
+
+//______________________________________________________________________________
+/// give Xen the control block of cpu, false if it refuses
+//______________________________________________________________________________
+bool
+xenEventFifoInitCpu(uint cpu    ///< vCPU whose events are to be queued
+		    )
+{
+    evtchn_fifo_control_block_t *block = (evtchn_fifo_control_block_t *) pageKernelAllocSingle();
+    if (!block)
+	{
+	    return false;
+	}
+    memset(block, 0, PAGE_SIZE);
+
+    evtchn_init_control_t op;
+    op.control_gfn = virtualToMfn((vaddr_t) block);
+    op.offset      = 0;
+    op.vcpu        = cpu;
+    if (HYPERVISOR_event_channel_op(EVTCHNOP_init_control, &op))
+	{
+	    pageKernelFreeSingle(block);
+	    return false;
+	}
+
+    controlBlock[cpu] = block;
+    return true;
+}
+
+//______________________________________________________________________________
+/// switch to the FIFO ABI, false leaves the 2-level ABI in place
+//______________________________________________________________________________
+bool
+xenEventFifoInit(void)
+{
+    if (!xenEventFifoInitCpu(smp_processor_id()))
+	{
+	    return false;
+	}
+
+    // ports handed over at start of day (console, xenstore) are low
+    // numbered, so the first page must exist before any event arrives
+    int err = _expand();
+    BUG_ON(err);
+
+    xenEventFifoActive = true;
+    return true;
+}
+
+//______________________________________________________________________________
+/// take the event at the head of a queue, returns the next port in the queue
+//______________________________________________________________________________
+static evtchn_port_t
+_clearLinked(volatile event_word_t *word)
+{
+    event_word_t new, old, w = *word;
+
+    do
+	{
+	    old = w;
+	    new = w & ~((1 << EVTCHN_FIFO_LINKED) | EVTCHN_FIFO_LINK_MASK);
+	}
+    while ((w = synch_cmpxchg(word, old, new)) != old);
+
+    return w & EVTCHN_FIFO_LINK_MASK;
+}
+
+//______________________________________________________________________________
+/// handle one event from queue priority
+//______________________________________________________________________________
+static void
+_consume(uint cpu,                     ///< vCPU taking the event
+	 uint priority,                ///< queue to take from
+	 uint32_t *ready,              ///< queues still holding events
+	 arch_interrupt_regs_t *regs   ///< registers at time of event
+	 )
+{
+    evtchn_port_t head = queueHead[cpu][priority];
+
+    if (!head)
+	{
+	    rmb();  // the control block head is only valid once ready was seen
+	    head = controlBlock[cpu]->head[priority];
+	}
+
+    evtchn_port_t port = head;
+    volatile event_word_t *word = _word(port);
+
+    head = _clearLinked(word);
+    if (!head)
+	{
+	    *ready &= ~(1 << priority);
+	}
+
+    event_word_t w = *word;
+    if ((w & (1 << EVTCHN_FIFO_PENDING)) && !(w & (1 << EVTCHN_FIFO_MASKED)))
+	{
+	    xenEventHandle(port, regs);
+	}
+
+    queueHead[cpu][priority] = head;
+}
+
+//______________________________________________________________________________
+/// the upcall under the FIFO ABI
+//______________________________________________________________________________
+void
+xenEventFifoCallback(arch_interrupt_regs_t *regs   ///< registers at the time of the event
+		     )
+{
+    uint         cpu       = smp_processor_id();
+    vcpu_info_t *vcpu_info = &HYPERVISOR_shared_info->vcpu_info[cpu];
+    evtchn_fifo_control_block_t *block = controlBlock[cpu];
+
+    vcpu_info->evtchn_upcall_pending = 0;
+
+    uint32_t ready = xchg(&block->ready, 0);
+    while (ready)
+	{
+	    // lowest set bit is the highest priority ready queue
+	    _consume(cpu, __ffs(ready), &ready, regs);
+	    ready |= xchg(&block->ready, 0);
+	}
+}
+
+//______________________________________________________________________________
+/// mask events on the channel port
+//______________________________________________________________________________
+void
+xenEventFifoMask(evtchn_port_t port   ///< port to be masked
+		 )
+{
+    if (port / EVENT_WORDS_PER_PAGE < eventArrayPages)
+	{
+	    synch_set_bit(EVTCHN_FIFO_MASKED, _word(port));
+	}
+}
+
+//______________________________________________________________________________
+/// allow events on the channel port, Xen relinks an event which arrived
+/// while masked
+//______________________________________________________________________________
+void
+xenEventFifoUnmask(evtchn_port_t port   ///< port to be unmasked
+		   )
+{
+    volatile event_word_t *word = _word(port);
+
+    synch_clear_bit(EVTCHN_FIFO_MASKED, word);
+    if (synch_test_bit(EVTCHN_FIFO_PENDING, word))
+	{
+	    evtchn_unmask_t op;
+	    op.port = port;
+	    (void) HYPERVISOR_event_channel_op(EVTCHNOP_unmask, &op);
+	}
+}
+
+//______________________________________________________________________________
+/// clear the event channel port
+//______________________________________________________________________________
+void
+xenEventFifoClearPort(evtchn_port_t port   ///< port to be cleared
+		      )
+{
+    if (port / EVENT_WORDS_PER_PAGE < eventArrayPages)
+	{
+	    synch_clear_bit(EVTCHN_FIFO_PENDING, _word(port));
+	}
+}
+
+//______________________________________________________________________________
+/// true if an event is pending on the port
+//______________________________________________________________________________
+bool
+xenEventFifoPending(evtchn_port_t port   ///< port to be tested
+		    )
+{
+    return port / EVENT_WORDS_PER_PAGE < eventArrayPages &&
+	synch_test_bit(EVTCHN_FIFO_PENDING, _word(port));
+}
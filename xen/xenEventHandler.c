@@ -29,29 +29,68 @@
 #include <nano/common.h>
 #include <nano/xenEventHandler.h>
 #include <nano/xenEvent.h>
+#include <nano/xenEventFifo.h>
+#include <nano/interruptDeferred.h>
 
-static inline int
+#define EVTCHN_WORD_BITS (8 * sizeof(ulong))   // ports per pending word
+
+static inline ulong
 xenEventHandlerActive(int cpu,                    ///< processor
 		      struct shared_info *sh,     ///< place where event info is stored
 		      int idx                     ///< evebt index
 		      )
 {
-    return sh->evtchn_pending[idx] & ~sh->evtchn_mask[idx];
+    return sh->evtchn_pending[idx] & ~sh->evtchn_mask[idx] & xenEventCpuMask[cpu][idx];
 }
 
 
+static void _callback(arch_interrupt_regs_t *regs);
+
+uint64 xenEventUpcallTsc;
+
 //______________________________________________________________________________
-/// do the call back associated with the pseudo interrupt (event channel)
+/// do the call back associated with the pseudo interrupt (event channel),
+/// timing how long events stay masked
 //______________________________________________________________________________
 void 
 xenEventHandlerCallback(arch_interrupt_regs_t *regs   ///< registers at the time of the event
 			)
+{
+    InterruptDeferredStatistics *s = &interruptDeferredStatistics;
+    uint64 start = getTsc();
+
+    xenEventUpcallTsc = start;
+    xenEventNotifyBegin();
+    _callback(regs);
+    xenEventNotifyEnd();
+
+    ulong cycles = getTsc() - start;
+    s->upcalls++;
+    s->maskedCycles += cycles;
+    if (cycles > s->maskedCyclesMax)
+	{
+	    s->maskedCyclesMax = cycles;
+	}
+}
+
+//______________________________________________________________________________
+/// dispatch pending events to their handlers
+//______________________________________________________________________________
+static void 
+_callback(arch_interrupt_regs_t *regs   ///< registers at the time of the event
+	  )
 {
     unsigned long  l1, l2, l1i, l2i;
     unsigned int   port;
-    int            cpu = 0;
+    int            cpu = smp_processor_id();
     shared_info_t *s = HYPERVISOR_shared_info;
     vcpu_info_t   *vcpu_info = &s->vcpu_info[cpu];
+
+    if (xenEventFifoActive)
+	{
+	    xenEventFifoCallback(regs);
+	    return;
+	}
    
     vcpu_info->evtchn_upcall_pending = 0;
     
@@ -60,12 +99,12 @@ xenEventHandlerCallback(arch_interrupt_regs_t *regs   ///< registers at the time
     while (l1 != 0)
 	{
 	    l1i = __ffs(l1);
-	    l1 &= ~(1 << l1i);        
+	    l1 &= ~(1UL << l1i);        
 	    while ((l2 = xenEventHandlerActive(cpu, s, l1i)) != 0)
 		{
 		    l2i = __ffs(l2);
-		    l2 &= ~(1 << l2i);            
-		    port = (l1i << 5) + l2i;
+		    l2 &= ~(1UL << l2i);            
+		    port = l1i * EVTCHN_WORD_BITS + l2i;
 		    xenEventHandle(port, regs);
 		}
 	}
@@ -79,6 +118,12 @@ xenEventHandlerMask(uint32 port   ///< port to be masked
 		    )
 {
     shared_info_t *s = HYPERVISOR_shared_info;
+
+    if (xenEventFifoActive)
+	{
+	    xenEventFifoMask(port);
+	    return;
+	}
     synch_set_bit(port, &s->evtchn_mask[0]);
 }
 
@@ -92,12 +137,26 @@ xenEventHandlerUnmask(uint32 port  ///< port to be unmasked
     shared_info_t *s = HYPERVISOR_shared_info;
     vcpu_info_t *vcpu_info = &s->vcpu_info[smp_processor_id()];
 
+    if (xenEventFifoActive)
+	{
+	    xenEventFifoUnmask(port);
+	    return;
+	}
+
+    // only Xen can resend to another vCPU
+    if (xenEventCpu(port) != smp_processor_id())
+	{
+	    evtchn_unmask_t op;
+	    op.port = port;
+	    (void) HYPERVISOR_event_channel_op(EVTCHNOP_unmask, &op);
+	    return;
+	}
     synch_clear_bit(port, &s->evtchn_mask[0]);
 
     // The following is basically the equivalent of 'hw_resend_irq'. Just like
     // a real IO-APIC we 'lose the interrupt edge' if the channel is masked.
     if (  synch_test_bit        (port,    &s->evtchn_pending[0]) && 
-	  !synch_test_and_set_bit(port>>5, &vcpu_info->evtchn_pending_sel) )
+	  !synch_test_and_set_bit(port / EVTCHN_WORD_BITS, &vcpu_info->evtchn_pending_sel) )
 	{
 	    vcpu_info->evtchn_upcall_pending = 1;
 	    if ( !vcpu_info->evtchn_upcall_mask )
@@ -113,5 +172,27 @@ xenEventHandlerClearPort(uint32 port    ///< port to be cleared
 			 )
 {
     shared_info_t *s = HYPERVISOR_shared_info;
+
+    if (xenEventFifoActive)
+	{
+	    xenEventFifoClearPort(port);
+	    return;
+	}
     synch_clear_bit(port, &s->evtchn_pending[0]);
 }
+
+//______________________________________________________________________________
+/// true if an event is pending on the channel port
+//______________________________________________________________________________
+bool
+xenEventHandlerPending(uint32 port    ///< port to be tested
+		       )
+{
+    shared_info_t *s = HYPERVISOR_shared_info;
+
+    if (xenEventFifoActive)
+	{
+	    return xenEventFifoPending(port);
+	}
+    return synch_test_bit(port, &s->evtchn_pending[0]);
+}
@@ -0,0 +1,189 @@
+//______________________________________________________________________________
+/// Interrupt moderation (NAPI style) for high rate event ports.
+///   An event on a moderated port masks it and queues its poll as deferred
+///   work, so a burst costs one upcall rather than one per notification.
+///   The poll is repeated while it uses its whole budget; once the device
+///   is drained the port is cleared and unmasked, and an event which
+///   arrived in between is taken by the upcall that the unmask raises.
+//______________________________________________________________________________
+
+#include <nano/common.h>
+#include <nano/xenEvent.h>
+#include <nano/xenEventModerate.h>
+
+typedef struct {
+    DeferredWork                work;       // runs _poll
+    evtchn_port_t               port;
+    XenEventPollFunction        poll;
+    void                       *data;
+    InterruptService           *service;    // driver's counters, may be NULL
+    uint                        budget;
+    XenEventModerateStatistics  statistics;
+} ModeratedPort;
+
+static ModeratedPort moderated[XEN_EVENT_MODERATED_MAX];
+static uint          moderatedCount;
+
+//______________________________________________________________________________
+/// the moderated port for port, or NULL
+//______________________________________________________________________________
+static ModeratedPort *
+_find(evtchn_port_t port)
+{
+    uint i;
+
+    for (i=0; i<moderatedCount; i++)
+	{
+	    if (moderated[i].port == port)
+		{
+		    return moderated + i;
+		}
+	}
+    return NULL;
+}
+
+//______________________________________________________________________________
+/// deferred work: poll the device, then either poll again or rearm the port
+//______________________________________________________________________________
+static void
+_poll(void *arg)
+{
+    ModeratedPort *m = arg;
+    XenEventModerateStatistics *s = &m->statistics;
+
+    uint done = m->poll(m->port, m->budget, m->data);
+    s->polls++;
+    s->work += done;
+
+    if (done >= m->budget)
+	{
+	    // more to do: stay masked and let other work run first
+	    s->exhausted++;
+	    interruptDeferredQueue(&m->work);
+	    return;
+	}
+
+    // drained: notifications so far are covered by this poll
+    if (m->service)
+	{
+	    m->service->serviced++;
+	}
+    xenEventHandlerUnmask(m->port);
+    s->rearms++;
+    if (xenEventHandlerPending(m->port))
+	{   // arrived after the last ring read: take it as the handler
+	    // would, the clear is followed by another poll before the unmask
+	    s->rearmPending++;
+	    xenEventHandlerMask(m->port);
+	    xenEventHandlerClearPort(m->port);
+	    if (m->service)
+		{
+		    m->service->occured++;
+		}
+	    interruptDeferredQueue(&m->work);
+	}
+}
+
+//______________________________________________________________________________
+/// upcall handler of a moderated port
+//______________________________________________________________________________
+static void
+_handler(evtchn_port_t port, arch_interrupt_regs_t *regs, void *data)
+{
+    ModeratedPort *m = data;
+
+    xenEventHandlerMask(port);
+    m->statistics.events++;
+    if (m->service)
+	{
+	    m->service->occured++;
+	}
+    interruptDeferredQueue(&m->work);
+}
+
+//______________________________________________________________________________
+/// bind port to a poll function rather than a handler.  Returns the port,
+/// or a negative value if no more ports can be moderated or it cannot be
+/// bound.
+//______________________________________________________________________________
+int
+xenEventModerate(evtchn_port_t port,             ///< port to moderate
+		 XenEventPollFunction poll,      ///< drains the device
+		 void *data,                     ///< passed to poll
+		 InterruptService *service       ///< counters to keep, or NULL
+		 )
+{
+    ModeratedPort *m = _find(port);
+
+    if (!m)
+	{
+	    if (moderatedCount == XEN_EVENT_MODERATED_MAX)
+		{
+		    printfLog("no room to moderate port %d\n", port);
+		    return -1;
+		}
+	    m = moderated + moderatedCount++;
+	}
+
+    memset(m, 0, sizeof(*m));
+    m->work.function = _poll;
+    m->work.arg      = m;
+    m->port          = port;
+    m->poll          = poll;
+    m->data          = data;
+    m->service       = service;
+    m->budget        = XEN_EVENT_MODERATE_BUDGET;
+
+    return xenEventBind(port, _handler, m);
+}
+
+//______________________________________________________________________________
+/// set the most work a poll of port may do before yielding to other work
+//______________________________________________________________________________
+void
+xenEventModerateBudgetSet(evtchn_port_t port,   ///< moderated port
+			  uint budget           ///< units per poll, at least one
+			  )
+{
+    ModeratedPort *m = _find(port);
+
+    if (m)
+	{
+	    m->budget = budget ? budget : 1;
+	}
+}
+
+//______________________________________________________________________________
+/// statistics of a moderated port, false if the port is not moderated
+//______________________________________________________________________________
+bool
+xenEventModerateStatistics(evtchn_port_t port,
+			   XenEventModerateStatistics *statistics)
+{
+    ModeratedPort *m = _find(port);
+
+    if (!m)
+	{
+	    return false;
+	}
+    *statistics = m->statistics;
+    return true;
+}
+
+//______________________________________________________________________________
+/// print each moderated port, events per poll show how well bursts merge
+//______________________________________________________________________________
+void
+xenEventModerateStatisticsPrint(void)
+{
+    uint i;
+
+    for (i=0; i<moderatedCount; i++)
+	{
+	    XenEventModerateStatistics *s = &moderated[i].statistics;
+	    xprintLog("moderate port $[uint]: budget $[uint] events $[ulong] polls $[ulong] work $[ulong] "
+		      "exhausted $[ulong] rearms $[ulong] pending at rearm $[ulong]\n",
+		      moderated[i].port, moderated[i].budget, s->events, s->polls, s->work,
+		      s->exhausted, s->rearms, s->rearmPending);
+	}
+}
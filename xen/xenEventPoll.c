@@ -0,0 +1,240 @@
+//______________________________________________________________________________
+/// Busy polling of latency critical event ports.
+///   Blocking costs a deschedule and a wakeup before the upcall, which is
+///   microseconds per event on a port that is busy anyway.  Ports marked hot
+///   are instead watched by the idle path: first by spinning for a window
+///   which grows while events keep arriving in it and shrinks while they do
+///   not, then by SCHEDOP_poll on just the hot ports, and only then does the
+///   kernel block for everything.
+//______________________________________________________________________________
+
+#include <nano/common.h>
+#include <nano/time.h>
+#include <nano/xenEvent.h>
+#include <nano/xenEventPoll.h>
+#include <nano/xenSchedule.h>
+#include <nano/interruptDeferred.h>
+
+#define SPIN_WINDOW_MIN      1000UL       // TSC cycles
+#define SPIN_WINDOW_MAX      200000UL
+#define SPIN_WINDOW_DEFAULT  20000UL
+#define POLL_NS              100000       // SCHEDOP_poll timeout
+
+static evtchn_port_t hotPorts[XEN_EVENT_HOT_MAX];
+static uint          hotCount;
+static bool          enabled = true;
+static bool          polling;             // the current wait used polling
+
+static XenEventPollStatistics statistics = { .window = SPIN_WINDOW_DEFAULT };
+
+static inline void
+_relax(void)
+{
+    __asm__ __volatile__("pause" ::: "memory");
+}
+
+//______________________________________________________________________________
+/// mark a port hot (polled by the idle path) or not, returns 0 on success
+//______________________________________________________________________________
+int
+xenEventPollSet(evtchn_port_t port,   ///< port to change
+		bool hot              ///< true to poll it
+		)
+{
+    uint i;
+
+    for (i=0; i<hotCount; i++)
+	{
+	    if (hotPorts[i] == port)
+		{
+		    if (!hot)
+			{
+			    hotPorts[i] = hotPorts[--hotCount];
+			}
+		    return 0;
+		}
+	}
+
+    if (!hot)
+	{
+	    return 0;
+	}
+    if (hotCount == XEN_EVENT_HOT_MAX)
+	{
+	    printfLog("no room to poll port %d\n", port);
+	    return -1;
+	}
+    hotPorts[hotCount++] = port;
+    return 0;
+}
+
+//______________________________________________________________________________
+/// turn polling on or off, to compare latency with and without it
+//______________________________________________________________________________
+void
+xenEventPollEnable(bool enable)
+{
+    enabled = enable;
+}
+
+//______________________________________________________________________________
+/// true if a hot port has an event pending
+//______________________________________________________________________________
+static bool
+_hotPending(void)
+{
+    uint i;
+
+    for (i=0; i<hotCount; i++)
+	{
+	    if (xenEventHandlerPending(hotPorts[i]))
+		{
+		    return true;
+		}
+	}
+    return false;
+}
+
+//______________________________________________________________________________
+/// spin for the window, true if an event arrived.  Events are enabled, so
+/// the upcall runs as soon as anything is delivered.
+//______________________________________________________________________________
+static bool
+_spin(void)
+{
+    ulong  upcalls = interruptDeferredStatistics.upcalls;
+    uint64 start   = getTsc();
+
+    statistics.spins++;
+    while (getTsc() - start < statistics.window)
+	{
+	    if (interruptDeferredStatistics.upcalls != upcalls || _hotPending())
+		{
+		    statistics.spinHits++;
+		    statistics.window = MIN(statistics.window + statistics.window / 4, SPIN_WINDOW_MAX);
+		    return true;
+		}
+	    _relax();
+	}
+
+    statistics.window = MAX(statistics.window / 2, SPIN_WINDOW_MIN);
+    return false;
+}
+
+//______________________________________________________________________________
+/// SCHEDOP_poll on the hot ports, true if one became pending
+//______________________________________________________________________________
+static bool
+_poll(void)
+{
+    ulong flags;
+    bool  hit;
+
+    statistics.polls++;
+
+    // Xen only polls with event delivery masked, restoring delivery
+    // then runs the upcall for whatever arrived
+    local_irq_save(flags);
+    hit = _hotPending();
+    if (!hit)
+	{
+	    (void) xenSchedulePoll(hotPorts, hotCount, NOW() + POLL_NS);
+	    hit = _hotPending();
+	}
+    local_irq_restore(flags);
+
+    statistics.pollHits += hit;
+    return hit;
+}
+
+//______________________________________________________________________________
+/// wait on the hot ports from the idle path.  True if an event arrived, so
+/// the caller should return to its work rather than block.
+//______________________________________________________________________________
+bool
+xenEventPollWait(void)
+{
+    polling = enabled && hotCount;
+    if (!polling)
+	{
+	    statistics.blocks++;
+	    return false;
+	}
+
+    if (_spin() || _poll())
+	{
+	    return true;
+	}
+
+    statistics.blocks++;
+    return false;
+}
+
+//______________________________________________________________________________
+/// record an event to handler latency, attributed to whether the wait it
+/// ended polled
+//______________________________________________________________________________
+void
+xenEventPollLatency(Time64 ns)
+{
+    uint bucket = ns > 0 ? 63 - __builtin_clzl(ns) : 0;
+
+    statistics.latency[polling][MIN(bucket, XEN_EVENT_LATENCY_BUCKETS - 1)]++;
+}
+
+//______________________________________________________________________________
+/// copy of the current statistics
+//______________________________________________________________________________
+void
+xenEventPollStatistics(XenEventPollStatistics *copy)
+{
+    *copy = statistics;
+}
+
+//______________________________________________________________________________
+/// upper bound, in ns, of the bucket holding the given percentile
+//______________________________________________________________________________
+static ulong
+_percentile(ulong *histogram, uint percent)
+{
+    ulong total = 0, seen = 0;
+    uint  b;
+
+    for (b=0; b<XEN_EVENT_LATENCY_BUCKETS; b++)
+	{
+	    total += histogram[b];
+	}
+    if (!total)
+	{
+	    return 0;
+	}
+
+    for (b=0; b<XEN_EVENT_LATENCY_BUCKETS; b++)
+	{
+	    seen += histogram[b];
+	    if (seen * 100 >= total * percent)
+		{
+		    break;
+		}
+	}
+    return 2UL << b;
+}
+
+//______________________________________________________________________________
+/// print wait outcomes and p50/p99 latency with and without polling
+//______________________________________________________________________________
+void
+xenEventPollStatisticsPrint(void)
+{
+    XenEventPollStatistics *s = &statistics;
+    uint mode;
+
+    xprintLog("poll: hot ports $[uint] spins $[ulong] hits $[ulong] polls $[ulong] hits $[ulong] blocks $[ulong] window $[ulong]\n",
+	      hotCount, s->spins, s->spinHits, s->polls, s->pollHits, s->blocks, s->window);
+    for (mode=0; mode<2; mode++)
+	{
+	    xprintLog("poll: latency $[str] p50 < $[ulong] ns p99 < $[ulong] ns\n",
+		      mode ? "polling" : "blocking",
+		      _percentile(s->latency[mode], 50), _percentile(s->latency[mode], 99));
+	}
+}
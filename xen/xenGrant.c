@@ -15,54 +15,217 @@
 //  Simple grant table implementation. About as stupid as it's
 //  possible to be and still work.
 //
-//   When updating xenGrantTable[i], the flags field must be updated
+//   When updating an entry, the flags field must be updated
 //   last (if it is zero the other fields are ignored) and a write barrier
 //   (wmb()) must be done before the flags are updated.
+//
+//   The table starts at NR_GRANT_FRAMES frames and grows, up to what Xen
+//   allows, when the free list runs out.  Each growth maps only the new
+//   frames, so entries are found through a per frame pointer.
 //___________________________________________________________________________
 
 #include <nano/common.h>
 #include <nano/mm.h>
 #include <nano/pageTable.h>
 #include <nano/xenGrant.h>
+#include <nano/xenEvent.h>
 #include <nano/xenEventHandler.h>
+#include <nano/kernelTask.h>
+#include <nano/xenbus.h>
 
 #define NR_RESERVED_ENTRIES 8
-#define NR_GRANT_ENTRIES (NR_GRANT_FRAMES * PAGE_SIZE / sizeof(grant_entry_v1_t))
+#define GRANT_ENTRIES_PER_FRAME (PAGE_SIZE / sizeof(grant_entry_v1_t))
+#define NR_GRANT_ENTRIES_MAX (XEN_GRANT_FRAMES_MAX * GRANT_ENTRIES_PER_FRAME)
+
+// the grant table entries, which are mapped into both ethos and Xen, one
+// pointer per frame.  Modification to these entries, therefore, cause Xen
+// to perform grant actions.
+static grant_entry_v1_t *xenGrantFrames[XEN_GRANT_FRAMES_MAX];
+static uint              xenGrantFrameCount;
+static uint              xenGrantFrameMax;    // Xen's limit, at most XEN_GRANT_FRAMES_MAX
 
-// this is going to contain the grant table entries which are mapped into both
-// ethos and Xen.  Modification to these entries, therefore, cause Xen to
-// perform grant actions.
-static grant_entry_v1_t *xenGrantTable;
+#define xenGrantEntry(ref) \
+    (&xenGrantFrames[(ref) / GRANT_ENTRIES_PER_FRAME][(ref) % GRANT_ENTRIES_PER_FRAME])
 
 // list of available pages to grant, xenGrantList[0] 
 // points to the first element in the list.
-static grant_ref_t    xenGrantList[NR_GRANT_ENTRIES];
+static grant_ref_t    xenGrantList[NR_GRANT_ENTRIES_MAX];
+static uint           freeCount;       // entries on the list
+static uint           reservedCount;   // of those, promised to reserves
+
+// woken when entries are freed
+static WaitQueue      xenGrantQueue = WAIT_QUEUE_INIT;
+
+XenGrantStatistics    xenGrantStatistics;
 
 //______________________________________________________________________________
-/// Free grant entry
+/// Free grant entry, events masked
 //______________________________________________________________________________
 static void
 _putFreeEntry(grant_ref_t ref)
 {
     xenGrantList[ref] = xenGrantList[0];
     xenGrantList[0]  = ref;
+    freeCount++;
 }
 
 //______________________________________________________________________________
-/// Find unused grant entry
-//    should check list empty --jas
+/// Take an unused grant entry, events masked; the list must not be empty
 //______________________________________________________________________________
 static grant_ref_t
 _getFreeEntry(void)
 {
+    BUG_ON(!freeCount);
     unsigned int ref = xenGrantList[0];
     xenGrantList[0] = xenGrantList[ref];
+    freeCount--;
+
+    uint inUse = xenGrantFrameCount * GRANT_ENTRIES_PER_FRAME - NR_RESERVED_ENTRIES - freeCount;
+    xenGrantStatistics.inUseMax = MAX(xenGrantStatistics.inUseMax, inUse);
     return ref;
 }
 
+//______________________________________________________________________________
+/// Give an entry back and wake whoever waits for one
+//______________________________________________________________________________
+static void
+_release(grant_ref_t ref)
+{
+    ulong flags;
+    local_irq_save(flags);
+    _putFreeEntry(ref);
+    local_irq_restore(flags);
+
+    waitQueueWake(&xenGrantQueue);
+}
 
 //______________________________________________________________________________
-/// Allow shared access between domain.
+/// Grow the table by at least needed entries, doubling it if Xen allows.
+/// Maps memory, so not for event handlers.  Returns false at Xen's limit,
+/// or if another growth is under way; xenGrantQueue is woken when it is done.
+//______________________________________________________________________________
+static bool
+_grow(uint needed)
+{
+    static bool growing;
+    mfn_t frames[XEN_GRANT_FRAMES_MAX];
+    gnttab_setup_table_t setup;
+    ulong flags;
+    uint old;
+    uint count;
+    uint i;
+
+    local_irq_save(flags);
+    if (growing)
+	{
+	    local_irq_restore(flags);
+	    return false;
+	}
+    growing = true;
+    old = xenGrantFrameCount;
+    local_irq_restore(flags);
+
+    count = MAX(2 * old, old + (needed + GRANT_ENTRIES_PER_FRAME - 1) / GRANT_ENTRIES_PER_FRAME);
+    count = MIN(count, xenGrantFrameMax);
+    if (count <= old)
+	{
+	    growing = false;
+	    return false;
+	}
+
+    // Xen grows the table and returns the frames of all of it
+    setup.dom       = DOMID_SELF;
+    setup.nr_frames = count;
+    set_xen_guest_handle(setup.frame_list, frames);
+    if (HYPERVISOR_grant_table_op(GNTTABOP_setup_table, &setup, 1) || setup.status)
+	{
+	    printfLog("grant table growth to %d frames failed, %s\n",
+		      count, xenGrantOpError(setup.status));
+	    xenGrantFrameMax = old;
+	    growing = false;
+	    return false;
+	}
+
+    vaddr_t map;
+    Status status = pageTableKernelMap(count - old, frames + old, &map);
+    if (StatusOk != status)
+	{
+	    growing = false;
+	    return false;
+	}
+    for (i = old; i < count; i++)
+	{
+	    xenGrantFrames[i] = (grant_entry_v1_t *) (map + (i - old) * PAGE_SIZE);
+	}
+
+    local_irq_save(flags);
+    xenGrantFrameCount = count;
+    for (i = old * GRANT_ENTRIES_PER_FRAME; i < count * GRANT_ENTRIES_PER_FRAME; i++)
+	{
+	    if (i >= NR_RESERVED_ENTRIES)
+		{
+		    _putFreeEntry(i);
+		}
+	}
+    growing = false;
+    local_irq_restore(flags);
+
+    // the table xenGrantInit sets up is not a growth
+    if (old)
+	{
+	    xenGrantStatistics.grows++;
+	}
+    waitQueueWake(&xenGrantQueue);
+    return true;
+}
+
+//______________________________________________________________________________
+/// Take an entry not promised to a reserve, growing the table if there is
+/// none; XEN_GRANT_INVALID_REF if the table is at its limit
+//______________________________________________________________________________
+static grant_ref_t
+_allocate(void)
+{
+    ulong flags;
+
+    for (;;)
+	{
+	    local_irq_save(flags);
+	    if (freeCount > reservedCount)
+		{
+		    grant_ref_t ref = _getFreeEntry();
+		    local_irq_restore(flags);
+		    return ref;
+		}
+	    local_irq_restore(flags);
+
+	    if (!_grow(1))
+		{
+		    xenGrantStatistics.exhausted++;
+		    return XEN_GRANT_INVALID_REF;
+		}
+	}
+}
+
+
+//______________________________________________________________________________
+/// fill in an entry granting access to frame
+//______________________________________________________________________________
+static void
+_permitAccess(grant_ref_t ref, domid_t domid, mfn_t frame, int readonly)
+{
+    grant_entry_v1_t *entry = xenGrantEntry(ref);
+
+    entry->frame = frame;
+    entry->domid = domid;
+    wmb();
+    readonly *= GTF_readonly;
+    entry->flags = GTF_permit_access | readonly;
+}
+
+//______________________________________________________________________________
+/// Allow shared access between domain.  Returns XEN_GRANT_INVALID_REF if
+/// the grant table is full and cannot grow.
 //______________________________________________________________________________
 grant_ref_t
 xenGrantAccess(domid_t domid,          ///< domain to be granted access
@@ -70,13 +233,11 @@ xenGrantAccess(domid_t domid,          ///< domain to be granted access
 	       int readonly            ///< true if read only
 	       )
 {
-    grant_ref_t ref = _getFreeEntry();
-    xenGrantTable[ref].frame = frame;
-    xenGrantTable[ref].domid = domid;
-    wmb();
-    readonly *= GTF_readonly;
-    xenGrantTable[ref].flags = GTF_permit_access | readonly;
-
+    grant_ref_t ref = _allocate();
+    if (ref != XEN_GRANT_INVALID_REF)
+	{
+	    _permitAccess(ref, domid, frame, readonly);
+	}
     return ref;
 }
 
@@ -88,11 +249,17 @@ xenGrantTransfer(domid_t domid,       ///< domain to be transfer to
 		 pfn_t pfn            ///< page frame number
 		 )
 {
-    grant_ref_t ref = _getFreeEntry();
-    xenGrantTable[ref].frame = pfn;
-    xenGrantTable[ref].domid = domid;
+    grant_ref_t ref = _allocate();
+    if (ref == XEN_GRANT_INVALID_REF)
+	{
+	    return ref;
+	}
+
+    grant_entry_v1_t *entry = xenGrantEntry(ref);
+    entry->frame = pfn;
+    entry->domid = domid;
     wmb();
-    xenGrantTable[ref].flags = GTF_accept_transfer;
+    entry->flags = GTF_accept_transfer;
 
     return ref;
 }
@@ -105,17 +272,18 @@ xenGrantEndAccess(grant_ref_t ref     ///< the grant entry of the page to be rem
 		  )
 {
     u16 flags, nflags;
+    grant_entry_v1_t *entry = xenGrantEntry(ref);
 
-    nflags = xenGrantTable[ref].flags;
+    nflags = entry->flags;
     do {
 	if ((flags = nflags) & (GTF_reading|GTF_writing)) {
 	    printfLog("WARNING: attempted to end access to grant entry still in use!\n");
 	    return 0;
 	}
-    } while ((nflags = synch_cmpxchg(&xenGrantTable[ref].flags, flags, 0)) !=
+    } while ((nflags = synch_cmpxchg(&entry->flags, flags, 0)) !=
 	     flags);
 
-    _putFreeEntry(ref);
+    _release(ref);
     return 1;
 }
 
@@ -128,25 +296,26 @@ xenGrantEndTransfer(grant_ref_t ref    ///< the tranfered page grant table refer
 {
     unsigned long frame;
     u16 flags;
+    grant_entry_v1_t *entry = xenGrantEntry(ref);
 
-    while (!((flags = xenGrantTable[ref].flags) & GTF_transfer_committed)) {
-	if (synch_cmpxchg(&xenGrantTable[ref].flags, flags, 0) == flags) {
+    while (!((flags = entry->flags) & GTF_transfer_committed)) {
+	if (synch_cmpxchg(&entry->flags, flags, 0) == flags) {
 	    printfLog("Release unused transfer grant.\n");
-	    _putFreeEntry(ref);
+	    _release(ref);
 	    return 0;
 	}
     }
 
     // If a transfer is in progress then wait until it is completed.
     while (!(flags & GTF_transfer_completed)) {
-	flags = xenGrantTable[ref].flags;
+	flags = entry->flags;
     }
 
     // Read the frame number /after/ reading completion status.
     rmb();
-    frame = xenGrantTable[ref].frame;
+    frame = entry->frame;
 
-    _putFreeEntry(ref);
+    _release(ref);
 
     return frame;
 }
@@ -183,6 +352,59 @@ xenGrantOpError(int16_t status            ///< status return
 	return xenGrantOpErrorMessages[status];
 }
 
+//______________________________________________________________________________
+/// Maps count grant refs from foreign domains in one hypercall.  Each
+/// op's status is set, and its handle (and bus address for device maps)
+/// on success.  Returns the hypercall's error if it failed as a whole,
+/// else the number of ops which failed.
+//______________________________________________________________________________
+int
+xenGrantMapForeignGrants(gnttab_map_grant_ref_t *ops,   ///< ops, filled by xenGrantMapOpSet
+			 uint count                     ///< number of ops
+			 )
+{
+    int err = HYPERVISOR_grant_table_op(GNTTABOP_map_grant_ref, ops, count);
+    uint failed = 0;
+    uint i;
+
+    xenGrantStatistics.mapCalls++;
+    if (err)
+	{
+	    return err;
+	}
+    for (i = 0; i < count; i++)
+	{
+	    failed += ops[i].status != GNTST_okay;
+	}
+    xenGrantStatistics.mapped += count - failed;
+    return failed;
+}
+
+//______________________________________________________________________________
+/// Unmaps count grants in one hypercall, as xenGrantMapForeignGrants.
+//______________________________________________________________________________
+int
+xenGrantUnmapForeignGrants(gnttab_unmap_grant_ref_t *ops, ///< ops, filled by xenGrantUnmapOpSet
+			   uint count                     ///< number of ops
+			   )
+{
+    int err = HYPERVISOR_grant_table_op(GNTTABOP_unmap_grant_ref, ops, count);
+    uint failed = 0;
+    uint i;
+
+    xenGrantStatistics.unmapCalls++;
+    if (err)
+	{
+	    return err;
+	}
+    for (i = 0; i < count; i++)
+	{
+	    failed += ops[i].status != GNTST_okay;
+	}
+    xenGrantStatistics.unmapped += count - failed;
+    return failed;
+}
+
 //______________________________________________________________________________
 /// Maps a grant ref from a foreign domain.
 //______________________________________________________________________________
@@ -197,21 +419,13 @@ xenGrantMapForeignGrant(vaddr_t hostAddr,       ///< address to be mapped into
     gnttab_map_grant_ref_t op;
     int err;
 
-    op.host_addr = hostAddr;
-    op.ref = ref;
-    op.dom = domId;
-    op.flags = GNTMAP_host_map;
-    if (readOnly)
-	{
-	    op.flags |= GNTMAP_readonly;
-	}
-
-    err = HYPERVISOR_grant_table_op(GNTTABOP_map_grant_ref, &op, 1);
-    if (err != 0 || op.status != 0 )
+    xenGrantMapOpSet(&op, hostAddr, GNTMAP_host_map, domId, ref, readOnly);
+    err = xenGrantMapForeignGrants(&op, 1);
+    if (err != 0)
 	{
 	    printfLog("xenGrantMapForeignGrant failed! err = %d, op.status = %d, %s\n",
 			err, op.status, xenGrantOpError(op.status));
-	    return err != 0 ? err : op.status;
+	    return op.status != 0 ? op.status : err;
 	}
     *handle = op.handle;
 
@@ -229,58 +443,495 @@ xenGrantUnmapForeignGrant(vaddr_t hostAddr,		///< address to be unmapped
     struct gnttab_unmap_grant_ref op;
     int err;
 
-    op.host_addr = hostAddr;
-    op.dev_bus_addr = 0;
-    op.handle = handle;
-
-    err = HYPERVISOR_grant_table_op(GNTTABOP_unmap_grant_ref, &op, 1);
-    if (err != 0 || op.status != 0 )
+    xenGrantUnmapOpSet(&op, hostAddr, 0, handle);
+    err = xenGrantUnmapForeignGrants(&op, 1);
+    if (err != 0)
 	{
 	    printfLog("xenGrantUnMapForeignGrant failed! err = %d, op.status = %d, %s\n",
 			err, op.status, xenGrantOpError(op.status));
-	    return err != 0 ? err : op.status;
+	    return op.status != 0 ? op.status : err;
 	}
 
     return 0;
 }
+
 //______________________________________________________________________________
-/// Initialize the grant table
+/// Block until count entries are free, growing the table if it can.
+/// Not for use inside a kernel task, which uses xenGrantSleep.
 //______________________________________________________________________________
 void
-xenGrantInit(void)
+xenGrantWait(uint count        ///< entries needed
+	     )
 {
-    int i;
-    gnttab_setup_table_t setup;
-    mfn_t frames[NR_GRANT_FRAMES];
+    if (freeCount - reservedCount >= count)
+	{
+	    return;
+	}
+    // a growth capped at Xen's limit may still leave too few
+    if (_grow(count) && freeCount - reservedCount >= count)
+	{
+	    return;
+	}
+    xenGrantStatistics.waits++;
+    WAIT_EVENT(&xenGrantQueue, freeCount - reservedCount >= count);
+}
 
-    // initialize the free list
-    for (i = NR_RESERVED_ENTRIES; i < NR_GRANT_ENTRIES; i++)
+//______________________________________________________________________________
+/// If fewer than count entries are free, put task to sleep until some
+/// are freed and return true; the task then tries again.
+//______________________________________________________________________________
+bool
+xenGrantSleep(KernelTask *task,   ///< the running task
+	      uint count          ///< entries needed
+	      )
+{
+    ulong generation = xenGrantQueue.generation;
+    rmb();
+    if (freeCount - reservedCount >= count)
 	{
-	    _putFreeEntry(i);
+	    return false;
 	}
 
-    setup.dom = DOMID_SELF;
-    setup.nr_frames = NR_GRANT_FRAMES;
-    // makes setup.frame_list point to frames
-    set_xen_guest_handle(setup.frame_list, frames);
+    // entries freed since the test would not wake it, so it runs again
+    kernelTaskSleep(&xenGrantQueue, task);
+    if (xenGrantQueue.generation != generation)
+	{
+	    waitQueueWake(&xenGrantQueue);
+	}
+    xenGrantStatistics.waits++;
+    return true;
+}
+
+//______________________________________________________________________________
+/// Set aside count entries in O(1), growing the table if need be.  The
+/// entries stay on the free list, only counted as promised, and are taken
+/// by xenGrantReserveAccess, which cannot fail.
+//______________________________________________________________________________
+Status
+xenGrantReserve(XenGrantReserve *reserve,    ///< reserve to add to
+		uint count                   ///< entries to set aside
+		)
+{
+    ulong flags;
+
+    for (;;)
+	{
+	    local_irq_save(flags);
+	    if (freeCount - reservedCount >= count)
+		{
+		    reservedCount  += count;
+		    reserve->count += count;
+		    local_irq_restore(flags);
+		    xenGrantStatistics.reserved += count;
+		    return StatusOk;
+		}
+	    local_irq_restore(flags);
+
+	    if (!_grow(count - (freeCount - reservedCount)))
+		{
+		    xenGrantStatistics.exhausted++;
+		    return StatusNoSpace;
+		}
+	}
+}
+
+//______________________________________________________________________________
+/// Grant access to frame with an entry from reserve
+//______________________________________________________________________________
+grant_ref_t
+xenGrantReserveAccess(XenGrantReserve *reserve,   ///< reserve with an entry left
+		      domid_t domid,              ///< domain to be granted access
+		      mfn_t frame,                ///< page frame to be shared
+		      int readonly                ///< true if read only
+		      )
+{
+    ulong flags;
+
+    local_irq_save(flags);
+    BUG_ON(!reserve->count);
+    reserve->count--;
+    reservedCount--;
+    grant_ref_t ref = _getFreeEntry();
+    local_irq_restore(flags);
+
+    _permitAccess(ref, domid, frame, readonly);
+    return ref;
+}
+
+//______________________________________________________________________________
+/// Give back the entries of reserve not taken
+//______________________________________________________________________________
+void
+xenGrantReserveRelease(XenGrantReserve *reserve   ///< reserve to empty
+		       )
+{
+    ulong flags;
 
-    // get the machine addresses in frames for the grant table, Xen will
-    // watch these frames.
-    // Allocation is in frames rather than grant_table_entries.
-    HYPERVISOR_grant_table_op(GNTTABOP_setup_table, &setup, 1);
+    local_irq_save(flags);
+    reservedCount  -= reserve->count;
+    reserve->count  = 0;
+    local_irq_restore(flags);
+
+    waitQueueWake(&xenGrantQueue);
+}
+
+//______________________________________________________________________________
+/// print grant table use
+//______________________________________________________________________________
+void
+xenGrantStatisticsPrint(void)
+{
+    XenGrantStatistics *s = &xenGrantStatistics;
+
+    xprintLog("grants: frames $[uint] of $[uint] free $[uint] reserved $[uint] in use max $[uint]\n",
+	      xenGrantFrameCount, xenGrantFrameMax, freeCount, reservedCount, s->inUseMax);
+    xprintLog("grants: grows $[ulong] exhausted $[ulong] waits $[ulong] reserved $[ulong]\n",
+	      s->grows, s->exhausted, s->waits, s->reserved);
+    xprintLog("grants: mapped $[ulong] in $[ulong] calls, unmapped $[ulong] in $[ulong] calls\n",
+	      s->mapped, s->mapCalls, s->unmapped, s->unmapCalls);
+    xprintLog("grants: persistent pages taken $[ulong] waits $[ulong]\n",
+	      s->persistentGets, s->persistentWaits);
+}
+
+//______________________________________________________________________________
+// Persistent grants.  A frontend and backend which both advertise
+// feature-persistent keep the pages of a pool granted, and mapped by the
+// backend, for the life of the device; each request copies its data
+// through pool pages, so no grant is made or revoked per request.
+//______________________________________________________________________________
+
+#define XEN_GRANT_PATH_MAX 128
+
+//______________________________________________________________________________
+/// Advertise persistent grants under the frontend's xenstore directory
+/// and return true if the backend advertises them too.
+//______________________________________________________________________________
+bool
+xenGrantPersistentNegotiate(const char *frontend,   ///< frontend device directory
+			    const char *backend     ///< backend device directory
+			    )
+{
+    char  path[XEN_GRANT_PATH_MAX];
+    char *value;
+    bool  persistent;
+
+    snprint(path, sizeof(path), "%s/feature-persistent", (char *) frontend);
+    if (xenbus_write(XBT_NIL, path, "1") != StatusOk)
+	{
+	    return false;
+	}
+
+    snprint(path, sizeof(path), "%s/feature-persistent", (char *) backend);
+    if (xenbus_read(XBT_NIL, path, &value) != StatusOk)
+	{
+	    return false;
+	}
+    persistent = !strcmp(value, "1");
+    xfree(value);
+    return persistent;
+}
+
+//______________________________________________________________________________
+/// Grant count fresh pages to backend, writable, for as long as pool lives
+//______________________________________________________________________________
+Status
+xenGrantPersistentInit(XenGrantPersistentPool *pool,   ///< pool to set up
+		       domid_t backend,                ///< domain of the backend
+		       uint count                      ///< pages in the pool
+		       )
+{
+    XenGrantReserve reserve = { 0 };
+    uint i;
+
+    pool->backend  = backend;
+    pool->count    = 0;
+    pool->free     = 0;
+    pool->freeList = NULL;
+    pool->queue.head = pool->queue.tail = NULL;
+    pool->queue.generation = 0;
+
+    pool->pages = xalloc(charXtype, count * sizeof(XenGrantPersistentPage));
+    if (!pool->pages)
+	{
+	    return StatusNoMemory;
+	}
+
+    Status status = xenGrantReserve(&reserve, count);
+    if (StatusOk != status)
+	{
+	    xfree(pool->pages);
+	    pool->pages = NULL;
+	    return status;
+	}
+
+    for (i = 0; i < count; i++)
+	{
+	    XenGrantPersistentPage *page = &pool->pages[i];
+	    page->page = (void *) pageKernelAllocSingle();
+	    if (!page->page)
+		{   // revoke and free the pages granted so far
+		    pool->count = pool->free = i;
+		    xenGrantPersistentDestroy(pool);
+		    xenGrantReserveRelease(&reserve);
+		    return StatusNoMemory;
+		}
+	    // the backend sees the page from now on, stale data must not leak
+	    memzero(page->page, PAGE_SIZE);
+	    page->ref  = xenGrantReserveAccess(&reserve, backend,
+					       virtualToMfn((vaddr_t) page->page), false);
+	    page->next = pool->freeList;
+	    pool->freeList = page;
+	}
+    pool->count = pool->free = count;
+    return StatusOk;
+}
+
+//______________________________________________________________________________
+/// Revoke the pool's grants and free its pages.  Pages the backend still
+/// has mapped cannot be revoked and are left allocated.
+//______________________________________________________________________________
+void
+xenGrantPersistentDestroy(XenGrantPersistentPool *pool)
+{
+    uint i;
+
+    ASSERT(pool->free == pool->count);
+    for (i = 0; i < pool->count; i++)
+	{
+	    if (xenGrantEndAccess(pool->pages[i].ref))
+		{
+		    pageKernelFreeSingle(pool->pages[i].page);
+		}
+	}
+    if (pool->pages)
+	{
+	    xfree(pool->pages);
+	}
+    pool->pages    = NULL;
+    pool->freeList = NULL;
+    pool->count    = pool->free = 0;
+}
+
+//______________________________________________________________________________
+/// Take a granted page from pool, NULL if all are in use.  Callable from
+/// event handlers.
+//______________________________________________________________________________
+XenGrantPersistentPage *
+xenGrantPersistentGet(XenGrantPersistentPool *pool)
+{
+    ulong flags;
+
+    local_irq_save(flags);
+    XenGrantPersistentPage *page = pool->freeList;
+    if (page)
+	{
+	    pool->freeList = page->next;
+	    pool->free--;
+	    xenGrantStatistics.persistentGets++;
+	}
+    local_irq_restore(flags);
+    return page;
+}
+
+//______________________________________________________________________________
+/// Take a granted page from pool, blocking until one is put back.  Not
+/// for use inside a kernel task, which sleeps on pool->queue instead.
+//______________________________________________________________________________
+XenGrantPersistentPage *
+xenGrantPersistentWait(XenGrantPersistentPool *pool)
+{
+    XenGrantPersistentPage *page;
+
+    if (!pool->free)
+	{
+	    xenGrantStatistics.persistentWaits++;
+	}
+    WAIT_EVENT(&pool->queue, (page = xenGrantPersistentGet(pool)));
+    return page;
+}
+
+//______________________________________________________________________________
+/// Return a page to pool, still granted.  Callable from event handlers.
+//______________________________________________________________________________
+void
+xenGrantPersistentPut(XenGrantPersistentPool *pool,    ///< pool page came from
+		      XenGrantPersistentPage *page     ///< page done with
+		      )
+{
+    ulong flags;
+
+    local_irq_save(flags);
+    page->next = pool->freeList;
+    pool->freeList = page;
+    pool->free++;
+    local_irq_restore(flags);
+
+    waitQueueWake(&pool->queue);
+}
+
+//______________________________________________________________________________
+// Map benchmark: grants one scratch page to this domain XEN_GRANT_BENCH
+// times, then device maps and unmaps the grants one per hypercall and
+// all in one hypercall, printing the cycles of each.  Device maps need
+// no virtual addresses.  It runs as a kernel task, since the domain id
+// has to be read from xenstore first.
+//______________________________________________________________________________
+
+#define XEN_GRANT_BENCH       1024
+#define XEN_GRANT_BENCH_ORDER 4     // pages for the op arrays, as 2^order
+
+enum { GRANT_BENCH_START, GRANT_BENCH_RUN };
+
+static XenbusRequest grantBenchRequest;
+static WaitQueue     grantBenchQueue = WAIT_QUEUE_INIT;
+
+//______________________________________________________________________________
+/// domid read, the task can go on
+//______________________________________________________________________________
+static void
+_grantBenchDomain(XenbusRequest *request)
+{
+    waitQueueWake(&grantBenchQueue);
+}
+
+//______________________________________________________________________________
+/// map and unmap the grants, count per hypercall; returns the cycles
+/// taken and adds the failed ops to failed
+//______________________________________________________________________________
+static uint64
+_grantBenchPass(gnttab_map_grant_ref_t *map, gnttab_unmap_grant_ref_t *unmap,
+		grant_ref_t *refs, domid_t self, uint count, uint *failed)
+{
+    uint64 start = getTsc();
+    uint i;
+    int err;
+
+    for (i = 0; i < XEN_GRANT_BENCH; i++)
+	{
+	    xenGrantMapOpSet(&map[i], 0, GNTMAP_device_map, self, refs[i], true);
+	}
+    for (i = 0; i < XEN_GRANT_BENCH; i += count)
+	{
+	    err = xenGrantMapForeignGrants(&map[i], count);
+	    *failed += err < 0 ? count : err;
+	}
+    for (i = 0; i < XEN_GRANT_BENCH; i++)
+	{
+	    xenGrantUnmapOpSet(&unmap[i], 0, map[i].dev_bus_addr, map[i].handle);
+	}
+    for (i = 0; i < XEN_GRANT_BENCH; i += count)
+	{
+	    err = xenGrantUnmapForeignGrants(&unmap[i], count);
+	    *failed += err < 0 ? count : err;
+	}
+    return getTsc() - start;
+}
+
+//______________________________________________________________________________
+/// benchmark task
+//______________________________________________________________________________
+static bool
+_grantBenchStep(KernelTask *task)
+{
+    if (task->state == GRANT_BENCH_START)
+	{
+	    task->state = GRANT_BENCH_RUN;
+	    kernelTaskSleep(&grantBenchQueue, task);
+	    grantBenchRequest.callback = _grantBenchDomain;
+	    xenbus_read_submit(&grantBenchRequest, XBT_NIL, "domid");
+	    return true;
+	}
+    task->state = GRANT_BENCH_START;
+
+    char *domid;
+    if (xenbus_request_value(&grantBenchRequest, &domid) != StatusOk)
+	{
+	    xprintLog("grants: benchmark cannot read domid\n");
+	    return false;
+	}
+    domid_t self = 0;
+    char *c;
+    for (c = domid; *c; c++)
+	{
+	    self = self * 10 + *c - '0';
+	}
+    xfree(domid);
+
+    XenGrantReserve reserve = { 0 };
+    if (xenGrantReserve(&reserve, XEN_GRANT_BENCH) != StatusOk)
+	{
+	    xprintLog("grants: benchmark cannot reserve $[uint] grants\n", XEN_GRANT_BENCH);
+	    return false;
+	}
+
+    void *page = (void *) pageKernelAllocSingle();
+    gnttab_map_grant_ref_t   *map   = (void *) pageKernelAlloc(XEN_GRANT_BENCH_ORDER);
+    gnttab_unmap_grant_ref_t *unmap = (void *) pageKernelAlloc(XEN_GRANT_BENCH_ORDER);
+    grant_ref_t              *refs  = (void *) pageKernelAllocSingle();
+    C_ASSERT(XEN_GRANT_BENCH * sizeof(*map) <= PAGE_SIZE << XEN_GRANT_BENCH_ORDER);
+    C_ASSERT(XEN_GRANT_BENCH * sizeof(*refs) <= PAGE_SIZE);
+
+    mfn_t mfn = virtualToMfn((vaddr_t) page);
+    uint i;
+    for (i = 0; i < XEN_GRANT_BENCH; i++)
+	{
+	    refs[i] = xenGrantReserveAccess(&reserve, self, mfn, true);
+	}
+
+    uint failedSingle  = 0;
+    uint failedVector  = 0;
+    uint64 single = _grantBenchPass(map, unmap, refs, self, 1, &failedSingle);
+    uint64 vector = _grantBenchPass(map, unmap, refs, self, XEN_GRANT_BENCH, &failedVector);
+
+    for (i = 0; i < XEN_GRANT_BENCH; i++)
+	{
+	    xenGrantEndAccess(refs[i]);
+	}
+    pageKernelFreeSingle(refs);
+    pageKernelFree(unmap, XEN_GRANT_BENCH_ORDER);
+    pageKernelFree(map, XEN_GRANT_BENCH_ORDER);
+    pageKernelFreeSingle(page);
+
+    xprintLog("grants: $[uint] map+unmap, one per call $[ulong] cycles ($[uint] failed), one call $[ulong] cycles ($[uint] failed)\n",
+	      XEN_GRANT_BENCH, (ulong) single, failedSingle, (ulong) vector, failedVector);
+    return false;
+}
+
+static KernelTask grantBenchTask = KERNEL_TASK(_grantBenchStep, NULL);
+
+//______________________________________________________________________________
+/// start the map benchmark, unless it is already running
+//______________________________________________________________________________
+void
+xenGrantBenchmarkStart(void)
+{
+    if (grantBenchTask.queued || grantBenchTask.state != GRANT_BENCH_START)
+	{
+	    xprintLog("grants: benchmark already running\n");
+	    return;
+	}
+    kernelTaskStart(&grantBenchTask);
+}
+
+//______________________________________________________________________________
+/// Initialize the grant table
+//______________________________________________________________________________
+void
+xenGrantInit(void)
+{
+    gnttab_query_size_t query;
 
-    printfLog("XEN_GRANT_ frames:\n");
-    for (i = 0; i < NR_GRANT_FRAMES; i++)
+    // how far Xen lets the table grow
+    query.dom = DOMID_SELF;
+    if (HYPERVISOR_grant_table_op(GNTTABOP_query_size, &query, 1) || query.status)
 	{
-	    //ASSERT(isForeignMachineAddr(frames_addr[i])); // Does not work on PAE
-	    printfLog("\tMFN = 0x%x\n", frames[i]);
+	    query.max_nr_frames = NR_GRANT_FRAMES;
 	}
+    xenGrantFrameMax = MIN(query.max_nr_frames, XEN_GRANT_FRAMES_MAX);
 
     // the frames returned from GNTTABOP_setup_table are mapped into virtual memory
-    // and returned as xenGrantTable.
-    Status status = pageTableKernelMap(NR_GRANT_FRAMES, frames, (vaddr_t *) &xenGrantTable);
-    BUG_ON(StatusOk!=status);
+    BUG_ON(!_grow(NR_GRANT_FRAMES * GRANT_ENTRIES_PER_FRAME));
 
-    printfLog("xenGrantTable mapped at %p.\n", xenGrantTable);
-    printfLog("NR_GRANT_ENTRIES: %d\n", NR_GRANT_ENTRIES);
+    printfLog("xenGrantTable %d frames, at most %d, first mapped at %p.\n",
+	      xenGrantFrameCount, xenGrantFrameMax, xenGrantFrames[0]);
 }
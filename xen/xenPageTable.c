@@ -30,14 +30,34 @@ xenPageTablePin(pt_t pt)
 {
     // pin the page directory.
     struct mmuext_op op;
-    op.cmd = XEN_PAGETABLE_PIN_COMMAND;
-    op.arg1.mfn = virtualToMfn((vaddr_t) pt);
+    xenPageTablePinOp(pt, &op);
 
     int reason  = HYPERVISOR_mmuext_op(&op, 1, NULL, DOMID_SELF);
     if ( reason < 0) {
 	printfLog("could not pin page table, error = %d\n", reason);
 	BUG();
     }
+    xenPageTablePinned(pt);
+}
+
+//______________________________________________________________________________
+/// Fill in op to pin pt, so the pin can be batched with other page table
+/// updates.  The caller must BUG() if the op fails, and call
+/// xenPageTablePinned once it is done.
+//______________________________________________________________________________
+void
+xenPageTablePinOp(pt_t pt, struct mmuext_op *op)
+{
+    op->cmd = XEN_PAGETABLE_PIN_COMMAND;
+    op->arg1.mfn = virtualToMfn((vaddr_t) pt);
+}
+
+//______________________________________________________________________________
+/// Record that pt has been pinned
+//______________________________________________________________________________
+void
+xenPageTablePinned(pt_t pt)
+{
     set_bit(PG_pinned, &virtualToPhysicalInfo(pt)->flags);
 }
 
@@ -29,6 +29,20 @@ xenScheduleYield()
   return HYPERVISOR_sched_op(SCHEDOP_yield, 0);
 }
 
+//_________________________________________________________________________
+/// Wait for an event on one of ports, or until timeout (absolute system
+/// time in ns, 0 for none).  Events must be masked.
+//_________________________________________________________________________
+int
+xenSchedulePoll(evtchn_port_t *ports, uint count, uint64 timeout)
+{
+  sched_poll_t poll;
+  set_xen_guest_handle(poll.ports, ports);
+  poll.nr_ports = count;
+  poll.timeout  = timeout;
+  return HYPERVISOR_sched_op(SCHEDOP_poll, &poll);
+}
+
 //_________________________________________________________________________
 /// shutdown OS
 //_________________________________________________________________________
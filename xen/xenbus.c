@@ -12,6 +12,7 @@
 #include <nano/xenEvent.h>
 #include <nano/schedPrivileged.h>
 #include <nano/fmt.h>
+#include <nano/kernelTask.h>
 
 // Request id table.
 static HandleTable reqIds;
@@ -78,18 +79,41 @@ typedef struct
     unsigned len;
 } xs_write_req_t;
 
-// Reply structure.
+// Pipelining counters.
 typedef struct
 {
-    enum { RECEIVED, PENDING } state;
-    void *reply;
-} xs_write_reply_t;
+    ulong submitted;     // requests written or queued for the ring
+    ulong completed;     // replies received
+    ulong inFlightMax;   // most requests outstanding at once
+    ulong backlogged;    // requests which found the ring full
+    ulong borrowed;      // replies parsed in place in the ring
+    ulong copied;        // replies copied out of the ring
+    ulong batches;       // xenbus_submit_end calls
+    ulong cacheHits;     // reads answered by the cache
+    ulong cacheMisses;   // reads outside transactions sent to xenstored
+    ulong cacheInvalidations;  // entries dropped by watches or our writes
+    ulong cacheEvictions;      // entries dropped for room
+    ulong cacheWatches;  // subtree watches registered
+    ulong watchEvents;   // watch events received
+    ulong watchCoalesced;      // events merged into one still pending
+    ulong watchUnknown;  // events for no registered token
+} xenbus_statistics_t;
 
-// Global that gets changed on a watch event coming in...
-// This is ueber-lame. But lack of threading + lack
-// userspace consumers of this code pretty much condemns
-// us to doing someting like this.
-static enum { NOT_SIGNALLED, SIGNALLED } xenbus_watch_state = NOT_SIGNALLED;
+static xenbus_statistics_t xenbus_statistics;
+
+// requests waiting for room in the request ring, oldest first
+static XenbusRequest *backlogHead;
+static XenbusRequest *backlogTail;
+
+// woken by xenbus_event on replies
+static WaitQueue replyQueue = WAIT_QUEUE_INIT;
+
+// Registered watches, hashed by token.  Each watch gets a token of its
+// own, so an event wakes only the watch it is for.
+#define XENBUS_WATCH_BUCKETS 32
+
+static XenbusWatch *watchBuckets[XENBUS_WATCH_BUCKETS];
+static ulong        watchTokens;     // tokens handed out
 
 // Inter-domain shared memory communications.
 #define XENSTORE_RING_SIZE 1024
@@ -107,6 +131,23 @@ struct xenstore_domain_interface
 // xenbus interface.
 static struct xenstore_domain_interface *xs_iface;
 
+// Replies parsed in place stay in the rsp ring until released, so
+// rsp_cons only moves past released replies; rspSeen is how far
+// xenbus_event has read.  Few are held at a time, since they hold
+// ring space xenstored needs for further replies.
+#define XENBUS_BORROW_MAX 8
+
+typedef struct
+{
+    XENSTORE_RING_IDX start;     // of the reply's header
+    bool              released;
+} xenbus_borrow_t;
+
+static xenbus_borrow_t   borrows[XENBUS_BORROW_MAX];   // oldest at borrowHead
+static uint              borrowHead;
+static uint              borrowCount;
+static XENSTORE_RING_IDX rspSeen;
+
 //______________________________________________________________________________
 /// Copy string from ring with wraparound
 //______________________________________________________________________________
@@ -125,6 +166,354 @@ memcpy_from_ring(const void *ring,     ///< ring from which string is to be copi
     memcpy(d + c1, r, c2);
 }
 
+//______________________________________________________________________________
+/// Copy string to ring with wraparound
+//______________________________________________________________________________
+static void
+memcpy_to_ring(void *ring,             ///< ring to which string is to be copied
+	       const void *src,        ///< source buffer
+	       int off,                ///< starting offset into ring
+	       int len                 ///< number of bytes
+	       )
+{
+    char *r = ring;
+    const char *d = src;
+    int c1 = MIN(len, XENSTORE_RING_SIZE - off);
+    int c2 = len - c1;
+    memcpy(r + off, d, c1);
+    memcpy(r, d + c1, c2);
+}
+
+//______________________________________________________________________________
+// Read cache.  Values read outside transactions are kept, keyed by path,
+// once a watch on their subtree makes xenstored tell us when they change;
+// our own writes and removes drop them directly.  A read which was in
+// flight across an invalidation is not cached, it may be stale.
+//______________________________________________________________________________
+
+#define XENBUS_CACHE_MAX   64
+
+typedef struct
+{
+    ListHead  list;      // most recently used first
+    uint32_t  hash;
+    char     *path;      // path and value follow the entry, in one allocation
+    char     *value;
+} xenbus_cache_entry_t;
+
+typedef struct
+{
+    ListHead     list;
+    XenbusWatch  watch;
+    char        *path;   // subtree watched
+} xenbus_cache_watch_t;
+
+static LIST_HEAD(cacheEntries);
+static LIST_HEAD(cacheWatches);
+static uint           cacheCount;
+static volatile ulong cacheGeneration;   // incremented by each invalidation
+
+//______________________________________________________________________________
+/// hash of a path or token, to skip most string compares
+//______________________________________________________________________________
+static uint32_t
+xenbus_hash(const char *path)
+{
+    uint32_t hash = 5381;
+    while (*path)
+	{
+	    hash = hash * 33 + (uchar) *path++;
+	}
+    return hash;
+}
+
+//______________________________________________________________________________
+/// true if path is subtree or below it
+//______________________________________________________________________________
+static bool
+xenbus_cache_under(const char *path, const char *subtree)
+{
+    int len = strlen(subtree);
+    return !strncmp(path, subtree, len) && (path[len] == '\0' || path[len] == '/');
+}
+
+//______________________________________________________________________________
+/// free what a failed allocation sequence did get
+//______________________________________________________________________________
+static void
+xenbus_cache_free(void *p)
+{
+    if (p)
+	{
+	    xfree(p);
+	}
+}
+
+//______________________________________________________________________________
+/// remove and free an entry, events masked
+//______________________________________________________________________________
+static void
+xenbus_cache_drop(xenbus_cache_entry_t *entry)
+{
+    list_del(&entry->list);
+    cacheCount--;
+    xfree(entry);
+}
+
+//______________________________________________________________________________
+/// drop path and everything below it, called from the event handler on
+/// watch events and before our own writes
+//______________________________________________________________________________
+static void
+xenbus_cache_invalidate(const char *path)
+{
+    xenbus_cache_entry_t *entry, *next;
+    ulong flags;
+
+    local_irq_save(flags);
+    cacheGeneration++;
+    list_for_each_entry_safe(entry, next, &cacheEntries, list)
+	{
+	    if (xenbus_cache_under(entry->path, path))
+		{
+		    xenbus_cache_drop(entry);
+		    xenbus_statistics.cacheInvalidations++;
+		}
+	}
+    local_irq_restore(flags);
+}
+
+//______________________________________________________________________________
+/// find path, events masked
+//______________________________________________________________________________
+static xenbus_cache_entry_t *
+xenbus_cache_find(const char *path, uint32_t hash)
+{
+    xenbus_cache_entry_t *entry;
+
+    list_for_each_entry(entry, &cacheEntries, list)
+	{
+	    if (entry->hash == hash && !strcmp(entry->path, path))
+		{
+		    return entry;
+		}
+	}
+    return NULL;
+}
+
+//______________________________________________________________________________
+/// copy of the cached value of path, NULL on a miss.  The copy is the
+/// caller's to free, as xenbus_read's values are.
+//______________________________________________________________________________
+static char *
+xenbus_cache_lookup(const char *path)
+{
+    char *value = NULL;
+    ulong flags;
+
+    local_irq_save(flags);
+    xenbus_cache_entry_t *entry = xenbus_cache_find(path, xenbus_hash(path));
+    if (entry)
+	{
+	    int len = strlen(entry->value) + 1;
+	    value = xalloc(charXtype, len);
+	    if (value)
+		{
+		    memcpy(value, entry->value, len);
+		}
+	    list_del(&entry->list);
+	    list_add(&entry->list, &cacheEntries);
+	    xenbus_statistics.cacheHits++;
+	}
+    else
+	{
+	    xenbus_statistics.cacheMisses++;
+	}
+    local_irq_restore(flags);
+    return value;
+}
+
+//______________________________________________________________________________
+/// cache value of path, read when the generation was generation.  The
+/// entry, path and value take a single allocation.
+//______________________________________________________________________________
+static void
+xenbus_cache_insert(const char *path, const char *value, ulong generation)
+{
+    uint32_t hash = xenbus_hash(path);
+    int pathLen   = strlen(path) + 1;
+    int valueLen  = strlen(value) + 1;
+    xenbus_cache_entry_t *entry = xalloc(charXtype, sizeof(*entry) + pathLen + valueLen);
+    ulong flags;
+
+    local_irq_save(flags);
+    if (!entry || generation != cacheGeneration || xenbus_cache_find(path, hash))
+	{
+	    local_irq_restore(flags);
+	    xenbus_cache_free(entry);
+	    return;
+	}
+
+    if (cacheCount == XENBUS_CACHE_MAX)
+	{
+	    xenbus_cache_drop(list_entry(cacheEntries.prev, xenbus_cache_entry_t, list));
+	    xenbus_statistics.cacheEvictions++;
+	}
+
+    entry->hash  = hash;
+    entry->path  = (char *) (entry + 1);
+    entry->value = entry->path + pathLen;
+    memcpy(entry->path, path, pathLen);
+    memcpy(entry->value, value, valueLen);
+    list_add(&entry->list, &cacheEntries);
+    cacheCount++;
+    local_irq_restore(flags);
+}
+
+//______________________________________________________________________________
+/// watch with token, events masked; NULL if there is none
+//______________________________________________________________________________
+static XenbusWatch *
+xenbus_watch_find(const char *token)
+{
+    XenbusWatch *watch = watchBuckets[xenbus_hash(token) % XENBUS_WATCH_BUCKETS];
+
+    while (watch && strcmp(watch->token, token))
+	{
+	    watch = watch->next;
+	}
+    return watch;
+}
+
+//______________________________________________________________________________
+/// callback of watches which only need the cache invalidation every
+/// event does; dispatch never queues it, so they never have one pending
+//______________________________________________________________________________
+static void
+xenbus_watch_ignore(XenbusWatch *watch)
+{
+}
+
+//______________________________________________________________________________
+/// hand a watch event to its watch, from the event handler.  An event
+/// arriving while the watch still has one pending is merged into it;
+/// if their paths differ the pending path becomes the watched path.
+//______________________________________________________________________________
+static void
+xenbus_watch_dispatch(const char *path, const char *token)
+{
+    XenbusWatch *watch = xenbus_watch_find(token);
+
+    xenbus_statistics.watchEvents++;
+    if (!watch)
+	{
+	    xenbus_statistics.watchUnknown++;
+	    return;
+	}
+
+    watch->events++;
+    if (watch->callback == xenbus_watch_ignore)
+	{   // nothing is pending on a cache watch, the event invalidated
+	    return;
+	}
+    if (watch->pending)
+	{
+	    watch->coalesced++;
+	    xenbus_statistics.watchCoalesced++;
+	    if (strncmp(watch->eventPath, path, sizeof(watch->eventPath)))
+		{
+		    strncpy(watch->eventPath, watch->path, sizeof(watch->eventPath) - 1);
+		}
+	    return;
+	}
+
+    strncpy(watch->eventPath, path, sizeof(watch->eventPath) - 1);
+    watch->pending = true;
+    if (watch->callback)
+	{
+	    interruptDeferredQueue(&watch->work);
+	}
+    waitQueueWake(&watch->queue);
+}
+
+//______________________________________________________________________________
+/// deferred work running a watch's callback with events enabled
+static void
+xenbus_watch_run(void *arg)
+{
+    XenbusWatch *watch = arg;
+
+    if (watch->pending)
+	{
+	    watch->pending = false;
+	    watch->callback(watch);
+	}
+}
+
+//______________________________________________________________________________
+/// true if len bytes can be written to the request ring
+//______________________________________________________________________________
+static bool
+xenbus_ring_space(int len)
+{
+    return xs_iface->req_prod + len - xs_iface->req_cons <= XENSTORE_RING_SIZE;
+}
+
+//______________________________________________________________________________
+/// Move backlogged requests into the ring while they fit, events masked.
+/// Returns true if any were moved.
+//______________________________________________________________________________
+static bool
+xenbus_backlog_push(void)
+{
+    bool pushed = false;
+
+    while (backlogHead && xenbus_ring_space(backlogHead->length))
+	{
+	    XenbusRequest *request = backlogHead;
+	    backlogHead = request->next;
+	    if (!backlogHead)
+		{
+		    backlogTail = NULL;
+		}
+
+	    memcpy_to_ring(xs_iface->req, request->message,
+			   MASK_XENSTORE_IDX(xs_iface->req_prod), request->length);
+	    wmb();
+	    xs_iface->req_prod += request->length;
+
+	    xfree(request->message);
+	    request->message = NULL;
+	    pushed = true;
+	}
+    return pushed;
+}
+
+//______________________________________________________________________________
+/// Move rsp_cons up to the oldest reply still borrowed, or to all read if
+/// none is, events masked.  Returns true if it moved.
+//______________________________________________________________________________
+static bool
+xenbus_rsp_advance(void)
+{
+    while (borrowCount && borrows[borrowHead].released)
+	{
+	    borrowHead = (borrowHead + 1) % XENBUS_BORROW_MAX;
+	    borrowCount--;
+	}
+
+    XENSTORE_RING_IDX cons = borrowCount ? borrows[borrowHead].start : rspSeen;
+    if (cons == xs_iface->rsp_cons)
+	{
+	    return false;
+	}
+
+    // done with the replies before the ring space is handed back
+    mb();
+    xs_iface->rsp_cons = cons;
+    return true;
+}
+
 //______________________________________________________________________________
 /// Event channel handler.
 //______________________________________________________________________________
@@ -135,44 +524,138 @@ xenbus_event(evtchn_port_t port,           ///< port on which the event arrives
 	     )
 {
     xs_message_t msg;
+    bool replied = false;
+
+    // xenstored has consumed requests, making room for the backlog
+    if (xenbus_backlog_push())
+	{
+	    xenEventNotify(start_info.store_evtchn);
+	}
+
     while (1)
 	{
-	    if (xs_iface->rsp_prod - xs_iface->rsp_cons < sizeof(msg))
+	    if (xs_iface->rsp_prod - rspSeen < sizeof(msg))
 		{
 		    break;
 		}
 	    rmb();
-	    memcpy_from_ring(xs_iface->rsp, &msg, MASK_XENSTORE_IDX(xs_iface->rsp_cons),
+	    memcpy_from_ring(xs_iface->rsp, &msg, MASK_XENSTORE_IDX(rspSeen),
 			     sizeof(msg));
-	    if (xs_iface->rsp_prod - xs_iface->rsp_cons < sizeof(msg) + msg.len)
+	    if (xs_iface->rsp_prod - rspSeen < sizeof(msg) + msg.len)
 		{
 		    break;
 		}
 	    if (msg.type == XS_WATCH_EVENT)
 		{
-		    xs_iface->rsp_cons += msg.len + sizeof(msg);
-		    xenbus_watch_state = SIGNALLED;
+		    // path and token, each NUL terminated
+		    static char event[XENSTORE_RING_SIZE + 1];
+		    BUG_ON(msg.len > XENSTORE_RING_SIZE);
+		    memcpy_from_ring(xs_iface->rsp, event,
+				     MASK_XENSTORE_IDX(rspSeen + sizeof(msg)), msg.len);
+		    event[msg.len] = '\0';
+		    rspSeen += msg.len + sizeof(msg);
+
+		    // any watch on the path shows cached values below it
+		    // changed, and must be dropped before a watcher re-reads
+		    xenbus_cache_invalidate(event);
+		    int pathLen = strlen(event) + 1;
+		    xenbus_watch_dispatch(event, pathLen < msg.len ? event + pathLen : "");
 		}
 	    else
 		{
-		    xs_write_reply_t *reply_struct;
-		    int status = handleGetReference(&reqIds, msg.req_id, (void**) &reply_struct);
+		    XenbusRequest *request;
+		    int status = handleGetReference(&reqIds, msg.req_id, (void**) &request);
 		    BUG_ON(status != StatusOk);
-		    reply_struct->reply = xalloc(charXtype, sizeof(msg) + msg.len);
-		    BUG_ON(reply_struct->reply == NULL);
-		    memcpy_from_ring(xs_iface->rsp,
-				     reply_struct->reply, 
-				     MASK_XENSTORE_IDX(xs_iface->rsp_cons),
-				     msg.len + sizeof(msg));
-		    xs_iface->rsp_cons += msg.len + sizeof(msg);
-		    reply_struct->state = RECEIVED;
+		    int off = MASK_XENSTORE_IDX(rspSeen);
+		    if (request->borrow && borrowCount < XENBUS_BORROW_MAX &&
+			off + sizeof(msg) + msg.len <= XENSTORE_RING_SIZE)
+			{
+			    // contiguous: the consumer parses it where it is
+			    request->reply = xs_iface->rsp + off;
+			    xenbus_borrow_t *borrow = &borrows[(borrowHead + borrowCount++) % XENBUS_BORROW_MAX];
+			    borrow->start    = rspSeen;
+			    borrow->released = false;
+			    xenbus_statistics.borrowed++;
+			}
+		    else
+			{
+			    request->reply = xalloc(charXtype, sizeof(msg) + msg.len);
+			    BUG_ON(request->reply == NULL);
+			    memcpy_from_ring(xs_iface->rsp,
+					     request->reply, 
+					     off,
+					     msg.len + sizeof(msg));
+			    xenbus_statistics.copied++;
+			}
+		    rspSeen += msg.len + sizeof(msg);
+
+		    // the id is free for reuse as soon as its reply is in
+		    handleFree(&reqIds, msg.req_id);
+		    xenbus_statistics.completed++;
+		    request->done = true;
+		    if (request->callback)
+			{
+			    request->callback(request);
+			}
+		    replied = true;
 		}
 	    wmb();
 	}
+
+    if (replied)
+	{
+	    waitQueueWake(&replyQueue);
+	}
+
+    // tell xenstored there is room for more replies
+    if (xenbus_rsp_advance())
+	{
+	    xenEventNotify(start_info.store_evtchn);
+	}
+}
+
+//______________________________________________________________________________
+/// Release a reply: one still in the ring gives its space back to
+/// xenstored once the replies before it are released too, a copy is freed.
+//______________________________________________________________________________
+static void
+xenbus_reply_release(xs_message_t *reply       ///< reply from xenbus_event
+		     )
+{
+    char *r = (char *) reply;
+    ulong flags;
+    uint  i;
+
+    if (r < xs_iface->rsp || r >= xs_iface->rsp + XENSTORE_RING_SIZE)
+	{
+	    xfree(reply);
+	    return;
+	}
+
+    local_irq_save(flags);
+    for (i = 0; i < borrowCount; i++)
+	{
+	    xenbus_borrow_t *borrow = &borrows[(borrowHead + i) % XENBUS_BORROW_MAX];
+	    if (xs_iface->rsp + MASK_XENSTORE_IDX(borrow->start) == r && !borrow->released)
+		{
+		    borrow->released = true;
+		    break;
+		}
+	}
+    BUG_ON(i == borrowCount);
+    bool advanced = xenbus_rsp_advance();
+    local_irq_restore(flags);
+
+    if (advanced)
+	{
+	    xenEventNotify(start_info.store_evtchn);
+	}
 }
 
 //______________________________________________________________________________
-/// Send data to xenbus. Blocks until done.
+/// Send data to xenbus.  If the ring has no room, or older requests are
+/// still waiting for room, the message is copied and left in the backlog
+/// for xenbus_event to write.
 //______________________________________________________________________________
 static void
 xenbus_write_ring(
@@ -181,18 +664,16 @@ xenbus_write_ring(
 		  int req_id,                      ///< request ID to match with return
 		  xenbus_transaction_t trans_id,   ///< transaction number (or zero)
 		  xs_write_req_t *req,             ///< array of the data to write
-		  int nr_reqs                      ///< the size of the req array
+		  int nr_reqs,                     ///< the size of the req array
+		  XenbusRequest *request           ///< request backlogged if need be
 		  )
 {
+    ulong flags;
     int r;
-    int req_off;
     int total_off;
-    int this_chunk;
-    const xs_write_req_t *current_req;
     XENSTORE_RING_IDX prod;
     int len = 0;
     xs_message_t message = { .type = type, .req_id = req_id, .tx_id = trans_id };
-    xs_write_req_t header = { &message, sizeof(message) };
 
     // Compute total length.
     for (r = 0; r < nr_reqs; r++)
@@ -201,65 +682,104 @@ xenbus_write_ring(
 	}
     message.len = len;
     len += sizeof(message);
-    current_req = &header;
 
     // If the whole message cannot fit in one message, fail...
     BUG_ON(len > XENSTORE_RING_SIZE);
 
-    // wait until there is room to write the whole message in one go
-    prod = xs_iface->req_prod;
-    if (prod + len - xs_iface->req_cons > XENSTORE_RING_SIZE) // don't need if? ---jas
+    // the whole message is written in one go, if there is room for it;
+    // xenbus_event writes the backlog, so the ring is written with events masked
+    local_irq_save(flags);
+    if (backlogHead || !xenbus_ring_space(len))
 	{
-	    // Wait for space to become available.
-	    while (xs_iface->req_prod + len - xs_iface->req_cons > XENSTORE_RING_SIZE)
+	    char *m = xalloc(charXtype, len);
+	    BUG_ON(m == NULL);
+	    memcpy(m, &message, sizeof(message));
+	    for (r = 0, total_off = sizeof(message); r < nr_reqs; r++)
 		{
-		    rmb();
+		    memcpy(m + total_off, req[r].data, req[r].len);
+		    total_off += req[r].len;
 		}
-	    prod = xs_iface->req_prod;
-	}
-
-    // Should fit, now write each request in at most two chunks
-    total_off = 0;
-    req_off = 0;
-    while (total_off < len)  // should use a memcpy_to_ring procedure internal to loop, with a for loop --jas
-	{
-	    this_chunk = MIN(current_req->len - req_off, XENSTORE_RING_SIZE - MASK_XENSTORE_IDX(prod));
-	    memcpy((char *) xs_iface->req + MASK_XENSTORE_IDX(prod),
-		   (char *) current_req->data + req_off,
-		   this_chunk);
-	    prod += this_chunk;
-	    req_off += this_chunk;
-	    total_off += this_chunk;
-	    if (req_off == current_req->len)
+	    request->message = m;
+	    request->length  = len;
+	    request->next    = NULL;
+	    if (backlogTail)
 		{
-		    req_off = 0;
-		    if (current_req == &header)
-			{
-			    current_req = req;
-			}
-		    else
-			{
-			    current_req++;
-			}
+		    backlogTail->next = request;
+		}
+	    else
+		{
+		    backlogHead = request;
 		}
+	    backlogTail = request;
+	    xenbus_statistics.backlogged++;
+	    local_irq_restore(flags);
+
+	    // xenstored must have been told about what is already in the ring
+	    xenEventNotifyFlush();
+	    return;
 	}
+    prod = xs_iface->req_prod;
 
-    BUG_ON(req_off != 0);
-    BUG_ON(total_off != len);
+    // Should fit, now write the header and each request, wrapping as needed
+    memcpy_to_ring(xs_iface->req, &message, MASK_XENSTORE_IDX(prod), sizeof(message));
+    prod += sizeof(message);
+    for (r = 0; r < nr_reqs; r++)
+	{
+	    memcpy_to_ring(xs_iface->req, req[r].data, MASK_XENSTORE_IDX(prod), req[r].len);
+	    prod += req[r].len;
+	}
+
+    BUG_ON(prod - xs_iface->req_prod != len);
     BUG_ON(prod > xs_iface->req_cons + XENSTORE_RING_SIZE);
 
     // force out ring buffer updates
     wmb();
     // Update indices.
     xs_iface->req_prod += len;
+    local_irq_restore(flags);
 
     // Notify remote.
-    notify_remote_via_evtchn(start_info.store_evtchn);
+    xenEventNotify(start_info.store_evtchn);
 }
 
 //______________________________________________________________________________
-/// Send a message to xenbus. Reply is malloced and is to be
-/// freed by the caller.
+/// Send a message to xenbus without waiting for the reply, which
+/// xenbus_event attaches to request.
+//______________________________________________________________________________
+static void
+xenbus_submit(
+	      XenbusRequest *request,           ///< outstanding until done
+	      xsd_sockmsg_type_t type,          ///< message types
+	      xenbus_transaction_t trans,       ///< transaction ID
+	      xs_write_req_t *io,               ///< request to send
+	      int nr_reqs                       ///< number of requests
+	      )
+{
+    ulong flags;
+    HandleId handleId;
+
+    request->done    = false;
+    request->reply   = NULL;
+    request->message = NULL;
+
+    // xenbus_event frees ids
+    local_irq_save(flags);
+    int status = handleAllocate(&reqIds, request, &handleId);
+    BUG_ON(status != StatusOk);
+    xenbus_statistics.submitted++;
+    xenbus_statistics.inFlightMax = MAX(xenbus_statistics.inFlightMax,
+					xenbus_statistics.submitted - xenbus_statistics.completed);
+    local_irq_restore(flags);
+
+    ShortHandleId shortHandleId = handleId;
+    C_ASSERT(sizeof(shortHandleId) == sizeof(((xs_message_t *) 0)->req_id));
+    request->id = shortHandleId;
+    xenbus_write_ring(type, shortHandleId, trans, io, nr_reqs, request);
+}
+
+//______________________________________________________________________________
+/// Send a message to xenbus. Reply is to be released by the caller
+/// with xenbus_reply_release, soon: it may be held in the ring.
 //______________________________________________________________________________
 static xs_message_t *
 xenbus_msg_reply(
@@ -269,25 +789,60 @@ xenbus_msg_reply(
 		 int nr_reqs                       ///< number of requests
 		 )
 {
-    HandleId handleId;
-    xs_write_reply_t reply = { .state = PENDING };
-    int status = handleAllocate(&reqIds, &reply, &handleId);
-    BUG_ON(status != StatusOk);
-    ShortHandleId shortHandleId = handleId;
-    xenbus_write_ring(type, shortHandleId, trans, io, nr_reqs);
-    while (reply.state == PENDING)
+    XenbusRequest request = { .callback = NULL, .borrow = true };
+    xenbus_submit(&request, type, trans, io, nr_reqs);
+    xenbus_request_wait(&request);
+
+    // Now we have a response.
+    xs_message_t *rep = request.reply;
+    BUG_ON(rep->req_id != request.id);
+    return rep;
+}
+
+//______________________________________________________________________________
+/// Make sure the subtree holding path is watched, so its values can be
+/// cached.  Returns false if xenstored refuses the watch.
+//______________________________________________________________________________
+static bool
+xenbus_cache_watch(const char *path)
+{
+    xenbus_cache_watch_t *watch;
+
+    list_for_each_entry(watch, &cacheWatches, list)
 	{
-	    archKernelBlock();
-	    rmb();
+	    if (xenbus_cache_under(path, watch->path))
+		{
+		    return true;
+		}
 	}
 
-    // Now we have a response.
-    xs_message_t *rep = reply.reply;
-    C_ASSERT(sizeof(shortHandleId) == sizeof(rep->req_id));
+    // watch the parent, so that sibling keys share one watch; events
+    // invalidate on their own, so the watch ignores them
+    const char *slash = strrchr(path, '/');
+    int len = slash && slash != path ? slash - path : strlen(path);
+    watch = xalloc(charXtype, sizeof(*watch));
+    char *subtree = xalloc(charXtype, len + 1);
+    if (!watch || !subtree)
+	{
+	    xenbus_cache_free(watch);
+	    xenbus_cache_free(subtree);
+	    return false;
+	}
+    memcpy(subtree, path, len);
+    subtree[len] = '\0';
 
-    BUG_ON(rep->req_id != shortHandleId);
-    handleFree(&reqIds, shortHandleId);
-    return rep;
+    watch->watch.callback = xenbus_watch_ignore;
+    if (xenbus_watch_register(&watch->watch, subtree) != StatusOk)
+	{
+	    xfree(watch);
+	    xfree(subtree);
+	    return false;
+	}
+
+    watch->path = subtree;
+    list_add(&watch->list, &cacheWatches);
+    xenbus_statistics.cacheWatches++;
+    return true;
 }
 
 //______________________________________________________________________________
@@ -397,7 +952,7 @@ xenbus_ls(
     res[i] = NULL;
     *contents = res;
  done:
-    xfree(repmsg);
+    xenbus_reply_release(repmsg);
     return status;
 }
 
@@ -418,6 +973,7 @@ xenbus_write(
 	    // todo: changed from { value, strlen(value) + 1}
 	    { value, strlen(value)}
 	};
+    xenbus_cache_invalidate(path);
     xs_message_t *reply = xenbus_msg_reply(XS_WRITE, xbt, req, ARRAY_SIZE(req));
     if (reply->type == XS_ERROR)
 	{
@@ -426,7 +982,7 @@ xenbus_write(
 	}
 
  done:
-    xfree(reply);
+    xenbus_reply_release(reply);
     return status;
 }
 
@@ -467,6 +1023,7 @@ xenbus_rm(
 {
     int status = StatusOk;
     xs_write_req_t req[] = { { path, strlen(path) + 1 } };
+    xenbus_cache_invalidate(path);
     xs_message_t *reply = xenbus_msg_reply(XS_RM, xbt, req, ARRAY_SIZE(req));
     if (reply->type == XS_ERROR)
 	{
@@ -474,7 +1031,7 @@ xenbus_rm(
 	    goto done;
 	}
  done:
-    xfree(reply);
+    xenbus_reply_release(reply);
     return status;
 }
 
@@ -497,7 +1054,7 @@ xenbus_begin(xenbus_transaction_t *xbt           ///< transaction ID return
     sscanf((char*) (reply + 1), "%u", xbt);
 
  done:
-    xfree(reply);
+    xenbus_reply_release(reply);
     return status;
 }
 
@@ -519,7 +1076,7 @@ xenbus_end(xenbus_transaction_t xbt,           ///< transaction ID
 	}
 
  done:
-    xfree(reply);
+    xenbus_reply_release(reply);
     return status;
 }
 
@@ -549,7 +1106,7 @@ xenbus_get_perms(
     *value = res;
 
  done:
-    xfree(reply);
+    xenbus_reply_release(reply);
     return status;
 }
 
@@ -618,7 +1175,7 @@ xenbus_set_perms(
 	    goto done;
 	}
  done:
-    xfree(reply);
+    xenbus_reply_release(reply);
     return status;
 }
 
@@ -633,60 +1190,182 @@ xenbus_read(
 	    char **value                          ///< value to be returned
 	    )
 {
-    char *res;
-    xs_message_t *repmsg;
-    int status = StatusOk;
-    xs_write_req_t req[] = { { path, strlen(path) + 1 } };
-    repmsg = xenbus_msg_reply(XS_READ, xbt, req, ARRAY_SIZE(req));
-    if (repmsg->type == XS_ERROR)
+    XenbusRequest request = { .callback = NULL, .borrow = true };
+    bool cacheable = false;
+
+    if (xbt == XBT_NIL)
 	{
-	    // status not StatusOk
-	    status = xenbus_error((char*) (repmsg + 1));
-	    goto done;
+	    char *cached = xenbus_cache_lookup(path);
+	    if (cached)
+		{
+		    *value = cached;
+		    return StatusOk;
+		}
+	    cacheable = xenbus_cache_watch(path);
+	}
+
+    ulong generation = cacheGeneration;
+    xenbus_read_submit(&request, xbt, path);
+    xenbus_request_wait(&request);
+    int status = xenbus_request_value(&request, value);
+    if (cacheable && status == StatusOk)
+	{
+	    xenbus_cache_insert(path, *value, generation);
 	}
-    res = xalloc(charXtype, repmsg->len + 1);
-    memcpy(res, repmsg + 1, repmsg->len);
-    res[repmsg->len] = 0;
-    *value = res;
- done:
-    xfree(repmsg);
     return status;
 }
 
 //______________________________________________________________________________
-/// Watch a xenbus path.
-/// Returns when value of path matches value.
+/// write the token for a new watch, as "w" and a hex number
+//______________________________________________________________________________
+static void
+xenbus_watch_token(char *token, ulong n)
+{
+    char digits[2 * sizeof(n)];
+    int  i = 0;
+
+    do
+	{
+	    digits[i++] = "0123456789abcdef"[n & 0xf];
+	    n >>= 4;
+	}
+    while (n);
+
+    *token++ = 'w';
+    while (i)
+	{
+	    *token++ = digits[--i];
+	}
+    *token = '\0';
+}
+
+//______________________________________________________________________________
+/// Register watch on path, with a token of its own.  watch and path must
+/// stay put until the watch is unregistered.  Each event then queues the
+/// watch's callback, if it has one, and wakes its waiters; events which
+/// arrive while one is pending are merged into it.
 //______________________________________________________________________________
 int
-xenbus_watch(
-	     xenbus_transaction_t xbt,            ///< transaction ID
-	     const char *path                     ///< path in XenStore
-	     )
+xenbus_watch_register(
+		      XenbusWatch *watch,              ///< watch to register
+		      const char *path                 ///< path in XenStore
+		      )
 {
-    xs_message_t *rep;
+    ulong flags;
+    int status = StatusOk;
+
+    C_ASSERT(sizeof(watch->token) > 2 * sizeof(ulong) + 1);
+    watch->path      = path;
+    watch->pending   = false;
+    watch->events    = 0;
+    watch->coalesced = 0;
+    watch->eventPath[0] = '\0';
+    watch->eventPath[sizeof(watch->eventPath) - 1] = '\0';
+    watch->queue.head = watch->queue.tail = NULL;
+    watch->queue.generation = 0;
+    watch->work.function = xenbus_watch_run;
+    watch->work.arg      = watch;
+    watch->work.queued   = false;
+    watch->work.runs     = 0;
+
+    // in the table first, xenstored fires the watch once at registration
+    local_irq_save(flags);
+    xenbus_watch_token(watch->token, ++watchTokens);
+    XenbusWatch **bucket = &watchBuckets[xenbus_hash(watch->token) % XENBUS_WATCH_BUCKETS];
+    watch->next = *bucket;
+    *bucket     = watch;
+    local_irq_restore(flags);
+
     xs_write_req_t req[] =
 	{
 	    { path, strlen(path) + 1 },
-	    { "0", 2 }
+	    { watch->token, strlen(watch->token) + 1 }
 	};
+    xs_message_t *rep = xenbus_msg_reply(XS_WATCH, XBT_NIL, req, ARRAY_SIZE(req));
+    if (rep->type == XS_ERROR)
+	{
+	    status = xenbus_error((char*) (rep + 1));
+	    xenbus_reply_release(rep);
+	    xenbus_watch_unregister(watch);
+	    return status;
+	}
+    xenbus_reply_release(rep);
+    return status;
+}
+
+//______________________________________________________________________________
+/// Remove watch, events for it are dropped from now on.  A watch with a
+/// callback may still have it queued, and must stay put until it has run.
+//______________________________________________________________________________
+int
+xenbus_watch_unregister(XenbusWatch *watch      ///< registered watch
+			)
+{
+    ulong flags;
     int status = StatusOk;
-    rep = xenbus_msg_reply(XS_WATCH, xbt, req, ARRAY_SIZE(req));
+
+    local_irq_save(flags);
+    XenbusWatch **w = &watchBuckets[xenbus_hash(watch->token) % XENBUS_WATCH_BUCKETS];
+    while (*w && *w != watch)
+	{
+	    w = &(*w)->next;
+	}
+    if (!*w)
+	{
+	    local_irq_restore(flags);
+	    return StatusNotFound;
+	}
+    *w = watch->next;
+    watch->pending = false;
+    local_irq_restore(flags);
+
+    xs_write_req_t req[] =
+	{
+	    { watch->path, strlen(watch->path) + 1 },
+	    { watch->token, strlen(watch->token) + 1 }
+	};
+    xs_message_t *rep = xenbus_msg_reply(XS_UNWATCH, XBT_NIL, req, ARRAY_SIZE(req));
     if (rep->type == XS_ERROR)
 	{
 	    status = xenbus_error((char*) (rep + 1));
-	    goto done;
 	}
+    xenbus_reply_release(rep);
+    return status;
+}
+
+//______________________________________________________________________________
+/// Block until watch has an event pending, and take it.  Not for use
+/// inside a kernel task, nor on a watch with a callback.
+//______________________________________________________________________________
+void
+xenbus_watch_wait(XenbusWatch *watch      ///< registered watch
+		  )
+{
+    ASSERT(!watch->callback);
+    WAIT_EVENT(&watch->queue, watch->pending);
+    watch->pending = false;
+}
+
+//______________________________________________________________________________
+/// Watch a xenbus path.
+/// Returns when path node becomes available.
+//______________________________________________________________________________
+int
+xenbus_watch(
+	     xenbus_transaction_t xbt,            ///< transaction ID
+	     const char *path                     ///< path in XenStore
+	     )
+{
+    XenbusWatch watch = { .callback = NULL };
+    int status = xenbus_watch_register(&watch, path);
+    REQUIRE_OK(status);
+
     for(;;)
 	{
 	    char *output = NULL;
 
 	    // Sit waiting for the watch to come in...
-	    while (xenbus_watch_state == NOT_SIGNALLED)
-		{
-		    archKernelBlock();
-		    rmb();
-		}
-	    xenbus_watch_state = NOT_SIGNALLED;
+	    xenbus_watch_wait(&watch);
 
 	    // Read and compare values.
 	    status = xenbus_read(XBT_NIL, path, &output);
@@ -697,8 +1376,7 @@ xenbus_watch(
 		}
 	}
 
- done:
-    xfree(rep);
+    (void) xenbus_watch_unregister(&watch);
     return status;
 }
 
@@ -713,31 +1391,17 @@ xenbus_watch_value(
 		   const char *value            ///< value on which to return
 		   )
 {
-    xs_message_t *rep;
-    xs_write_req_t req[] =
-	{
-	    { path, strlen(path) + 1 },
-	    { "0", 2 }
-	};
-    int status = StatusOk;
-    rep = xenbus_msg_reply(XS_WATCH, xbt, req, ARRAY_SIZE(req));
-    if (rep->type == XS_ERROR)
-	{
-	    status = xenbus_error((char*) (rep + 1));
-	    goto done;
-	}
+    XenbusWatch watch = { .callback = NULL };
+    int status = xenbus_watch_register(&watch, path);
+    REQUIRE_OK(status);
+
     for (;;)
 	{
 	    int c;
 	    char *output = NULL;
 
 	    // Sit waiting for the watch to come in...
-	    while (xenbus_watch_state == NOT_SIGNALLED)
-		{
-		    archKernelBlock();
-		    rmb();
-		}
-	    xenbus_watch_state = NOT_SIGNALLED;
+	    xenbus_watch_wait(&watch);
 
 	    // Read and compare values.
 	    status = xenbus_read(XBT_NIL, path, &output);
@@ -754,18 +1418,293 @@ xenbus_watch_value(
 	}
 
     // Once we're done, destroy the watch
-    rep = xenbus_msg_reply(XS_UNWATCH, xbt, req, ARRAY_SIZE(req));
-    if (rep->type == XS_ERROR)
+    return xenbus_watch_unregister(&watch);
+}
+
+//______________________________________________________________________________
+/// Start reading path.  request must stay put until it is done; its
+/// callback, if any, then runs from the event handler with events masked.
+//______________________________________________________________________________
+void
+xenbus_read_submit(
+		   XenbusRequest *request,          ///< request to complete
+		   xenbus_transaction_t xbt,        ///< transaction ID
+		   const char *path                 ///< path in XenStore
+		   )
+{
+    xs_write_req_t req[] = { { path, strlen(path) + 1 } };
+    xenbus_submit(request, XS_READ, xbt, req, ARRAY_SIZE(req));
+}
+
+//______________________________________________________________________________
+/// Start writing value to path, as xenbus_read_submit.
+//______________________________________________________________________________
+void
+xenbus_write_submit(
+		    XenbusRequest *request,         ///< request to complete
+		    xenbus_transaction_t xbt,       ///< transaction ID
+		    const char *path,               ///< path in XenStore
+		    const char *value               ///< value to write
+		    )
+{
+    xs_write_req_t req[] =
 	{
-	    status = xenbus_error((char*) (rep + 1));
-	    goto done;
+	    { path, strlen(path) + 1 },
+	    { value, strlen(value)}
+	};
+    xenbus_cache_invalidate(path);
+    xenbus_submit(request, XS_WRITE, xbt, req, ARRAY_SIZE(req));
+}
+
+//______________________________________________________________________________
+/// Requests submitted until xenbus_submit_end go to xenstored with
+/// one notification.
+//______________________________________________________________________________
+void
+xenbus_submit_begin(void)
+{
+    xenEventNotifyBegin();
+}
+
+//______________________________________________________________________________
+/// End a batch of submissions, notifying xenstored.
+//______________________________________________________________________________
+void
+xenbus_submit_end(void)
+{
+    xenbus_statistics.batches++;
+    xenEventNotifyEnd();
+}
+
+//______________________________________________________________________________
+/// Block until request is done.  Not for use inside a kernel task, which
+/// should sleep on a wait queue its callback wakes.
+//______________________________________________________________________________
+void
+xenbus_request_wait(XenbusRequest *request)
+{
+    WAIT_EVENT(&replyQueue, request->done);
+}
+
+//______________________________________________________________________________
+/// Result of a done request, releasing its reply.  For reads, value is
+/// set to the value read, to be freed by xfree by the caller iff the
+/// status equals StatusOk; value may be NULL to discard it.
+//______________________________________________________________________________
+int
+xenbus_request_value(
+		     XenbusRequest *request,        ///< done request
+		     char **value                   ///< value returned, or NULL
+		     )
+{
+    xs_message_t *reply = request->reply;
+    int status = StatusOk;
+
+    ASSERT(request->done && reply);
+    if (reply->type == XS_ERROR)
+	{
+	    status = xenbus_error((char*) (reply + 1));
+	}
+    else if (value)
+	{
+	    char *res = xalloc(charXtype, reply->len + 1);
+	    memcpy(res, reply + 1, reply->len);
+	    res[reply->len] = 0;
+	    *value = res;
 	}
+    xenbus_reply_release(reply);
+    request->reply = NULL;
+    return status;
+}
 
- done:
-    xfree(rep);
+//______________________________________________________________________________
+/// Read count paths with all the requests in flight at once, so the
+/// time taken is bounded by ring throughput rather than round trips.
+/// Returns the first failing status, values[i] is set where statuses[i]
+/// equals StatusOk.
+//______________________________________________________________________________
+int
+xenbus_read_many(
+		 xenbus_transaction_t xbt,          ///< transaction ID
+		 const char **paths,                ///< paths in XenStore
+		 uint count,                        ///< number of paths
+		 char **values,                     ///< values returned
+		 int *statuses                      ///< status of each read
+		 )
+{
+    XenbusRequest *requests = xalloc(charXtype, count * sizeof(XenbusRequest));
+    int status = StatusOk;
+    uint i;
+
+    if (!requests)
+	{
+	    return StatusNoMemory;
+	}
+
+    xenbus_submit_begin();
+    for (i = 0; i < count; i++)
+	{
+	    // copied out: replies waiting their turn would pin the ring
+	    requests[i].callback = NULL;
+	    requests[i].arg      = NULL;
+	    requests[i].borrow   = false;
+	    xenbus_read_submit(&requests[i], xbt, paths[i]);
+	}
+    xenbus_submit_end();
+
+    for (i = 0; i < count; i++)
+	{
+	    xenbus_request_wait(&requests[i]);
+	    statuses[i] = xenbus_request_value(&requests[i], &values[i]);
+	    if (statuses[i] != StatusOk && status == StatusOk)
+		{
+		    status = statuses[i];
+		}
+	}
+
+    xfree(requests);
     return status;
 }
 
+//______________________________________________________________________________
+/// print pipelining counters
+//______________________________________________________________________________
+void
+xenbus_statistics_print(void)
+{
+    xenbus_statistics_t *s = &xenbus_statistics;
+
+    xprintLog("xenstore: submitted $[ulong] completed $[ulong] in flight max $[ulong]\n",
+	      s->submitted, s->completed, s->inFlightMax);
+    xprintLog("xenstore: backlogged $[ulong] batches $[ulong] replies in ring $[ulong] copied $[ulong]\n",
+	      s->backlogged, s->batches, s->borrowed, s->copied);
+    xprintLog("xenstore: watch events $[ulong] coalesced $[ulong] unknown token $[ulong]\n",
+	      s->watchEvents, s->watchCoalesced, s->watchUnknown);
+    xprintLog("xenstore: cache hits $[ulong] misses $[ulong] entries $[uint] invalidations $[ulong] evictions $[ulong] watches $[ulong]\n",
+	      s->cacheHits, s->cacheMisses, cacheCount, s->cacheInvalidations,
+	      s->cacheEvictions, s->cacheWatches);
+}
+
+//______________________________________________________________________________
+// Probe benchmark: reads the same keys one round trip at a time, then all
+// in flight at once, from a kernel task, and prints the cycles each took.
+//______________________________________________________________________________
+
+#define BENCH_READS 32
+
+enum { BENCH_START, BENCH_SERIAL, BENCH_PIPELINED };
+
+static const char *benchKeys[] =
+    {
+	"domid", "name", "vm", "memory/target",
+	"console/port", "console/ring-ref", "cpu/0/availability", "device"
+    };
+
+static XenbusRequest  benchRequests[BENCH_READS];
+static volatile uint  benchCompleted;
+static uint           benchExpected;
+static uint           benchIssued;
+static uint64         benchStart;
+static uint64         benchSerial;
+static WaitQueue      benchQueue = WAIT_QUEUE_INIT;
+
+//______________________________________________________________________________
+/// completion callback, wakes the task once what it waits for is in
+//______________________________________________________________________________
+static void
+_benchDone(XenbusRequest *request)
+{
+    if (++benchCompleted == benchExpected)
+	{
+	    waitQueueWake(&benchQueue);
+	}
+}
+
+//______________________________________________________________________________
+/// release the benchmark's replies
+//______________________________________________________________________________
+static void
+_benchRelease(void)
+{
+    uint i;
+    for (i = 0; i < BENCH_READS; i++)
+	{
+	    if (benchRequests[i].reply)
+		{
+		    (void) xenbus_request_value(&benchRequests[i], NULL);
+		}
+	}
+}
+
+//______________________________________________________________________________
+/// benchmark task.  It sleeps before submitting, so that a reply which
+/// comes in at once still finds it on the queue to wake.
+//______________________________________________________________________________
+static bool
+_benchStep(KernelTask *task)
+{
+    uint i;
+
+    switch (task->state)
+	{
+	case BENCH_START:
+	    benchIssued = benchCompleted = 0;
+	    benchStart  = getTsc();
+	    task->state = BENCH_SERIAL;
+	    // fall through
+	case BENCH_SERIAL:
+	    if (benchIssued < BENCH_READS)
+		{
+		    benchExpected = benchIssued + 1;
+		    kernelTaskSleep(&benchQueue, task);
+		    benchRequests[benchIssued].callback = _benchDone;
+		    xenbus_read_submit(&benchRequests[benchIssued], XBT_NIL,
+				       benchKeys[benchIssued % ARRAY_SIZE(benchKeys)]);
+		    benchIssued++;
+		    return true;
+		}
+	    benchSerial = getTsc() - benchStart;
+	    _benchRelease();
+
+	    benchCompleted = 0;
+	    benchExpected  = BENCH_READS;
+	    benchStart     = getTsc();
+	    kernelTaskSleep(&benchQueue, task);
+	    xenbus_submit_begin();
+	    for (i = 0; i < BENCH_READS; i++)
+		{
+		    xenbus_read_submit(&benchRequests[i], XBT_NIL,
+				       benchKeys[i % ARRAY_SIZE(benchKeys)]);
+		}
+	    xenbus_submit_end();
+	    task->state = BENCH_PIPELINED;
+	    return true;
+	case BENCH_PIPELINED:
+	    xprintLog("xenstore: $[uint] reads, one at a time $[ulong] cycles, pipelined $[ulong] cycles\n",
+		      BENCH_READS, (ulong) benchSerial, (ulong) (getTsc() - benchStart));
+	    _benchRelease();
+	    task->state = BENCH_START;
+	    break;
+	}
+    return false;
+}
+
+static KernelTask benchTask = KERNEL_TASK(_benchStep, NULL);
+
+//______________________________________________________________________________
+/// start the probe benchmark, unless it is already running
+//______________________________________________________________________________
+void
+xenbus_benchmark_start(void)
+{
+    if (benchTask.queued || benchTask.state != BENCH_START)
+	{
+	    xprintLog("xenstore: benchmark already running\n");
+	    return;
+	}
+    kernelTaskStart(&benchTask);
+}
+
 //______________________________________________________________________________
 /// Initializes xenbus code.
 //______________________________________________________________________________
@@ -775,6 +1714,7 @@ xenbus_init(void)
     int rc = handleTableInit(&reqIds);
     BUG_ON(rc != StatusOk);
     xs_iface = (void*) mfnToVirtual(start_info.store_mfn);
+    rspSeen  = xs_iface->rsp_cons;
 
     // Register the event handler for xenstore.
     int evtchan = xenEventBind(start_info.store_evtchn, &xenbus_event, NULL);